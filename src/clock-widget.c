@@ -4,13 +4,15 @@
 #include <math.h>
 #include <poll.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
+#include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "shm-pool.h"
 #include "wlr-layer-shell-unstable-v1-client-protocol.h"
 #include <wayland-client.h>
 
@@ -31,6 +33,7 @@ typedef struct {
   int font_size;
   int corner_radius;
   int padding;
+  int antialias;
 } Config;
 
 static struct wl_display *display = NULL;
@@ -39,7 +42,7 @@ static struct wl_shm *wl_shm = NULL;
 static struct zwlr_layer_shell_v1 *layer_shell = NULL;
 static struct wl_surface *surface = NULL;
 static struct zwlr_layer_surface_v1 *layer_surface = NULL;
-static struct wl_buffer *buffer = NULL;
+static ShmPool pool; // Double buffered, reused every tick
 static struct wl_callback *frame_callback = NULL;
 static volatile sig_atomic_t running = 1;
 static volatile sig_atomic_t should_exit = 0;
@@ -47,13 +50,70 @@ static int configured = 0;
 static int needs_redraw = 1;
 static time_t last_drawn_time = 0;
 static int display_fd = -1;
+static int tick_fd = -1; // Fires on every second (or minute) boundary
+static volatile sig_atomic_t dump_log = 0;
+
+// Logging
+// Errors and info go to stderr. Debug messages (per frame and per tick)
+// only reach stderr with --debug; otherwise they are kept in memory and
+// written out on SIGUSR1, so the steady state makes no write calls. Build
+// with -DLOG_MAX_LEVEL=LOG_INFO to compile them out entirely.
+enum { LOG_ERROR, LOG_INFO, LOG_DEBUG };
+
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_DEBUG
+#endif
+
+#define LOG_RING_LINES 64
+#define LOG_LINE_SIZE 128
+
+static int log_level = LOG_INFO; // Highest level written to stderr
+static char log_ring[LOG_RING_LINES][LOG_LINE_SIZE];
+static unsigned int log_head = 0; // Lines logged so far
+
+__attribute__((format(printf, 2, 3))) static void
+log_write(int level, const char *fmt, ...) {
+  static const char *prefix[] = {"error: ", "", "debug: "};
+  char *line = log_ring[log_head++ % LOG_RING_LINES];
+  int len = snprintf(line, LOG_LINE_SIZE, "%s", prefix[level]);
+
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(line + len, LOG_LINE_SIZE - len, fmt, args);
+  va_end(args);
+
+  if (level <= log_level)
+    fprintf(stderr, "%s\n", line);
+}
+
+#define log_error(...) log_write(LOG_ERROR, __VA_ARGS__)
+#define log_info(...) log_write(LOG_INFO, __VA_ARGS__)
+#define log_debug(...)                                                         \
+  do {                                                                         \
+    if (LOG_DEBUG <= LOG_MAX_LEVEL)                                            \
+      log_write(LOG_DEBUG, __VA_ARGS__);                                       \
+  } while (0)
+
+// Write out the last LOG_RING_LINES messages
+static void log_dump(void) {
+  unsigned int first =
+      log_head > LOG_RING_LINES ? log_head - LOG_RING_LINES : 0;
+  fprintf(stderr, "--- last %u log messages ---\n", log_head - first);
+  for (unsigned int i = first; i < log_head; i++)
+    fprintf(stderr, "%s\n", log_ring[i % LOG_RING_LINES]);
+  fprintf(stderr, "---\n");
+}
+
+static void dump_log_handler(int signo) {
+  (void)signo;
+  dump_log = 1;
+}
 
-// Signal handler function
+// Signal handler function. Only sets flags, the main loop logs the exit.
 static void signal_handler(int signo) {
   (void)signo;
   should_exit = 1;
   running = 0;
-  fprintf(stderr, "Signal received, exiting...\n");
 }
 
 static Config config = {.width = 180,
@@ -74,176 +134,268 @@ static Config config = {.width = 180,
                         .corner_radius = 15,
                         .padding = 12};
 
-// 7-segment digit
-void draw_digit(uint32_t *pixels, char digit, int x, int y, int width,
-                int height, uint32_t color) {
-  if (digit < '0' || digit > '9')
-    return;
+// Glyphs
+// Digits, the colon and the date glyphs are rasterized once per font size
+// and color into coverage masks, then blitted row by row: runs of full
+// coverage are copied from a row of solid color and edges are blended.
+typedef struct {
+  int width, height;
+  unsigned char *coverage; // 0 (empty) to 255 (solid), row by row
+} Glyph;
 
-  int segments[10][7] = {
-      {1, 1, 1, 1, 1, 1, 0}, // 0
-      {0, 1, 1, 0, 0, 0, 0}, // 1
-      {1, 1, 0, 1, 1, 0, 1}, // 2
-      {1, 1, 1, 1, 0, 0, 1}, // 3
-      {0, 1, 1, 0, 0, 1, 1}, // 4
-      {1, 0, 1, 1, 0, 1, 1}, // 5
-      {1, 0, 1, 1, 1, 1, 1}, // 6
-      {1, 1, 1, 0, 0, 0, 0}, // 7
-      {1, 1, 1, 1, 1, 1, 1}, // 8
-      {1, 1, 1, 1, 0, 1, 1}  // 9
-  };
+// Date glyph shapes: a box, a box with a middle bar (A, E, I, O) and a box
+// with two inner verticals (M, W)
+enum { DATE_BOX, DATE_BAR, DATE_MW, DATE_SHAPES };
 
-  int *seg = segments[digit - '0'];
-  int thickness = width / 7;
-  if (thickness < 2)
-    thickness = 2;
-
-  int seg_length = width - thickness * 2;
-
-  // Segment positions (relative to digit bounds)
-  // a: top horizontal
-  if (seg[0]) {
-    for (int i = 0; i < thickness; i++) {
-      for (int px = x + thickness; px < x + width - thickness; px++) {
-        int py = y + i;
-        if (px >= 0 && px < config.width && py >= 0 && py < config.height) {
-          pixels[py * config.width + px] = color;
-        }
-      }
-    }
-  }
+typedef struct {
+  int font_size;
+  uint32_t color;
+  uint32_t *solid; // color, as wide as the widest glyph
+  Glyph digits[10];
+  Glyph colon; // Both dots
+  Glyph date[DATE_SHAPES];
+} GlyphAtlas;
+
+static GlyphAtlas time_glyphs; // At config.font_size
+static GlyphAtlas date_glyphs; // At the smaller date size
+
+// Samples per pixel along each axis when anti-aliasing
+#define AA_SAMPLES 4
+
+// Segments lit for each digit: a (top), b, c (right), d (bottom), e, f
+// (left), g (middle)
+static const unsigned char segments[10][7] = {
+    {1, 1, 1, 1, 1, 1, 0}, // 0
+    {0, 1, 1, 0, 0, 0, 0}, // 1
+    {1, 1, 0, 1, 1, 0, 1}, // 2
+    {1, 1, 1, 1, 0, 0, 1}, // 3
+    {0, 1, 1, 0, 0, 1, 1}, // 4
+    {1, 0, 1, 1, 0, 1, 1}, // 5
+    {1, 0, 1, 1, 1, 1, 1}, // 6
+    {1, 1, 1, 0, 0, 0, 0}, // 7
+    {1, 1, 1, 1, 1, 1, 1}, // 8
+    {1, 1, 1, 1, 0, 1, 1}  // 9
+};
 
-  // b: top-right vertical
-  if (seg[1]) {
-    for (int i = 0; i < thickness; i++) {
-      for (int py = y + thickness; py < y + height / 2 - thickness / 2; py++) {
-        int px = x + width - thickness + i;
-        if (px >= 0 && px < config.width && py >= 0 && py < config.height) {
-          pixels[py * config.width + px] = color;
-        }
-      }
-    }
-  }
+// A 7-segment digit filling width x height, with segments t thick and the
+// middle one starting at row m
+typedef struct {
+  const unsigned char *seg;
+  float width, height, t, m;
+} DigitShape;
+
+static int digit_covers(const void *shape, float x, float y) {
+  const DigitShape *d = shape;
+  const unsigned char *seg = d->seg;
+  float w = d->width, h = d->height, t = d->t, m = d->m;
+  int across = x >= t && x < w - t;
+  int left = x < t;
+  int right = x >= w - t;
+  int upper = y >= t && y < m;
+  int lower = y >= m && y < h - t;
+
+  return (seg[0] && across && y < t) || (seg[1] && right && upper) ||
+         (seg[2] && right && lower) || (seg[3] && across && y >= h - t) ||
+         (seg[4] && left && lower) || (seg[5] && left && upper) ||
+         (seg[6] && across && y >= m && y < m + t);
+}
 
-  // c: bottom-right vertical
-  if (seg[2]) {
-    for (int i = 0; i < thickness; i++) {
-      for (int py = y + height / 2 - thickness / 2; py < y + height - thickness;
-           py++) {
-        int px = x + width - thickness + i;
-        if (px >= 0 && px < config.width && py >= 0 && py < config.height) {
-          pixels[py * config.width + px] = color;
-        }
-      }
-    }
-  }
+// Two dots of radius r, centered on pixel (r, r) and gap rows below it
+typedef struct {
+  int r, gap;
+} ColonShape;
+
+static int colon_covers(const void *shape, float x, float y) {
+  const ColonShape *c = shape;
+  float dx = x - 0.5f - c->r;
+  float dy_top = y - 0.5f - c->r;
+  float dy_bottom = dy_top - c->gap;
+  float r2 = (float)(c->r * c->r);
+  return dx * dx + dy_top * dy_top <= r2 ||
+         dx * dx + dy_bottom * dy_bottom <= r2;
+}
 
-  // d: bottom horizontal
-  if (seg[3]) {
-    for (int i = 0; i < thickness; i++) {
-      for (int px = x + thickness; px < x + width - thickness; px++) {
-        int py = y + height - thickness + i;
-        if (px >= 0 && px < config.width && py >= 0 && py < config.height) {
-          pixels[py * config.width + px] = color;
-        }
-      }
-    }
-  }
+// A date character: an outline box, open at the middle row, which holds
+// the bar of A, E, I and O instead
+typedef struct {
+  int kind, width, height;
+} DateShape;
+
+static int date_covers(const void *shape, float x, float y) {
+  const DateShape *d = shape;
+  int cx = (int)x, cy = (int)y;
+  int inner = cx > 0 && cx < d->width - 1;
+
+  if (cy == 0 || cy == d->height - 1)
+    return inner;
+  if (cy == d->height / 2)
+    return d->kind == DATE_BAR && inner;
+  if (cx == 0 || cx == d->width - 1)
+    return 1;
+  return d->kind == DATE_MW && (cx == d->width / 4 || cx == 3 * d->width / 4);
+}
 
-  // e: bottom-left vertical
-  if (seg[4]) {
-    for (int i = 0; i < thickness; i++) {
-      for (int py = y + height / 2 - thickness / 2; py < y + height - thickness;
-           py++) {
-        int px = x + i;
-        if (px >= 0 && px < config.width && py >= 0 && py < config.height) {
-          pixels[py * config.width + px] = color;
-        }
-      }
-    }
-  }
+static int date_shape(char c) {
+  int upper = toupper((unsigned char)c);
+  if (strchr("AEIO", upper))
+    return DATE_BAR;
+  if (upper == 'M' || upper == 'W')
+    return DATE_MW;
+  return DATE_BOX;
+}
 
-  // f: top-left vertical
-  if (seg[5]) {
-    for (int i = 0; i < thickness; i++) {
-      for (int py = y + thickness; py < y + height / 2 - thickness / 2; py++) {
-        int px = x + i;
-        if (px >= 0 && px < config.width && py >= 0 && py < config.height) {
-          pixels[py * config.width + px] = color;
+// Fill a width x height glyph with the coverage of shape
+static int rasterize(Glyph *glyph, int width, int height,
+                     int (*covers)(const void *, float, float),
+                     const void *shape) {
+  int samples = config.antialias ? AA_SAMPLES : 1;
+
+  glyph->width = width > 0 ? width : 0;
+  glyph->height = height > 0 ? height : 0;
+  glyph->coverage = calloc((size_t)glyph->width * glyph->height + 1, 1);
+  if (!glyph->coverage)
+    return -1;
+
+  for (int y = 0; y < glyph->height; y++) {
+    for (int x = 0; x < glyph->width; x++) {
+      int hits = 0;
+      for (int sy = 0; sy < samples; sy++) {
+        for (int sx = 0; sx < samples; sx++) {
+          hits += covers(shape, x + (sx + 0.5f) / samples,
+                         y + (sy + 0.5f) / samples);
         }
       }
+      glyph->coverage[y * glyph->width + x] =
+          hits * 255 / (samples * samples);
     }
   }
+  return 0;
+}
 
-  // g: middle horizontal
-  if (seg[6]) {
-    for (int i = 0; i < thickness; i++) {
-      for (int px = x + thickness; px < x + width - thickness; px++) {
-        int py = y + height / 2 - thickness / 2 + i;
-        if (px >= 0 && px < config.width && py >= 0 && py < config.height) {
-          pixels[py * config.width + px] = color;
-        }
-      }
-    }
-  }
+static void atlas_finish(GlyphAtlas *atlas) {
+  for (int i = 0; i < 10; i++)
+    free(atlas->digits[i].coverage);
+  for (int i = 0; i < DATE_SHAPES; i++)
+    free(atlas->date[i].coverage);
+  free(atlas->colon.coverage);
+  free(atlas->solid);
+  memset(atlas, 0, sizeof(*atlas));
 }
 
-void draw_colon(uint32_t *pixels, int x, int y, int size, uint32_t color) {
+// Rasterize every glyph at font_size. Returns -1 if out of memory.
+static int atlas_init(GlyphAtlas *atlas, int font_size, uint32_t color) {
+  memset(atlas, 0, sizeof(*atlas));
+  atlas->font_size = font_size;
+  atlas->color = color;
+
+  // Digits are font_size wide and twice as tall. Anti-aliased segments keep
+  // their exact fractional thickness rather than snapping to pixels.
+  int width = font_size;
+  int height = font_size * 2;
+  DigitShape digit = {.width = width, .height = height};
+  if (config.antialias) {
+    digit.t = width / 7.0f;
+    if (digit.t < 2)
+      digit.t = 2;
+    digit.m = height / 2.0f - digit.t / 2;
+  } else {
+    int thickness = width / 7;
+    if (thickness < 2)
+      thickness = 2;
+    digit.t = thickness;
+    digit.m = height / 2 - thickness / 2;
+  }
+  for (int i = 0; i < 10; i++) {
+    digit.seg = segments[i];
+    if (rasterize(&atlas->digits[i], width, height, digit_covers, &digit) < 0)
+      goto fail;
+  }
+
+  // The colon is half a digit wide
+  int size = font_size / 2;
   int dot_size = size / 4;
   if (dot_size < 3)
     dot_size = 3;
+  ColonShape colon = {.r = dot_size / 2, .gap = size / 3 / 2 * 2};
+  if (rasterize(&atlas->colon, colon.r * 2 + 1, colon.r * 2 + 1 + colon.gap,
+                colon_covers, &colon) < 0)
+    goto fail;
+
+  for (int i = 0; i < DATE_SHAPES; i++) {
+    DateShape date = {.kind = i, .width = font_size / 2, .height = font_size};
+    if (rasterize(&atlas->date[i], date.width, date.height, date_covers,
+                  &date) < 0)
+      goto fail;
+  }
 
-  int spacing = size / 3;
+  int solid_width = width > atlas->colon.width ? width : atlas->colon.width;
+  atlas->solid = malloc((size_t)solid_width * sizeof(uint32_t) + 1);
+  if (!atlas->solid)
+    goto fail;
+  for (int i = 0; i < solid_width; i++)
+    atlas->solid[i] = color;
+  return 0;
 
-  // Top dot
-  for (int dy = -dot_size / 2; dy <= dot_size / 2; dy++) {
-    for (int dx = -dot_size / 2; dx <= dot_size / 2; dx++) {
-      int px = x + dx;
-      int py = y - spacing / 2 + dy;
-      if (px >= 0 && px < config.width && py >= 0 && py < config.height) {
-        if (dx * dx + dy * dy <= (dot_size / 2) * (dot_size / 2)) {
-          pixels[py * config.width + px] = color;
-        }
-      }
-    }
+fail:
+  atlas_finish(atlas);
+  return -1;
+}
+
+// Mix src over dst by alpha (0-255), channel by channel
+static uint32_t blend(uint32_t dst, uint32_t src, unsigned int alpha) {
+  uint32_t out = 0;
+  for (int shift = 0; shift < 32; shift += 8) {
+    unsigned int d = (dst >> shift) & 0xff;
+    unsigned int s = (src >> shift) & 0xff;
+    out |= ((d * (255 - alpha) + s * alpha + 127) / 255) << shift;
   }
+  return out;
+}
 
-  // Bottom dot
-  for (int dy = -dot_size / 2; dy <= dot_size / 2; dy++) {
-    for (int dx = -dot_size / 2; dx <= dot_size / 2; dx++) {
-      int px = x + dx;
-      int py = y + spacing / 2 + dy;
-      if (px >= 0 && px < config.width && py >= 0 && py < config.height) {
-        if (dx * dx + dy * dy <= (dot_size / 2) * (dot_size / 2)) {
-          pixels[py * config.width + px] = color;
-        }
+// Draw glyph with its top-left corner at (x, y), clipped to the widget
+static void blit_glyph(uint32_t *pixels, const GlyphAtlas *atlas,
+                       const Glyph *glyph, int x, int y) {
+  int x0 = x < 0 ? -x : 0;
+  int y0 = y < 0 ? -y : 0;
+  int x1 = x + glyph->width > config.width ? config.width - x : glyph->width;
+  int y1 =
+      y + glyph->height > config.height ? config.height - y : glyph->height;
+
+  for (int gy = y0; gy < y1; gy++) {
+    const unsigned char *coverage = glyph->coverage + gy * glyph->width;
+    uint32_t *row = pixels + (y + gy) * config.width + x;
+    for (int gx = x0; gx < x1;) {
+      if (coverage[gx] == 255) {
+        int end = gx + 1;
+        while (end < x1 && coverage[end] == 255)
+          end++;
+        memcpy(row + gx, atlas->solid, (end - gx) * sizeof(uint32_t));
+        gx = end;
+      } else {
+        if (coverage[gx])
+          row[gx] = blend(row[gx], atlas->color, coverage[gx]);
+        gx++;
       }
     }
   }
 }
 
-void draw_time(uint32_t *pixels, const char *time_str, int x, int y) {
-  int digit_width = config.font_size;
-  int digit_height = config.font_size * 2;
-  int spacing = digit_width / 3;
-  int colon_spacing = digit_width / 4;
+// 7-segment digit with its top-left corner at (x, y)
+void draw_digit(uint32_t *pixels, char digit, int x, int y) {
+  if (digit < '0' || digit > '9')
+    return;
+  blit_glyph(pixels, &time_glyphs, &time_glyphs.digits[digit - '0'], x, y);
+}
 
-  for (int i = 0; time_str[i]; i++) {
-    if (time_str[i] == ':') {
-      draw_colon(pixels, x + colon_spacing / 2, y + digit_height / 2,
-                 digit_width / 2, config.text_color);
-      x += colon_spacing * 2;
-    } else if (isdigit(time_str[i])) {
-      draw_digit(pixels, time_str[i], x, y, digit_width, digit_height,
-                 config.text_color);
-      x += digit_width + spacing;
-    }
-  }
+// Colon centered on (x, y)
+void draw_colon(uint32_t *pixels, int x, int y) {
+  const Glyph *colon = &time_glyphs.colon;
+  blit_glyph(pixels, &time_glyphs, colon, x - colon->width / 2,
+             y - colon->height / 2);
 }
 
 void draw_date(uint32_t *pixels, const char *date_str, int x, int y) {
-  int char_width = config.font_size / 2;
-  int char_height = config.font_size;
+  int char_width = date_glyphs.font_size / 2;
 
   for (int i = 0; date_str[i]; i++) {
     char c = date_str[i];
@@ -254,40 +406,7 @@ void draw_date(uint32_t *pixels, const char *date_str, int x, int y) {
       continue;
     }
 
-    // Draw character
-    for (int cy = 0; cy < char_height; cy++) {
-      for (int cx = 0; cx < char_width; cx++) {
-        int draw_pixel = 0;
-
-        // Border
-        if (cy == 0 || cy == char_height - 1) {
-          if (cx > 0 && cx < char_width - 1)
-            draw_pixel = 1;
-        }
-        // Middle bar for some letters
-        else if (cy == char_height / 2) {
-          if (strchr("AEIO", toupper(c)) && cx > 0 && cx < char_width - 1)
-            draw_pixel = 1;
-        }
-        // Vertical bars
-        else if (cx == 0 || cx == char_width - 1) {
-          draw_pixel = 1;
-        }
-        // For 'M' and 'W'
-        else if ((toupper(c) == 'M' || toupper(c) == 'W') &&
-                 (cx == char_width / 4 || cx == 3 * char_width / 4)) {
-          draw_pixel = 1;
-        }
-
-        if (draw_pixel) {
-          int px = x + cx;
-          int py = y + cy;
-          if (px >= 0 && px < config.width && py >= 0 && py < config.height) {
-            pixels[py * config.width + px] = config.text_color;
-          }
-        }
-      }
-    }
+    blit_glyph(pixels, &date_glyphs, &date_glyphs.date[date_shape(c)], x, y);
 
     if (isdigit(c)) {
       x += char_width + 2;
@@ -387,60 +506,58 @@ void get_time_and_date(char *time_buf, size_t time_size, char *date_buf,
   }
 }
 
-// Create shared memory buffer
-static struct wl_buffer *create_buffer(void) {
-  int stride = config.width * 4;
-  int size = stride * config.height;
-
-  char template[] = "/tmp/clock-widget-shm-XXXXXX";
-  int fd = mkstemp(template);
-  if (fd < 0) {
-    fprintf(stderr, "Failed to create shm file\n");
-    return NULL;
-  }
-
-  unlink(template);
-  if (ftruncate(fd, size) < 0) {
-    fprintf(stderr, "Failed to truncate shm file\n");
-    close(fd);
-    return NULL;
-  }
-
-  uint32_t *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-  if (data == MAP_FAILED) {
-    fprintf(stderr, "Failed to mmap shm file\n");
-    close(fd);
-    return NULL;
-  }
-
-  // Clear to transparent
-  for (int i = 0; i < config.width * config.height; i++) {
-    data[i] = 0x00000000;
-  }
-
-  // Draw rounded rectangle background
-  draw_rounded_rect(data, config.bg_color);
+// Layout
+// The widget is redrawn incrementally: the background and the time colons
+// are painted once, and each tick only the digits that changed are copied
+// back from the background and drawn again.
+typedef struct {
+  int x, y, width, height;
+} Rect;
 
-  // Get time and date
-  char time_str[32];
-  char date_str[32];
-   get_time_and_date(time_str, sizeof(time_str), date_str, sizeof(date_str));
+static uint32_t *background = NULL; // Static parts of the widget
+static Rect time_cells[16];         // Where each time character goes
+static int time_len = 0;
+static Rect date_band; // Rows the date line is drawn in
 
-  // Calculate positions with padding
+// What a pooled buffer currently shows. Buffers are reused in turn, so one
+// can be a frame or two behind the surface.
+typedef struct {
+  struct wl_buffer *buffer; // Buffer the strings below describe
+  char time[16];
+  char date[32];
+} BufferContents;
+
+static BufferContents contents[SHM_POOL_MAX];
+static char shown_time[16] = ""; // Last committed to the surface
+static char shown_date[32] = "";
+
+// Lay out the time from a sample string (every digit is the same width, so
+// positions never change) and paint the background with its colons
+static int init_background(void) {
+  background = calloc((size_t)config.width * config.height, sizeof(uint32_t));
+  if (!background)
+    return -1;
+  draw_rounded_rect(background, config.bg_color);
+
+  int date_font_size = config.font_size / 2;
+  if (date_font_size < 4)
+    date_font_size = 4;
+  if (atlas_init(&time_glyphs, config.font_size, config.text_color) < 0 ||
+      atlas_init(&date_glyphs, date_font_size, config.text_color) < 0)
+    return -1;
+
+  const char *sample = config.show_seconds ? "00:00:00" : "00:00";
   int content_width = config.width - config.padding * 2;
   int content_height = config.height - config.padding * 2;
-
-  // Draw time (centered horizontally, 1/3 from top)
-  int time_str_len = strlen(time_str);
-  int time_chars = time_str_len;
   int digit_width = config.font_size;
+  int digit_height = config.font_size * 2;
   int spacing = digit_width / 3;
   int colon_spacing = digit_width / 4;
 
-  // Calculate time width
+  // Time is centered horizontally, 1/3 from the top
   int time_width = 0;
-  for (int i = 0; time_str[i]; i++) {
-    if (time_str[i] == ':') {
+  for (int i = 0; sample[i]; i++) {
+    if (sample[i] == ':') {
       time_width += colon_spacing * 2;
     } else {
       time_width += digit_width + spacing;
@@ -448,78 +565,145 @@ static struct wl_buffer *create_buffer(void) {
   }
   time_width -= spacing;
 
-  int time_x = config.padding + (content_width - time_width) / 2;
-  int time_y = config.padding + content_height / 3 - config.font_size;
-  draw_time(data, time_str, time_x, time_y);
-
-  // Draw date if enabled
-if (config.show_date && date_str[0]) {
-    const int DATE_FONT_SCALE = 2; 
-    int date_font_size = config.font_size / DATE_FONT_SCALE;
-    if (date_font_size < 4) date_font_size = 4;
-
-    int date_len = strlen(date_str);
-    int date_char_width_base = date_font_size / 2;
-    int date_width = 0;
-    for (int i = 0; date_str[i]; i++) {
-        if (date_str[i] == ' ') {
-            date_width += date_char_width_base;
-        } else if (isdigit(date_str[i])) {
-            date_width += date_char_width_base + 2;
-        } else {
-            date_width += date_char_width_base + 1;
-        }
+  int x = config.padding + (content_width - time_width) / 2;
+  int y = config.padding + content_height / 3 - config.font_size;
+  time_len = strlen(sample);
+  for (int i = 0; i < time_len; i++) {
+    if (sample[i] == ':') {
+      draw_colon(background, x + colon_spacing / 2, y + digit_height / 2);
+      time_cells[i] = (Rect){x, y, colon_spacing * 2, digit_height};
+      x += colon_spacing * 2;
+    } else {
+      time_cells[i] = (Rect){x, y, digit_width, digit_height};
+      x += digit_width + spacing;
     }
+  }
 
-    int date_x = config.padding + (content_width - date_width) / 2;
-    int date_y = config.padding + content_height * 2 / 3;
-    int original_font_size = config.font_size;
-    config.font_size = date_font_size;
+  date_band = (Rect){0, config.padding + content_height * 2 / 3, config.width,
+                     date_font_size};
+  return 0;
+}
 
-    draw_date(data, date_str, date_x, date_y);
+// Copy the background back over rect, clipped to the widget
+static void restore_background(uint32_t *pixels, Rect rect) {
+  int x0 = rect.x < 0 ? 0 : rect.x;
+  int y0 = rect.y < 0 ? 0 : rect.y;
+  int x1 = rect.x + rect.width > config.width ? config.width
+                                              : rect.x + rect.width;
+  int y1 = rect.y + rect.height > config.height ? config.height
+                                                : rect.y + rect.height;
+  if (x0 >= x1)
+    return;
+  for (int y = y0; y < y1; y++) {
+    memcpy(pixels + y * config.width + x0, background + y * config.width + x0,
+           (x1 - x0) * sizeof(uint32_t));
+  }
+}
 
-    // Restore global font size
-    config.font_size = original_font_size;
+// Date line, centered horizontally
+static void draw_date_line(uint32_t *pixels, const char *date_str) {
+  int content_width = config.width - config.padding * 2;
+  int date_font_size = date_band.height;
+  int date_char_width_base = date_font_size / 2;
+  int date_width = 0;
+  for (int i = 0; date_str[i]; i++) {
+    if (date_str[i] == ' ') {
+      date_width += date_char_width_base;
+    } else if (isdigit(date_str[i])) {
+      date_width += date_char_width_base + 2;
+    } else {
+      date_width += date_char_width_base + 1;
+    }
   }
 
-  munmap(data, size);
+  int date_x = config.padding + (content_width - date_width) / 2;
+  draw_date(pixels, date_str, date_x, date_band.y);
+}
+
+// Character i of two time strings differs (either may be shorter)
+static int time_char_changed(const char *a, const char *b, int i) {
+  char ca = (int)strlen(a) > i ? a[i] : '\0';
+  char cb = (int)strlen(b) > i ? b[i] : '\0';
+  return ca != cb;
+}
 
-  struct wl_shm_pool *pool = wl_shm_create_pool(wl_shm, fd, size);
-  struct wl_buffer *buf = wl_shm_pool_create_buffer(
-      pool, 0, config.width, config.height, stride, WL_SHM_FORMAT_ARGB8888);
-  wl_shm_pool_destroy(pool);
-  close(fd);
+static void frame_callback_handler(void *data, struct wl_callback *callback,
+                                   uint32_t timestamp);
 
-  return buf;
+static const struct wl_callback_listener frame_listener = {
+    .done = frame_callback_handler,
+};
+
+static void damage_rect(Rect rect) {
+  wl_surface_damage_buffer(surface, rect.x, rect.y, rect.width, rect.height);
 }
 
 // Draw current frame
 void draw_frame(void) {
   if (!configured) {
-    fprintf(stderr, "Not drawing frame: not configured yet\n");
+    log_debug("Not drawing frame: not configured yet");
     return;
   }
 
-  struct wl_buffer *new_buffer = create_buffer();
-  if (!new_buffer) {
-    fprintf(stderr, "Failed to create buffer\n");
+  ShmBuffer *buf = shm_pool_acquire(&pool, config.width, config.height);
+  if (!buf) {
+    // Both buffers are still with the compositor, draw once one is back
+    needs_redraw = 1;
     return;
   }
+  uint32_t *pixels = buf->data;
 
-  wl_surface_attach(surface, new_buffer, 0, 0);
-  wl_surface_damage(surface, 0, 0, config.width, config.height);
+  // Get time and date
+  char time_str[32];
+  char date_str[32];
+  get_time_and_date(time_str, sizeof(time_str), date_str, sizeof(date_str));
+
+  // A fresh buffer starts out as the background
+  BufferContents *old = &contents[buf - pool.buffers];
+  if (old->buffer != buf->buffer) {
+    memcpy(pixels, background, buf->size);
+    old->buffer = buf->buffer;
+    old->time[0] = old->date[0] = '\0';
+  }
 
-  // Destroy old buffer if it exists
-  if (buffer) {
-    wl_buffer_destroy(buffer);
+  // Bring this buffer up to date with the new time
+  for (int i = 0; i < time_len; i++) {
+    if (!isdigit(time_str[i]) || !time_char_changed(time_str, old->time, i))
+      continue;
+    restore_background(pixels, time_cells[i]);
+    draw_digit(pixels, time_str[i], time_cells[i].x, time_cells[i].y);
+  }
+  if (strcmp(date_str, old->date) != 0) {
+    restore_background(pixels, date_band);
+    if (date_str[0])
+      draw_date_line(pixels, date_str);
   }
-  buffer = new_buffer;
 
+  // Damage only what changed on screen since the last commit
+  wl_surface_attach(surface, buf->buffer, 0, 0);
+  if (!shown_time[0]) {
+    wl_surface_damage_buffer(surface, 0, 0, config.width, config.height);
+  } else {
+    for (int i = 0; i < time_len; i++) {
+      if (time_char_changed(time_str, shown_time, i))
+        damage_rect(time_cells[i]);
+    }
+    if (strcmp(date_str, shown_date) != 0)
+      damage_rect(date_band);
+  }
+  // Hold further redraws until the compositor has shown this one
+  frame_callback = wl_surface_frame(surface);
+  wl_callback_add_listener(frame_callback, &frame_listener, NULL);
   wl_surface_commit(surface);
+
+  snprintf(old->time, sizeof(old->time), "%s", time_str);
+  snprintf(old->date, sizeof(old->date), "%s", date_str);
+  snprintf(shown_time, sizeof(shown_time), "%s", time_str);
+  snprintf(shown_date, sizeof(shown_date), "%s", date_str);
   needs_redraw = 0;
   last_drawn_time = time(NULL);
 
-  fprintf(stderr, "Frame drawn at %ld\n", last_drawn_time);
+  log_debug("Frame drawn at %ld", (long)last_drawn_time);
 }
 
 // Parse command line arguments - ADD padding option
@@ -544,7 +728,8 @@ void parse_args(int argc, char *argv[]) {
       printf("  --font-size N      Set font size (default: 28)\n");
       printf("  --corner-radius R  Set corner radius (default: 15)\n");
       printf("  --transparency N   Set transparency (0-255, default: 170)\n");
-      printf("  --debug            Enable debug output\n");
+      printf("  --antialias        Smooth the digit and colon edges\n");
+      printf("  --debug            Log every frame and tick to stderr\n");
       printf("  --help             Show this help\n");
       exit(0);
     } else if (strcmp(argv[i], "--top-left") == 0) {
@@ -589,8 +774,10 @@ void parse_args(int argc, char *argv[]) {
         alpha = 255;
       // Keep the color but change alpha
       config.bg_color = (alpha << 24) | 0x222222;
+    } else if (strcmp(argv[i], "--antialias") == 0) {
+      config.antialias = 1;
     } else if (strcmp(argv[i], "--debug") == 0) {
-      // Debug is enabled by default with stderr output
+      log_level = LOG_DEBUG;
     }
   }
 }
@@ -602,18 +789,18 @@ static void registry_global(void *data, struct wl_registry *registry,
   (void)data;
   (void)version;
 
-  fprintf(stderr, "Registry global: %s (name: %u)\n", interface, name);
+  log_debug("Registry global: %s (name: %u)", interface, name);
 
   if (strcmp(interface, wl_compositor_interface.name) == 0) {
     compositor = wl_registry_bind(registry, name, &wl_compositor_interface, 4);
-    fprintf(stderr, "Got compositor\n");
+    log_debug("Got compositor");
   } else if (strcmp(interface, wl_shm_interface.name) == 0) {
     wl_shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
-    fprintf(stderr, "Got shm\n");
+    log_debug("Got shm");
   } else if (strcmp(interface, zwlr_layer_shell_v1_interface.name) == 0) {
     layer_shell =
         wl_registry_bind(registry, name, &zwlr_layer_shell_v1_interface, 4);
-    fprintf(stderr, "Got layer shell\n");
+    log_debug("Got layer shell");
   }
 }
 
@@ -622,7 +809,7 @@ static void registry_global_remove(void *data, struct wl_registry *registry,
   (void)data;
   (void)registry;
   (void)name;
-  fprintf(stderr, "Registry global removed: %u\n", name);
+  log_debug("Registry global removed: %u", name);
 }
 
 static const struct wl_registry_listener registry_listener = {
@@ -636,21 +823,23 @@ static void layer_surface_configure(void *data,
                                     uint32_t serial, uint32_t width,
                                     uint32_t height) {
   (void)data;
-  fprintf(stderr, "Layer surface configure: %ux%u (serial: %u)\n", width,
+  log_debug("Layer surface configure: %ux%u (serial: %u)", width,
           height, serial);
 
   zwlr_layer_surface_v1_ack_configure(surface, serial);
   configured = 1;
 
-  // Draw initial frame
-  draw_frame();
+  // Draw initial frame, or a fresh one after the frame in flight
+  needs_redraw = 1;
+  if (!frame_callback)
+    draw_frame();
 }
 
 static void layer_surface_closed(void *data,
                                  struct zwlr_layer_surface_v1 *surface) {
   (void)data;
   (void)surface;
-  fprintf(stderr, "Layer surface closed\n");
+  log_info("Layer surface closed");
   running = 0;
   should_exit = 1;
 }
@@ -664,33 +853,66 @@ static const struct zwlr_layer_surface_v1_listener layer_surface_listener = {
 static void frame_callback_handler(void *data, struct wl_callback *callback,
                                    uint32_t timestamp) {
   (void)data;
-  (void)callback;
   (void)timestamp;
 
-  fprintf(stderr, "Frame callback\n");
+  wl_callback_destroy(callback);
+  frame_callback = NULL;
 
-  if (frame_callback) {
-    wl_callback_destroy(frame_callback);
-    frame_callback = NULL;
-  }
+  // A tick came in while the last frame was still on its way
+  if (needs_redraw)
+    draw_frame();
+}
 
-  // Check if we need to redraw
-  time_t now = time(NULL);
-  if (now != last_drawn_time) {
+// Draw now, or once the frame in flight has been shown
+static void request_redraw(void) {
+  needs_redraw = 1;
+  if (!frame_callback)
     draw_frame();
-  }
+}
 
-  // Request next frame
-  frame_callback = wl_surface_frame(surface);
-  static const struct wl_callback_listener listener = {
-      .done = frame_callback_handler};
-  wl_callback_add_listener(frame_callback, &listener, NULL);
+static void buffer_released(void *data) {
+  (void)data;
+  if (needs_redraw && !frame_callback)
+    draw_frame();
+}
+
+// Arm tick_fd for the next second (or minute) boundary of the wall clock,
+// repeating from there. The timer is cancelled if the clock is set, so a
+// time change is picked up right away.
+static int arm_tick(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  time_t period = config.show_seconds ? 1 : 60;
+
+  struct itimerspec spec = {
+      .it_interval = {.tv_sec = period},
+      .it_value = {.tv_sec = now.tv_sec - now.tv_sec % period + period},
+  };
+  return timerfd_settime(tick_fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+                         &spec, NULL);
+}
+
+static void handle_tick(void) {
+  uint64_t expirations;
+  ssize_t n = read(tick_fd, &expirations, sizeof(expirations));
+  if (n < 0 && errno == ECANCELED) {
+    // The clock was set, realign to the new boundaries
+    log_info("Clock changed, rearming timer");
+    arm_tick();
+  } else if (n < 0) {
+    return;
+  }
+  request_redraw();
 }
 
 // Clean up function
 static void cleanup(void) {
-  fprintf(stderr, "Cleaning up...\n");
+  log_debug("Cleaning up...");
 
+  if (tick_fd >= 0) {
+    close(tick_fd);
+    tick_fd = -1;
+  }
   if (frame_callback) {
     wl_callback_destroy(frame_callback);
     frame_callback = NULL;
@@ -703,10 +925,11 @@ static void cleanup(void) {
     wl_surface_destroy(surface);
     surface = NULL;
   }
-  if (buffer) {
-    wl_buffer_destroy(buffer);
-    buffer = NULL;
-  }
+  shm_pool_finish(&pool);
+  free(background);
+  background = NULL;
+  atlas_finish(&time_glyphs);
+  atlas_finish(&date_glyphs);
   if (display) {
     wl_display_disconnect(display);
     display = NULL;
@@ -714,7 +937,7 @@ static void cleanup(void) {
 }
 
 int main(int argc, char *argv[]) {
-  fprintf(stderr, "Starting clock widget...\n");
+  log_info("Starting clock widget...");
 
   parse_args(argc, argv);
 
@@ -734,13 +957,20 @@ int main(int argc, char *argv[]) {
   sa_tstp.sa_flags = 0;
   sigaction(SIGTSTP, &sa_tstp, NULL);
 
+  // SIGUSR1 writes out the recent log messages
+  struct sigaction sa_usr1;
+  sa_usr1.sa_handler = dump_log_handler;
+  sigemptyset(&sa_usr1.sa_mask);
+  sa_usr1.sa_flags = 0;
+  sigaction(SIGUSR1, &sa_usr1, NULL);
+
   // Connect to Wayland display
   display = wl_display_connect(NULL);
   if (!display) {
-    fprintf(stderr, "Failed to connect to Wayland display\n");
+    log_error("Failed to connect to Wayland display");
     return 1;
   }
-  fprintf(stderr, "Connected to Wayland display\n");
+  log_info("Connected to Wayland display");
 
   // Get registry
   struct wl_registry *registry = wl_display_get_registry(display);
@@ -749,31 +979,38 @@ int main(int argc, char *argv[]) {
   wl_display_flush(display);
 
   if (!compositor || !wl_shm || !layer_shell) {
-    fprintf(stderr, "Missing required Wayland interfaces\n");
-    fprintf(stderr, "compositor: %p, shm: %p, layer_shell: %p\n",
+    log_error("Missing required Wayland interfaces");
+    log_error("compositor: %p, shm: %p, layer_shell: %p",
             (void *)compositor, (void *)wl_shm, (void *)layer_shell);
     return 1;
   }
+  shm_pool_init(&pool, wl_shm, WL_SHM_FORMAT_ARGB8888, 2);
+  pool.release = buffer_released;
+  if (init_background() < 0) {
+    log_error("Failed to allocate background");
+    cleanup();
+    return 1;
+  }
 
   // Create surface
   surface = wl_compositor_create_surface(compositor);
   if (!surface) {
-    fprintf(stderr, "Failed to create surface\n");
+    log_error("Failed to create surface");
     cleanup();
     return 1;
   }
-  fprintf(stderr, "Surface created\n");
+  log_debug("Surface created");
 
   // Create layer surface
   layer_surface = zwlr_layer_shell_v1_get_layer_surface(
       layer_shell, surface, NULL, config.layer, "clock-widget");
 
   if (!layer_surface) {
-    fprintf(stderr, "Failed to create layer surface\n");
+    log_error("Failed to create layer surface");
     cleanup();
     return 1;
   }
-  fprintf(stderr, "Layer surface created\n");
+  log_debug("Layer surface created");
 
   // Configure layer surface
   zwlr_layer_surface_v1_set_size(layer_surface, config.width, config.height);
@@ -792,7 +1029,7 @@ int main(int argc, char *argv[]) {
   wl_display_roundtrip(display);
   wl_display_flush(display);
 
-  fprintf(stderr, "Surface committed, waiting for configure...\n");
+  log_debug("Surface committed, waiting for configure...");
 
   // Set up frame callback once we're configured
   while (running && !configured && !should_exit) {
@@ -803,9 +1040,11 @@ int main(int argc, char *argv[]) {
     if (ret < 0) {
       if (errno == EINTR) {
         // Interrupted by signal
+        if (should_exit)
+          log_info("Signal received, exiting...");
         continue;
       }
-      perror("poll");
+      log_error("poll: %s", strerror(errno));
       break;
     } else if (ret == 0) {
       // Timeout
@@ -819,78 +1058,63 @@ int main(int argc, char *argv[]) {
   }
 
   if (!configured) {
-    fprintf(stderr, "Exiting before configuration\n");
+    log_error("Exiting before configuration");
     cleanup();
     return 1;
   }
 
-  fprintf(stderr, "Configured, setting up frame callback\n");
-
-  // Set up frame callback for animation
-  frame_callback = wl_surface_frame(surface);
-  static const struct wl_callback_listener listener = {
-      .done = frame_callback_handler};
-  wl_callback_add_listener(frame_callback, &listener, NULL);
-  wl_surface_commit(surface);
-  wl_display_flush(display);
+  tick_fd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (tick_fd < 0 || arm_tick() < 0) {
+    log_error("timerfd: %s", strerror(errno));
+    cleanup();
+    return 1;
+  }
 
   // Main loop
-  fprintf(stderr, "Entering main loop\n");
-  fprintf(stderr, "Press Ctrl+C to exit\n");
+  // Sleep until the display or the timer needs us; frames are only drawn
+  // on a tick, and frame callbacks only requested for those frames.
+  log_info("Entering main loop");
+  log_info("Press Ctrl+C to exit");
 
   display_fd = wl_display_get_fd(display);
 
   while (running && !should_exit) {
-    // Check if time has changed
-    time_t now = time(NULL);
-    if (now != last_drawn_time) {
-      fprintf(stderr, "Time changed: %ld -> %ld\n", last_drawn_time, now);
-      if (frame_callback) {
-        wl_callback_destroy(frame_callback);
-        frame_callback = NULL;
-      }
-      frame_callback = wl_surface_frame(surface);
-      wl_callback_add_listener(frame_callback, &listener, NULL);
-      wl_surface_commit(surface);
-      wl_display_flush(display);
-    }
-
-    struct pollfd pfd = {.fd = display_fd, .events = POLLIN};
-    long timeout_ms;
-
-    // Calculate timeout based on configuration
-    if (config.show_seconds) {
-      timeout_ms = 1000;
-    } else {
-      long seconds_to_next_minute = 60 - (now % 60);
-      timeout_ms = seconds_to_next_minute * 1000;
+    if (dump_log) {
+      dump_log = 0;
+      log_dump();
     }
+    wl_display_flush(display);
 
-    if (timeout_ms <= 0)
-      timeout_ms = 100; // Minimum timeout
-
-    int ret = poll(&pfd, 1, timeout_ms);
+    struct pollfd pfds[] = {
+        {.fd = display_fd, .events = POLLIN},
+        {.fd = tick_fd, .events = POLLIN},
+    };
+    int ret = poll(pfds, 2, -1);
     if (ret < 0) {
       if (errno == EINTR) {
         // Interrupted by signal
+        if (should_exit)
+          log_info("Signal received, exiting...");
         continue;
       }
-      perror("poll");
+      log_error("poll: %s", strerror(errno));
       break;
-    } else if (ret == 0) {
-      // Timeout
-      continue;
     }
 
-    if (pfd.revents & POLLIN) {
-      wl_display_dispatch(display);
+    if (pfds[0].revents & POLLIN) {
+      if (wl_display_dispatch(display) < 0) {
+        log_error("Lost connection to the compositor");
+        break;
+      }
+    } else if (pfds[0].revents & (POLLERR | POLLHUP)) {
+      log_error("Lost connection to the compositor");
+      break;
     }
-
-    wl_display_flush(display);
-    wl_display_dispatch_pending(display);
+    if (pfds[1].revents & POLLIN)
+      handle_tick();
   }
 
-  fprintf(stderr, "Exiting...\n");
+  log_info("Exiting...");
 
   cleanup();
 
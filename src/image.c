@@ -0,0 +1,367 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "../include/stb_image.h"
+
+#ifdef HAVE_LIBJPEG
+#include <jpeglib.h>
+#include <setjmp.h>
+
+typedef struct {
+  struct jpeg_error_mgr mgr;
+  jmp_buf jump;
+} JpegError;
+
+static void jpeg_error_exit(j_common_ptr cinfo) {
+  longjmp(((JpegError *)cinfo->err)->jump, 1);
+}
+#endif
+
+#ifdef HAVE_LIBPNG
+#include <png.h>
+#endif
+
+struct ImageDecoder {
+  Image whole; // Formats stb can only decode at once
+#ifdef HAVE_LIBJPEG
+  FILE *file; // Set while a JPEG is streamed
+  struct jpeg_decompress_struct cinfo;
+  JpegError err;
+  unsigned char *row;
+#endif
+#ifdef HAVE_LIBPNG
+  png_structp png; // Set while a PNG is streamed
+  png_infop info;
+  FILE *png_file;
+  unsigned char *png_row;
+  int png_y; // Rows read so far
+#endif
+};
+
+#ifdef HAVE_LIBJPEG
+
+// Start decoding a JPEG with the largest DCT scaling that still covers
+// min_width x min_height. Returns 0 on success, 1 if the file is not a JPEG
+// and -1 if libjpeg could not decode it.
+static int open_jpeg(ImageDecoder *dec, const char *path, int min_width,
+                     int min_height) {
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return -1;
+  unsigned char magic[3];
+  if (fread(magic, 1, 3, f) != 3 || magic[0] != 0xff || magic[1] != 0xd8 ||
+      magic[2] != 0xff) {
+    fclose(f);
+    return 1;
+  }
+  rewind(f);
+
+  struct jpeg_decompress_struct *cinfo = &dec->cinfo;
+  cinfo->err = jpeg_std_error(&dec->err.mgr);
+  dec->err.mgr.error_exit = jpeg_error_exit;
+  if (setjmp(dec->err.jump)) {
+    jpeg_destroy_decompress(cinfo);
+    fclose(f);
+    return -1;
+  }
+
+  jpeg_create_decompress(cinfo);
+  jpeg_stdio_src(cinfo, f);
+  jpeg_read_header(cinfo, TRUE);
+
+  cinfo->scale_num = 1;
+  cinfo->scale_denom = 1;
+  if (min_width > 0 && min_height > 0) {
+    for (unsigned int denom = 8; denom > 1; denom /= 2) {
+      if ((cinfo->image_width + denom - 1) / denom >= (unsigned int)min_width &&
+          (cinfo->image_height + denom - 1) / denom >=
+              (unsigned int)min_height) {
+        cinfo->scale_denom = denom;
+        break;
+      }
+    }
+  }
+#ifdef JCS_EXTENSIONS
+  cinfo->out_color_space = JCS_EXT_RGBA;
+#else
+  cinfo->out_color_space = JCS_RGB;
+#endif
+
+  jpeg_start_decompress(cinfo);
+  dec->row = malloc((size_t)cinfo->output_width * 4);
+  if (!dec->row) {
+    jpeg_destroy_decompress(cinfo);
+    fclose(f);
+    return -1;
+  }
+  dec->file = f;
+  return 0;
+}
+
+static const unsigned char *jpeg_row(ImageDecoder *dec, int y) {
+  struct jpeg_decompress_struct *cinfo = &dec->cinfo;
+  if (setjmp(dec->err.jump))
+    return NULL;
+  // The last row read is still in the buffer, anything before it is gone
+  if (y < (int)cinfo->output_scanline - 1)
+    return NULL;
+  while ((int)cinfo->output_scanline <= y) {
+    unsigned char *pixels = dec->row;
+    jpeg_read_scanlines(cinfo, &pixels, 1);
+  }
+#ifndef JCS_EXTENSIONS
+  // Expand RGB to RGBA in place, back to front
+  unsigned char *pixels = dec->row;
+  for (int x = (int)cinfo->output_width - 1; x >= 0; x--) {
+    pixels[x * 4 + 3] = 255;
+    pixels[x * 4 + 2] = pixels[x * 3 + 2];
+    pixels[x * 4 + 1] = pixels[x * 3 + 1];
+    pixels[x * 4 + 0] = pixels[x * 3 + 0];
+  }
+#endif
+  return dec->row;
+}
+#endif
+
+#ifdef HAVE_LIBPNG
+
+// Start decoding a PNG, expanded to 8-bit RGBA. Returns 0 on success, 1 if
+// the file is not a PNG or is interlaced (every pass covers the whole image,
+// so there is no streaming it) and -1 if libpng could not decode it.
+static int open_png(ImageDecoder *dec, const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return -1;
+  unsigned char magic[8];
+  if (fread(magic, 1, 8, f) != 8 || png_sig_cmp(magic, 0, 8) != 0) {
+    fclose(f);
+    return 1;
+  }
+
+  png_structp png =
+      png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  png_infop info = png ? png_create_info_struct(png) : NULL;
+  if (!info) {
+    png_destroy_read_struct(&png, NULL, NULL);
+    fclose(f);
+    return -1;
+  }
+  if (setjmp(png_jmpbuf(png))) {
+    png_destroy_read_struct(&png, &info, NULL);
+    fclose(f);
+    return -1;
+  }
+
+  png_init_io(png, f);
+  png_set_sig_bytes(png, 8);
+  png_read_info(png, info);
+  if (png_get_interlace_type(png, info) != PNG_INTERLACE_NONE) {
+    png_destroy_read_struct(&png, &info, NULL);
+    fclose(f);
+    return 1;
+  }
+
+  int color = png_get_color_type(png, info);
+  png_set_expand(png); // Palette, low bit depths and tRNS
+  if (png_get_bit_depth(png, info) == 16)
+    png_set_strip_16(png);
+  if (color == PNG_COLOR_TYPE_GRAY || color == PNG_COLOR_TYPE_GRAY_ALPHA)
+    png_set_gray_to_rgb(png);
+  png_set_filler(png, 0xff, PNG_FILLER_AFTER); // No-op with alpha already
+  png_read_update_info(png, info);
+
+  png_uint_32 width = png_get_image_width(png, info);
+  dec->png_row = NULL;
+  if (png_get_rowbytes(png, info) == (size_t)width * 4)
+    dec->png_row = malloc((size_t)width * 4);
+  if (!dec->png_row) {
+    png_destroy_read_struct(&png, &info, NULL);
+    fclose(f);
+    return -1;
+  }
+  dec->png = png;
+  dec->info = info;
+  dec->png_file = f;
+  dec->png_y = 0;
+  return 0;
+}
+
+static const unsigned char *png_row(ImageDecoder *dec, int y) {
+  if (setjmp(png_jmpbuf(dec->png)))
+    return NULL;
+  // The last row read is still in the buffer, anything before it is gone
+  if (y < dec->png_y - 1)
+    return NULL;
+  while (dec->png_y <= y) {
+    png_read_row(dec->png, dec->png_row, NULL);
+    dec->png_y++;
+  }
+  return dec->png_row;
+}
+#endif
+
+static int load_stb(const char *path, Image *image) {
+  int channels;
+  image->data = stbi_load(path, &image->width, &image->height, &channels, 4);
+  return image->data ? 0 : -1; // Callers report failures
+}
+
+// Open path with whichever decoder streams it, falling back to decoding it
+// whole with stb if whole is set
+static int open_reader(ImageReader *reader, const char *path, int min_width,
+                       int min_height, int whole) {
+  ImageDecoder *dec = calloc(1, sizeof(*dec));
+  if (!dec)
+    return -1;
+  reader->decoder = dec;
+
+#ifdef HAVE_LIBJPEG
+  // Anything libjpeg can't handle is left to stb
+  if (open_jpeg(dec, path, min_width, min_height) == 0) {
+    reader->width = dec->cinfo.output_width;
+    reader->height = dec->cinfo.output_height;
+    return 0;
+  }
+#else
+  (void)min_width;
+  (void)min_height;
+#endif
+#ifdef HAVE_LIBPNG
+  // PNGs have no reduced decode, but can still be read a row at a time
+  if (open_png(dec, path) == 0) {
+    reader->width = png_get_image_width(dec->png, dec->info);
+    reader->height = png_get_image_height(dec->png, dec->info);
+    return 0;
+  }
+#endif
+
+  // stb can only decode the whole image at once
+  if (!whole || load_stb(path, &dec->whole) < 0) {
+    free(dec);
+    reader->decoder = NULL;
+    return -1;
+  }
+  reader->width = dec->whole.width;
+  reader->height = dec->whole.height;
+  return 0;
+}
+
+int image_reader_open(ImageReader *reader, const char *path, int min_width,
+                      int min_height) {
+  return open_reader(reader, path, min_width, min_height, 1);
+}
+
+const unsigned char *image_reader_row(ImageReader *reader, int y) {
+  ImageDecoder *dec = reader->decoder;
+  if (y < 0 || y >= reader->height)
+    return NULL;
+#ifdef HAVE_LIBJPEG
+  if (dec->file)
+    return jpeg_row(dec, y);
+#endif
+#ifdef HAVE_LIBPNG
+  if (dec->png)
+    return png_row(dec, y);
+#endif
+  return dec->whole.data + (size_t)y * reader->width * 4;
+}
+
+void image_reader_close(ImageReader *reader) {
+  ImageDecoder *dec = reader->decoder;
+  if (!dec)
+    return;
+#ifdef HAVE_LIBJPEG
+  if (dec->file) {
+    jpeg_destroy_decompress(&dec->cinfo);
+    fclose(dec->file);
+    free(dec->row);
+  }
+#endif
+#ifdef HAVE_LIBPNG
+  if (dec->png) {
+    png_destroy_read_struct(&dec->png, &dec->info, NULL);
+    fclose(dec->png_file);
+    free(dec->png_row);
+  }
+#endif
+  image_free(&dec->whole);
+  free(dec);
+  reader->decoder = NULL;
+}
+
+int image_load_scaled(const char *path, int min_width, int min_height,
+                      Image *image) {
+  ImageReader reader;
+  if (image_reader_open(&reader, path, min_width, min_height) < 0)
+    return -1;
+
+  // Decoded whole already: take it over
+  ImageDecoder *dec = reader.decoder;
+  if (dec->whole.data) {
+    *image = dec->whole;
+    dec->whole.data = NULL;
+    image_reader_close(&reader);
+    return 0;
+  }
+
+  size_t stride = (size_t)reader.width * 4;
+  Image out = {malloc(stride * reader.height), reader.width, reader.height};
+  int y = 0;
+  for (; out.data && y < reader.height; y++) {
+    const unsigned char *row = image_reader_row(&reader, y);
+    if (!row)
+      break;
+    memcpy(out.data + y * stride, row, stride);
+  }
+  image_reader_close(&reader);
+  if (y < reader.height) {
+    // libjpeg or libpng gave up halfway; stb may still cope
+    image_free(&out);
+    return load_stb(path, image);
+  }
+  *image = out;
+  return 0;
+}
+
+int image_load(const char *path, Image *image) {
+  return image_load_scaled(path, 0, 0, image);
+}
+
+int image_load_rows(const char *path, ImageRowFn row, void *data) {
+  ImageReader reader;
+  if (image_reader_open(&reader, path, 0, 0) < 0)
+    return -1;
+  int status = 0;
+  for (int y = 0; y < reader.height && status == 0; y++) {
+    const unsigned char *rgba = image_reader_row(&reader, y);
+    status = rgba ? row(data, rgba, y, reader.width, reader.height) : -1;
+  }
+  image_reader_close(&reader);
+  return status < 0 ? -1 : 0;
+}
+
+int image_info(const char *path, int *width, int *height) {
+  int channels;
+  if (stbi_info(path, width, height, &channels))
+    return 0;
+
+  // Too large for stb, but libjpeg or libpng may still stream it, and
+  // opening them reads no more than the header
+  ImageReader reader;
+  if (open_reader(&reader, path, 0, 0, 0) < 0)
+    return -1;
+  *width = reader.width;
+  *height = reader.height;
+  image_reader_close(&reader);
+  return 0;
+}
+
+void image_free(Image *image) {
+  free(image->data); // stb allocates with malloc() as well
+  image->data = NULL;
+  image->width = image->height = 0;
+}
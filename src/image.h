@@ -0,0 +1,61 @@
+#ifndef LAYER_IMAGE_H
+#define LAYER_IMAGE_H
+
+#include <stdint.h>
+
+// Decoded image, always 4 channels (RGBA, 8 bits each)
+typedef struct {
+  unsigned char *data;
+  int width;
+  int height;
+} Image;
+
+// Decode the file at path. Returns 0 on success, -1 on failure.
+int image_load(const char *path, Image *image);
+
+// Like image_load(), but the image may come out smaller than the file as long
+// as it still covers min_width x min_height. JPEGs are then decoded with DCT
+// scaling (1/2, 1/4 or 1/8) when built with libjpeg; other formats are
+// decoded at full size.
+int image_load_scaled(const char *path, int min_width, int min_height,
+                      Image *image);
+
+// Receives a decoded image a row at a time: rgba holds row y, width pixels.
+// Returns 0 to continue or -1 to stop decoding.
+typedef int (*ImageRowFn)(void *data, const unsigned char *rgba, int y,
+                          int width, int height);
+
+// Decode the file at path at full size through an ImageReader, passing each
+// row to row from top to bottom. Returns 0 on success, -1 on failure.
+int image_load_rows(const char *path, ImageRowFn row, void *data);
+
+typedef struct ImageDecoder ImageDecoder;
+
+// An image decoded a row at a time, so a consumer that writes its output
+// as it goes never holds the whole image
+typedef struct {
+  int width, height; // Decoded size
+  ImageDecoder *decoder;
+} ImageReader;
+
+// Open the file at path for reading, scaled down like image_load_scaled().
+// JPEGs are streamed when built with libjpeg, and non-interlaced PNGs when
+// built with libpng, so only a row is held in memory; other formats are
+// decoded whole here. Returns 0 on success, -1 on
+// failure.
+int image_reader_open(ImageReader *reader, const char *path, int min_width,
+                      int min_height);
+
+// Row y (RGBA, width pixels), valid until the next call, or NULL on a
+// decode error. Rows can only be read from top to bottom: skipped rows are
+// decoded and dropped, and rows above the last one read are gone.
+const unsigned char *image_reader_row(ImageReader *reader, int y);
+
+void image_reader_close(ImageReader *reader);
+
+// Read the dimensions of the image at path without decoding it
+int image_info(const char *path, int *width, int *height);
+
+void image_free(Image *image);
+
+#endif
@@ -1,36 +1,42 @@
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/keysym.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <unistd.h>
 #include <wayland-client.h>
 
-#define STB_IMAGE_IMPLEMENTATION
 #include "../build//xdg-shell-client-protocol.h"
-#include "../include/stb_image.h"
+#include "image.h"
+#include "mip.h"
+#include "scale.h"
+#include "shm-pool.h"
+#include "thumbs.h"
 
-typedef struct {
-    unsigned char *data;
-    int width;
-    int height;
-    int channels;
-} ImageData;
+#define GRID_WORKERS_MAX 8
+#define GRID_BACKGROUND THUMB_BACKGROUND // ARGB: dark gray
 
 static struct wl_compositor *compositor = NULL;
 static struct wl_shm *shm = NULL;
 static struct xdg_wm_base *wm_base = NULL;
 static volatile sig_atomic_t running = 1;
-static struct wl_buffer *global_buffer = NULL;
 static volatile int configured = 0;
 static struct wl_seat *seat = NULL;
 static struct wl_keyboard *keyboard = NULL;
 static int has_keyboard = 0;
+static ScaleFilter scale_filter = SCALE_DEFAULT;
+static int idle_benchmark = 0; // Seconds to sit idle before reporting wakeups
+static size_t tile_budget = MIP_DEFAULT_BUDGET; // Bytes of image tiles in memory
+static size_t thumb_cache_max = THUMB_CACHE_DEFAULT_MAX; // 0: No thumbnail cache
 
 static int is_wayland() {
     char *xdg = getenv("XDG_SESSION_TYPE");
@@ -59,17 +65,317 @@ static void sigint_handler(int signo) {
     running = 0;
 }
 
-static int create_shm_file(off_t size) {
-    char template[] = "/tmp/imageviewer-shm-XXXXXX";
-    int fd = mkstemp(template);
-    if (fd >= 0) {
-        unlink(template);
-        if (ftruncate(fd, size) < 0) {
-            close(fd);
-            return -1;
-        }
+// Single image view
+// The image is kept as a tiled mip pyramid, and every resize, zoom or pan
+// rescales the visible part from the nearest level, reading in only the
+// tiles it covers. Building the pyramid decodes every pixel, so the first
+// frame comes from a preview decoded at about the window size instead, and
+// the pyramid is built on a thread once that is on screen, while the window
+// keeps answering the compositor.
+#define VIEW_BACKGROUND 0xFF000000 // ARGB: black
+#define VIEW_ZOOM_STEP 1.25
+#define VIEW_MAX_SCALE 16.0 // Screen pixels per image pixel
+#define VIEW_MIN_SIZE 64
+
+typedef struct {
+    const char *path;
+    Image preview;             // Shown until the pyramid is built
+    MipPyramid mip;            // Empty until view_build_finish()
+    MipPyramid building;       // Filled in by the build thread
+    pthread_t builder;
+    int build_started, build_joined;
+    int build_ret;             // mip_open() result, set by the build thread
+    int build_fds[2];          // A byte is written to [1] when it is done
+    int image_width, image_height; // Full size
+    int width, height;         // Window size
+    double zoom;               // 1 fits the whole image in the window
+    double center_x, center_y; // Image point at the window center
+    int dirty;                 // Window contents are out of date
+} View;
+
+enum {
+    VIEW_ZOOM_IN,
+    VIEW_ZOOM_OUT,
+    VIEW_RESET,
+    VIEW_LEFT,
+    VIEW_RIGHT,
+    VIEW_UP,
+    VIEW_DOWN,
+};
+
+static View *active_view = NULL; // Gets the Wayland key presses
+static int frame_pending = 0;    // Last view frame not shown yet
+
+// Decode the preview: JPEGs with DCT scaling, and every format scaled to
+// fit width x height as it streams in
+static int view_init(View *view, const char *path, int width, int height) {
+    memset(view, 0, sizeof(*view));
+    view->mip.fd = -1;
+    view->building.fd = -1;
+    view->build_fds[0] = view->build_fds[1] = -1;
+    int image_w, image_h;
+    ImageReader reader;
+    if (image_info(path, &image_w, &image_h) < 0 ||
+        image_reader_open(&reader, path, width, height) < 0)
+        return -1;
+
+    // The image at its fitted size, never larger than decoded
+    double fit_w = (double)width / reader.width;
+    double fit_h = (double)height / reader.height;
+    double fit = fit_w < fit_h ? fit_w : fit_h;
+    if (fit > 1)
+        fit = 1;
+    int preview_w = (int)(reader.width * fit + 0.5);
+    int preview_h = (int)(reader.height * fit + 0.5);
+    if (preview_w < 1)
+        preview_w = 1;
+    if (preview_h < 1)
+        preview_h = 1;
+    Image preview = {malloc((size_t)preview_w * preview_h * 4), preview_w,
+                     preview_h};
+    int ret = -1;
+    if (preview.data)
+        ret = scale_reader(&reader, 0, 0, reader.width, reader.height,
+                           preview.data, preview_w, preview_h, preview_w * 4,
+                           scale_filter, &scale_rgba8888);
+    image_reader_close(&reader);
+    if (ret < 0) {
+        image_free(&preview);
+        return -1;
+    }
+
+    view->path = path;
+    view->preview = preview;
+    view->image_width = image_w;
+    view->image_height = image_h;
+    view->width = width;
+    view->height = height;
+    view->zoom = 1;
+    view->center_x = image_w / 2.0;
+    view->center_y = image_h / 2.0;
+    view->dirty = 1;
+    return 0;
+}
+
+static void *view_build_thread(void *arg) {
+    View *view = arg;
+    view->build_ret = mip_open(&view->building, view->path, tile_budget);
+    char done = 1;
+    if (write(view->build_fds[1], &done, 1) < 0)
+        perror("[imageviewer] write");
+    return NULL;
+}
+
+// Start building the pyramid in the background, once the preview is on
+// screen. build_fds[0] becomes readable when it is done. It stays in memory
+// if it fits the tile budget and goes to a backing file otherwise. Returns
+// -1 if the build could not be started.
+static int view_build_start(View *view) {
+    if (view->build_started)
+        return 0;
+    if (pipe(view->build_fds) < 0)
+        return -1;
+    fcntl(view->build_fds[0], F_SETFL, O_NONBLOCK);
+    view->build_started = 1;
+    if (pthread_create(&view->builder, NULL, view_build_thread, view) != 0) {
+        view->build_joined = 1;
+        view_build_thread(view); // Build it here instead
+    }
+    return 0;
+}
+
+// Switch to the pyramid once build_fds[0] is readable. Returns -1 if the
+// image could not be decoded.
+static int view_build_finish(View *view) {
+    char done;
+    if (read(view->build_fds[0], &done, 1) != 1)
+        return 0; // Not done yet
+    if (!view->build_joined) {
+        pthread_join(view->builder, NULL);
+        view->build_joined = 1;
+    }
+    if (view->build_ret < 0)
+        return -1;
+    view->mip = view->building;
+    memset(&view->building, 0, sizeof(view->building));
+    view->building.fd = -1;
+    image_free(&view->preview);
+    view->dirty = 1;
+    return 0;
+}
+
+// Waits for a build still running, as mip_open() can't be interrupted
+static void view_free(View *view) {
+    if (view->build_started && !view->build_joined)
+        pthread_join(view->builder, NULL);
+    mip_free(&view->building);
+    for (int i = 0; i < 2; i++)
+        if (view->build_fds[i] >= 0)
+            close(view->build_fds[i]);
+    image_free(&view->preview);
+    mip_free(&view->mip);
+}
+
+// Screen pixels per image pixel
+static double view_scale(const View *view) {
+    double fit_w = (double)view->width / view->image_width;
+    double fit_h = (double)view->height / view->image_height;
+    return (fit_w < fit_h ? fit_w : fit_h) * view->zoom;
+}
+
+// Keep the center where the window stays filled with image along each
+// axis the image overflows, and centered along the others
+static void view_clamp(View *view) {
+    int image_w = view->image_width;
+    int image_h = view->image_height;
+    double scale = view_scale(view);
+    double half_w = view->width / scale / 2;
+    double half_h = view->height / scale / 2;
+
+    if (half_w * 2 >= image_w)
+        view->center_x = image_w / 2.0;
+    else if (view->center_x < half_w)
+        view->center_x = half_w;
+    else if (view->center_x > image_w - half_w)
+        view->center_x = image_w - half_w;
+
+    if (half_h * 2 >= image_h)
+        view->center_y = image_h / 2.0;
+    else if (view->center_y < half_h)
+        view->center_y = half_h;
+    else if (view->center_y > image_h - half_h)
+        view->center_y = image_h - half_h;
+}
+
+static void view_resize(View *view, int width, int height) {
+    if (width < VIEW_MIN_SIZE)
+        width = VIEW_MIN_SIZE;
+    if (height < VIEW_MIN_SIZE)
+        height = VIEW_MIN_SIZE;
+    if (width == view->width && height == view->height)
+        return;
+    view->width = width;
+    view->height = height;
+    view_clamp(view);
+    view->dirty = 1;
+}
+
+static void view_action(View *view, int action) {
+    double scale = view_scale(view);
+    // Pan by a tenth of the window
+    double step_x = view->width / scale / 10;
+    double step_y = view->height / scale / 10;
+
+    switch (action) {
+    case VIEW_ZOOM_IN:
+        view->zoom *= VIEW_ZOOM_STEP;
+        if (view_scale(view) > VIEW_MAX_SCALE)
+            view->zoom = view->zoom * VIEW_MAX_SCALE / view_scale(view);
+        if (view->zoom < 1)
+            view->zoom = 1;
+        break;
+    case VIEW_ZOOM_OUT:
+        view->zoom /= VIEW_ZOOM_STEP;
+        if (view->zoom < 1)
+            view->zoom = 1;
+        break;
+    case VIEW_RESET:
+        view->zoom = 1;
+        view->center_x = view->image_width / 2.0;
+        view->center_y = view->image_height / 2.0;
+        break;
+    case VIEW_LEFT:
+        view->center_x -= step_x;
+        break;
+    case VIEW_RIGHT:
+        view->center_x += step_x;
+        break;
+    case VIEW_UP:
+        view->center_y -= step_y;
+        break;
+    case VIEW_DOWN:
+        view->center_y += step_y;
+        break;
+    }
+    view_clamp(view);
+    view->dirty = 1;
+}
+
+// The source span shown along one axis and where it lands in the window
+static void view_axis(int image_size, int window, double scale, double center,
+                      int *src, int *src_size, int *dst, int *dst_size) {
+    double shown = image_size * scale;
+    if (shown <= window) {
+        // All of it, centered
+        *src = 0;
+        *src_size = image_size;
+        *dst_size = (int)(shown + 0.5);
+        if (*dst_size < 1)
+            *dst_size = 1;
+        *dst = (window - *dst_size) / 2;
+    } else {
+        *dst = 0;
+        *dst_size = window;
+        *src_size = (int)(window / scale + 0.5);
+        if (*src_size < 1)
+            *src_size = 1;
+        if (*src_size > image_size)
+            *src_size = image_size;
+        *src = (int)(center - *src_size / 2.0 + 0.5);
+        if (*src < 0)
+            *src = 0;
+        if (*src > image_size - *src_size)
+            *src = image_size - *src_size;
     }
-    return fd;
+}
+
+static void fill_pixels(unsigned char *pixels, int stride, int x, int y,
+                        int width, int height, uint32_t value) {
+    for (int row = y; row < y + height; row++) {
+        uint32_t *p = (uint32_t *)(pixels + (size_t)row * stride) + x;
+        for (int i = 0; i < width; i++)
+            p[i] = value;
+    }
+}
+
+// Draw the view into a width x height buffer, background around the image
+static int view_render(View *view, void *pixels, int stride,
+                       uint32_t background, const ScaleFormat *format) {
+    double scale = view_scale(view);
+    int src_x, src_y, src_w, src_h, dst_x, dst_y, dst_w, dst_h;
+    view_axis(view->image_width, view->width, scale, view->center_x, &src_x,
+              &src_w, &dst_x, &dst_w);
+    view_axis(view->image_height, view->height, scale, view->center_y, &src_y,
+              &src_h, &dst_y, &dst_h);
+
+    // Letterbox bars
+    unsigned char *p = pixels;
+    fill_pixels(p, stride, 0, 0, view->width, dst_y, background);
+    fill_pixels(p, stride, 0, dst_y + dst_h, view->width,
+                view->height - dst_y - dst_h, background);
+    fill_pixels(p, stride, 0, dst_y, dst_x, dst_h, background);
+    fill_pixels(p, stride, dst_x + dst_w, dst_y, view->width - dst_x - dst_w,
+                dst_h, background);
+
+    view->dirty = 0;
+    unsigned char *dst = p + (size_t)dst_y * stride + dst_x * 4;
+    if (view->mip.count)
+        return mip_scale(&view->mip, src_x, src_y, src_w, src_h, dst, dst_w,
+                         dst_h, stride, scale_filter, format);
+
+    // The same rectangle of the preview
+    const Image *preview = &view->preview;
+    double sx = (double)preview->width / view->image_width;
+    double sy = (double)preview->height / view->image_height;
+    int x0 = (int)(src_x * sx), y0 = (int)(src_y * sy);
+    int x1 = (int)((src_x + src_w) * sx + 0.5);
+    int y1 = (int)((src_y + src_h) * sy + 0.5);
+    if (x1 <= x0)
+        x1 = x0 + 1;
+    if (y1 <= y0)
+        y1 = y0 + 1;
+    return scale_image(preview, x0, y0, x1 - x0, y1 - y0, dst, dst_w, dst_h,
+                       stride, scale_filter, format);
 }
 
 // Wayland callbacks
@@ -154,6 +460,23 @@ static void keyboard_key(void *data, struct wl_keyboard *keyboard,
         // 'q' = 16, Escape = 1
         if (key == 16 || key == 1) {
             running = 0;
+        } else if (active_view) {
+            // Evdev codes: '=' 13 and keypad '+' 78, '-' 12 and keypad 74,
+            // '0' 11, arrows and h/j/k/l
+            if (key == 13 || key == 78)
+                view_action(active_view, VIEW_ZOOM_IN);
+            else if (key == 12 || key == 74)
+                view_action(active_view, VIEW_ZOOM_OUT);
+            else if (key == 11)
+                view_action(active_view, VIEW_RESET);
+            else if (key == 105 || key == 35)
+                view_action(active_view, VIEW_LEFT);
+            else if (key == 106 || key == 38)
+                view_action(active_view, VIEW_RIGHT);
+            else if (key == 103 || key == 37)
+                view_action(active_view, VIEW_UP);
+            else if (key == 108 || key == 36)
+                view_action(active_view, VIEW_DOWN);
         }
     }
 }
@@ -245,64 +568,277 @@ static void registry_remover(void *data, struct wl_registry *reg, uint32_t id) {
 static const struct wl_registry_listener registry_listener = {
     .global = registry_handler, .global_remove = registry_remover};
 
-static void frame_done(void *data, struct wl_callback *cb, uint32_t time) {
-    (void)time;
-    wl_callback_destroy(cb);
+static long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Block until Wayland events arrive, fd (if not -1) becomes readable or
+// timeout_ms passes (-1 waits forever), then dispatch the events. Returns 1
+// if either was ready, 0 on timeout or signal, -1 if the connection is gone.
+static int wayland_wait(struct wl_display *display, int fd, int timeout_ms) {
+    while (wl_display_prepare_read(display) != 0) {
+        if (wl_display_dispatch_pending(display) < 0)
+            return -1;
+    }
+    wl_display_flush(display);
 
-    if (running) {
-        struct wl_surface *surface = data;
-        struct wl_callback *new_cb = wl_surface_frame(surface);
-        static const struct wl_callback_listener listener = {.done = frame_done};
-        wl_callback_add_listener(new_cb, &listener, surface);
-        wl_surface_attach(surface, global_buffer, 0, 0);
-        wl_surface_commit(surface);
+    struct pollfd pfd[2] = {
+        {.fd = wl_display_get_fd(display), .events = POLLIN},
+        {.fd = fd, .events = POLLIN},
+    };
+    int ret = poll(pfd, 2, timeout_ms);
+    if (ret <= 0) {
+        wl_display_cancel_read(display);
+        return ret < 0 && errno != EINTR ? -1 : 0;
     }
+    if (pfd[0].revents & (POLLERR | POLLHUP)) {
+        wl_display_cancel_read(display);
+        return -1;
+    }
+    if (!(pfd[0].revents & POLLIN)) {
+        wl_display_cancel_read(display);
+        return 1;
+    }
+    if (wl_display_read_events(display) < 0 ||
+        wl_display_dispatch_pending(display) < 0)
+        return -1;
+    return 1;
 }
 
-// Load and scale a single image for grid view
-static ImageData* load_and_scale_image(const char *path, int target_width, int target_height) {
-    int w, h, ch;
-    unsigned char *img = stbi_load(path, &w, &h, &ch, 4);
-    if (!img) {
-        fprintf(stderr, "[imageviewer] Failed to load image: %s\n", path);
-        return NULL;
+// Wait up to a second for the first xdg_surface configure
+static int wayland_wait_configure(struct wl_display *display) {
+    long deadline = monotonic_ms() + 1000;
+    configured = 0;
+    while (!configured) {
+        long remaining = deadline - monotonic_ms();
+        if (remaining <= 0 || wayland_wait(display, -1, remaining) < 0)
+            break;
     }
+    return configured ? 0 : -1;
+}
 
-    ImageData *image = malloc(sizeof(ImageData));
-    if (!image) {
-        stbi_image_free(img);
-        return NULL;
+// Channel order of 32-bit images on the default X visual
+static int x11_scale_format(Display *dpy, ScaleFormat *format) {
+    int screen = DefaultScreen(dpy);
+    Visual *visual = DefaultVisual(dpy, screen);
+    int depth = DefaultDepth(dpy, screen);
+
+    int count = 0, bits_per_pixel = 0;
+    XPixmapFormatValues *formats = XListPixmapFormats(dpy, &count);
+    for (int i = 0; i < count; i++) {
+        if (formats[i].depth == depth)
+            bits_per_pixel = formats[i].bits_per_pixel;
     }
+    if (formats)
+        XFree(formats);
+
+    if (bits_per_pixel != 32 ||
+        scale_format_from_masks(visual->red_mask, visual->green_mask,
+                                visual->blue_mask,
+                                ImageByteOrder(dpy) == LSBFirst, format) < 0) {
+        fprintf(stderr, "[imageviewer] Unsupported X visual (depth %d)\n",
+                depth);
+        return -1;
+    }
+    return 0;
+}
 
-    image->width = target_width;
-    image->height = target_height;
-    image->channels = 4;
+// Grid Decode Pool
+// Grid cells are decoded and scaled in parallel, each worker claiming the
+// next undecoded cell and writing it straight into its place in the
+// composite buffer. Cells are independent, so no locking is needed. The
+// index of every finished cell is written to notify_fd, so the viewer can
+// show it while the others are still decoding.
+typedef struct {
+    const char **paths;
+    int count; // Number of cells to fill
+    int cols;
+    int cell_width;
+    int cell_height;
+    uint32_t *pixels; // Composite buffer
+    int stride;       // Composite buffer row length in pixels
+    const ScaleFormat *format; // Composite buffer pixel layout
+    int next;         // Next unclaimed cell, advanced atomically
+    int loaded;       // Cells decoded successfully, advanced atomically
+    int notify_fd;    // Pipe that finished cell indices are written to
+    pthread_t threads[GRID_WORKERS_MAX];
+    int num_threads;
+} GridDecoder;
+
+// Fill one grid cell from the image's thumbnail, which is made and cached on
+// first use and mapped straight from the cache after that
+static int decode_cell(GridDecoder *dec, int cell) {
+    Thumb thumb;
+    if (thumb_get(dec->paths[cell], dec->cell_width, dec->cell_height,
+                  scale_filter, thumb_cache_max > 0, &thumb) < 0) {
+        fprintf(stderr, "[imageviewer] Failed to load: %s\n", dec->paths[cell]);
+        return -1;
+    }
 
-    // Allocate memory for scaled image
-    image->data = malloc(target_width * target_height * 4);
-    if (!image->data) {
-        stbi_image_free(img);
-        free(image);
-        return NULL;
+    int start_x = (cell % dec->cols) * dec->cell_width;
+    int start_y = (cell / dec->cols) * dec->cell_height;
+    uint32_t *dst = dec->pixels + (size_t)start_y * dec->stride + start_x;
+
+    // Same size, so this only converts to the window's pixel format
+    Image image = {(unsigned char *)thumb.pixels, thumb.width, thumb.height};
+    int ret = scale_image(&image, 0, 0, thumb.width, thumb.height, dst,
+                          dec->cell_width, dec->cell_height, dec->stride * 4,
+                          SCALE_NEAREST, dec->format);
+    thumb_release(&thumb);
+    if (ret < 0) {
+        fprintf(stderr, "[imageviewer] Out of memory scaling: %s\n",
+                dec->paths[cell]);
+        return -1;
     }
+    return 0;
+}
 
-    // nearest-neighbor scaling for grid thumbnail
-    for (int y = 0; y < target_height; ++y) {
-        for (int x = 0; x < target_width; ++x) {
-            int src_x = (x * w) / target_width;
-            int src_y = (y * h) / target_height;
-            int src_idx = (src_y * w + src_x) * 4;
-            int dst_idx = (y * target_width + x) * 4;
+static void *grid_worker(void *arg) {
+    GridDecoder *dec = arg;
+    int cell;
+    while ((cell = __atomic_fetch_add(&dec->next, 1, __ATOMIC_RELAXED)) <
+           dec->count) {
+        if (decode_cell(dec, cell) == 0)
+            __atomic_fetch_add(&dec->loaded, 1, __ATOMIC_RELAXED);
+        if (write(dec->notify_fd, &cell, sizeof(cell)) < 0)
+            perror("[imageviewer] write");
+    }
+    return NULL;
+}
 
-            image->data[dst_idx + 0] = img[src_idx + 0];
-            image->data[dst_idx + 1] = img[src_idx + 1];
-            image->data[dst_idx + 2] = img[src_idx + 2];
-            image->data[dst_idx + 3] = img[src_idx + 3];
-        }
+// Start decoding paths into pixels in the background
+static void grid_decoder_start(GridDecoder *dec, const char **paths,
+                               int num_paths, int grid_cols, int grid_rows,
+                               int cell_width, int cell_height,
+                               uint32_t *pixels, int stride,
+                               const ScaleFormat *format, int notify_fd) {
+    dec->paths = paths;
+    dec->count = num_paths < grid_cols * grid_rows ? num_paths
+                                                   : grid_cols * grid_rows;
+    dec->cols = grid_cols;
+    dec->cell_width = cell_width;
+    dec->cell_height = cell_height;
+    dec->pixels = pixels;
+    dec->stride = stride;
+    dec->format = format;
+    dec->next = 0;
+    dec->loaded = 0;
+    dec->notify_fd = notify_fd;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = dec->count;
+    if (workers > cpus)
+        workers = cpus;
+    if (workers > GRID_WORKERS_MAX)
+        workers = GRID_WORKERS_MAX;
+
+    dec->num_threads = 0;
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&dec->threads[i], NULL, grid_worker, dec) != 0)
+            break;
+        dec->num_threads++;
     }
+}
+
+// Wait for all cells. Returns the number of images that could be loaded.
+static int grid_decoder_wait(GridDecoder *dec) {
+    grid_worker(dec); // Covers thread creation failures
+    for (int i = 0; i < dec->num_threads; i++)
+        pthread_join(dec->threads[i], NULL);
+    dec->num_threads = 0;
+    if (thumb_cache_max > 0)
+        thumb_cache_trim(thumb_cache_max);
+    return dec->loaded;
+}
 
-    stbi_image_free(img);
-    return image;
+// Stop handing out cells, and wait for the ones being decoded
+static void grid_decoder_cancel(GridDecoder *dec) {
+    __atomic_store_n(&dec->next, dec->count, __ATOMIC_RELAXED);
+    grid_decoder_wait(dec);
+}
+
+// Pipe for finished cells. Only the read end is non-blocking, workers
+// never have more than a few hundred ints in flight.
+static int create_notify_pipe(int fds[2]) {
+    if (pipe(fds) < 0)
+        return -1;
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    return 0;
+}
+
+// Read finished cell indices from the notify pipe into cells. Returns the
+// number read.
+static int read_finished_cells(int fd, int *cells, int max_cells) {
+    ssize_t got = read(fd, cells, max_cells * sizeof(*cells));
+    return got > 0 ? (int)(got / sizeof(*cells)) : 0;
+}
+
+// Frames of the Wayland grid. The workers decode into a private composite
+// buffer that the compositor never sees, and finished cells are copied into
+// a pool buffer it has released before that is committed, so no cell is
+// ever written while it may be on screen. Each pool buffer remembers the
+// cells it already holds, so only the ones it is missing are copied and
+// damaged.
+typedef struct {
+    struct wl_surface *surface;
+    ShmPool pool;
+    const uint32_t *pixels; // Composite buffer the workers write to
+    int width, height;
+    int cols, cell_width, cell_height;
+    int count;
+    unsigned char *done;    // Cells finished decoding, so safe to read
+    unsigned char *shown[SHM_POOL_MAX]; // Cells each pool buffer holds
+    struct wl_buffer *filled[SHM_POOL_MAX]; // Buffer shown[] applies to
+    int pending;            // Finished cells not shown yet
+} GridFrame;
+
+static void grid_present(GridFrame *frame) {
+    ShmBuffer *buf = shm_pool_acquire(&frame->pool, frame->width,
+                                      frame->height);
+    if (!buf) {
+        frame->pending = 1; // Shown once a buffer is released
+        return;
+    }
+    frame->pending = 0;
+
+    int index = buf - frame->pool.buffers;
+    unsigned char *shown = frame->shown[index];
+    uint32_t *dst = buf->data;
+    int stride = buf->stride / 4;
+    if (frame->filled[index] != buf->buffer) {
+        // A new buffer: background first, then every finished cell
+        for (int y = 0; y < frame->height; y++)
+            for (int x = 0; x < frame->width; x++)
+                dst[(size_t)y * stride + x] = GRID_BACKGROUND;
+        memset(shown, 0, frame->count);
+        frame->filled[index] = buf->buffer;
+        wl_surface_damage_buffer(frame->surface, 0, 0, frame->width,
+                                 frame->height);
+    }
+    for (int cell = 0; cell < frame->count; cell++) {
+        if (!frame->done[cell] || shown[cell])
+            continue;
+        int x = (cell % frame->cols) * frame->cell_width;
+        int y = (cell / frame->cols) * frame->cell_height;
+        for (int row = y; row < y + frame->cell_height; row++)
+            memcpy(dst + (size_t)row * stride + x,
+                   frame->pixels + (size_t)row * frame->width + x,
+                   (size_t)frame->cell_width * 4);
+        shown[cell] = 1;
+        wl_surface_damage_buffer(frame->surface, x, y, frame->cell_width,
+                                 frame->cell_height);
+    }
+
+    wl_surface_attach(frame->surface, buf->buffer, 0, 0);
+    wl_surface_commit(frame->surface);
+}
+
+static void grid_buffer_released(void *data) {
+    GridFrame *frame = data;
+    if (frame->pending)
+        grid_present(frame);
 }
 
 // Wayland grid viewer
@@ -315,8 +851,10 @@ static int run_wayland_grid_viewer(const char **paths, int num_paths,
     }
 
     // Calculate total grid dimensions
-    int cell_width = requested_width > 0 ? requested_width / grid_cols : 400;
-    int cell_height = requested_height > 0 ? requested_height / grid_rows : 300;
+    int cell_width = requested_width > 0 ? requested_width / grid_cols
+                                         : THUMB_WIDTH;
+    int cell_height = requested_height > 0 ? requested_height / grid_rows
+                                           : THUMB_HEIGHT;
     int display_w = cell_width * grid_cols;
     int display_h = cell_height * grid_rows;
 
@@ -328,40 +866,44 @@ static int run_wayland_grid_viewer(const char **paths, int num_paths,
     fprintf(stderr, "[imageviewer] Cell size: %dx%d, Total: %dx%d\n",
             cell_width, cell_height, display_w, display_h);
 
-    // Load all images
-    ImageData **images = malloc(num_paths * sizeof(ImageData*));
-    if (!images) {
-        fprintf(stderr, "[imageviewer] Memory allocation failed\n");
+    // Create composite buffer for grid. The decode pool fills it in while
+    // the Wayland connection is being set up.
+    uint32_t *dst = malloc((size_t)display_w * display_h * sizeof(*dst));
+    // Finished cells, then the cells held by each pool buffer
+    int max_cells = grid_cols * grid_rows;
+    unsigned char *done = calloc((size_t)max_cells * (1 + SHM_POOL_MAX), 1);
+    if (!dst || !done) {
+        fprintf(stderr, "[imageviewer] Out of memory\n");
+        free(dst);
+        free(done);
         return 1;
     }
 
-    int loaded_images = 0;
-    for (int i = 0; i < num_paths; i++) {
-        images[i] = load_and_scale_image(paths[i], cell_width, cell_height);
-        if (images[i]) {
-            loaded_images++;
-        } else {
-            fprintf(stderr, "[imageviewer] Failed to load: %s\n", paths[i]);
-            images[i] = NULL;
-        }
-    }
+    // Clear background (dark gray), which cells that fail to load keep
+    for (size_t i = 0; i < (size_t)display_w * display_h; i++)
+        dst[i] = GRID_BACKGROUND;
 
-    if (loaded_images == 0) {
-        fprintf(stderr, "[imageviewer] No images could be loaded\n");
-        free(images);
+    int notify[2];
+    if (create_notify_pipe(notify) < 0) {
+        perror("[imageviewer] pipe");
+        free(dst);
+        free(done);
         return 1;
     }
 
+    GridDecoder decoder;
+    grid_decoder_start(&decoder, paths, num_paths, grid_cols, grid_rows,
+                       cell_width, cell_height, dst, display_w,
+                       &scale_argb8888, notify[1]);
+
     struct wl_display *display = wl_display_connect(NULL);
     if (!display) {
         fprintf(stderr, "[imageviewer] wl_display_connect failed\n");
-        for (int i = 0; i < num_paths; i++) {
-            if (images[i]) {
-                free(images[i]->data);
-                free(images[i]);
-            }
-        }
-        free(images);
+        grid_decoder_cancel(&decoder);
+        close(notify[0]);
+        close(notify[1]);
+        free(dst);
+        free(done);
         return 1;
     }
 
@@ -371,107 +913,31 @@ static int run_wayland_grid_viewer(const char **paths, int num_paths,
 
     if (!compositor || !shm || !wm_base) {
         fprintf(stderr, "[imageviewer] Missing Wayland globals\n");
-        for (int i = 0; i < num_paths; i++) {
-            if (images[i]) {
-                free(images[i]->data);
-                free(images[i]);
-            }
-        }
-        free(images);
+        grid_decoder_cancel(&decoder);
+        close(notify[0]);
+        close(notify[1]);
+        free(dst);
+        free(done);
         wl_display_disconnect(display);
         return 1;
     }
     wl_display_roundtrip(display);
 
-    // Create composite buffer for grid
-    int stride = display_w * 4;
-    int size = stride * display_h;
-    int fd = create_shm_file(size);
-    if (fd < 0) {
-        fprintf(stderr, "[imageviewer] create_shm_file failed\n");
-        for (int i = 0; i < num_paths; i++) {
-            if (images[i]) {
-                free(images[i]->data);
-                free(images[i]);
-            }
-        }
-        free(images);
-        wl_display_disconnect(display);
-        return 1;
-    }
-
-    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (map == MAP_FAILED) {
-        perror("[imageviewer] mmap");
-        close(fd);
-        for (int i = 0; i < num_paths; i++) {
-            if (images[i]) {
-                free(images[i]->data);
-                free(images[i]);
-            }
-        }
-        free(images);
-        wl_display_disconnect(display);
-        return 1;
-    }
-
-    // Clear background (dark gray)
-    uint32_t *dst = map;
-    for (int y = 0; y < display_h; ++y) {
-        for (int x = 0; x < display_w; ++x) {
-            dst[y * display_w + x] = 0xFF202020; // ARGB: dark gray
-        }
-    }
-
-    // Composite all images into grid
-    int images_placed = 0;
-    for (int row = 0; row < grid_rows; row++) {
-        for (int col = 0; col < grid_cols; col++) {
-            if (images_placed >= num_paths) break;
-
-            int img_index = row * grid_cols + col;
-            if (img_index >= num_paths || !images[img_index]) continue;
-
-            int start_x = col * cell_width;
-            int start_y = row * cell_height;
-
-            ImageData *img = images[img_index];
-            uint32_t *src_pixels = (uint32_t*)img->data;
-
-            // Copy image to grid cell
-            for (int y = 0; y < cell_height && y < img->height; y++) {
-                for (int x = 0; x < cell_width && x < img->width; x++) {
-                    int dst_idx = (start_y + y) * display_w + (start_x + x);
-                    int src_idx = y * img->width + x;
-
-                    // Only copy if pixel is not fully transparent
-                    if ((src_pixels[src_idx] >> 24) > 0) {
-                        dst[dst_idx] = src_pixels[src_idx];
-                    }
-                }
-            }
-            images_placed++;
-        }
-        if (images_placed >= num_paths) break;
-    }
-
-    // Free image data
-    for (int i = 0; i < num_paths; i++) {
-        if (images[i]) {
-            free(images[i]->data);
-            free(images[i]);
-        }
-    }
-    free(images);
-
-    struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, size);
-    struct wl_buffer *buffer = wl_shm_pool_create_buffer(
-        pool, 0, display_w, display_h, stride, WL_SHM_FORMAT_ARGB8888);
-    global_buffer = buffer;
-    wl_shm_pool_destroy(pool);
-    close(fd);
-
     struct wl_surface *surface = wl_compositor_create_surface(compositor);
+    GridFrame frame = {.surface = surface,
+                       .pixels = dst,
+                       .width = display_w,
+                       .height = display_h,
+                       .cols = grid_cols,
+                       .cell_width = cell_width,
+                       .cell_height = cell_height,
+                       .count = decoder.count,
+                       .done = done};
+    for (int i = 0; i < SHM_POOL_MAX; i++)
+        frame.shown[i] = done + (size_t)max_cells * (1 + i);
+    shm_pool_init(&frame.pool, shm, WL_SHM_FORMAT_ARGB8888, 2);
+    frame.pool.release = grid_buffer_released;
+    frame.pool.data = &frame;
     int wh[2] = {display_w, display_h};
     struct xdg_surface *xdg_surface =
         xdg_wm_base_get_xdg_surface(wm_base, surface);
@@ -493,35 +959,23 @@ static int run_wayland_grid_viewer(const char **paths, int num_paths,
     wl_display_flush(display);
 
     // Wait for first configure
-    configured = 0;
-    int timeout = 0;
-    while (!configured && timeout < 100) {
-        wl_display_dispatch(display);
-        wl_display_flush(display);
-        usleep(10000);
-        timeout++;
-    }
-
-    if (!configured) {
+    if (wayland_wait_configure(display) < 0) {
         fprintf(stderr, "[imageviewer] Timeout waiting for configure\n");
-        munmap(map, size);
-        wl_buffer_destroy(buffer);
+        grid_decoder_cancel(&decoder);
+        close(notify[0]);
+        close(notify[1]);
+        shm_pool_finish(&frame.pool);
+        free(dst);
+        free(done);
         if (keyboard) wl_keyboard_destroy(keyboard);
         if (seat) wl_seat_destroy(seat);
         wl_display_disconnect(display);
         return 1;
     }
 
-    // Attach buffer
-    wl_surface_attach(surface, buffer, 0, 0);
-    wl_surface_commit(surface);
-    wl_display_flush(display);
-
-    // Set up frame callback
-    struct wl_callback *cb = wl_surface_frame(surface);
-    static const struct wl_callback_listener listener = {.done = frame_done};
-    wl_callback_add_listener(cb, &listener, surface);
-    wl_surface_commit(surface);
+    // Show the placeholder grid right away, cells are filled in as they
+    // finish decoding
+    grid_present(&frame);
     wl_display_flush(display);
 
     // Set up signal handler
@@ -530,21 +984,46 @@ static int run_wayland_grid_viewer(const char **paths, int num_paths,
     sigaction(SIGINT, &sa, NULL);
 
     fprintf(stderr,
-            "[imageviewer] Grid view shown (%dx%d, %d images). Press 'q' or ESC to exit.\n",
-            display_w, display_h, loaded_images);
+            "[imageviewer] Grid view shown (%dx%d). Press 'q' or ESC to exit.\n",
+            display_w, display_h);
 
     // Main loop
+    int ret = 0;
+    int cells_done = 0;
+    int cells_fd = notify[0]; // -1 once every cell is in
     while (running) {
-        wl_display_dispatch(display);
-        wl_display_flush(display);
-        usleep(10000);
+        if (wayland_wait(display, cells_fd, -1) < 0)
+            break;
+        if (cells_fd < 0)
+            continue;
+
+        int cells[64];
+        int count = read_finished_cells(notify[0], cells, 64);
+        for (int i = 0; i < count; i++)
+            done[cells[i]] = 1;
+        if (count > 0)
+            grid_present(&frame);
+
+        cells_done += count;
+        if (cells_done >= decoder.count) {
+            cells_fd = -1; // All decoded
+            if (decoder.loaded == 0) {
+                fprintf(stderr, "[imageviewer] No images could be loaded\n");
+                ret = 1;
+                running = 0;
+            }
+        }
     }
 
     fprintf(stderr, "[imageviewer] Exiting...\n");
 
     // Cleanup
-    munmap(map, size);
-    wl_buffer_destroy(buffer);
+    grid_decoder_cancel(&decoder);
+    close(notify[0]);
+    close(notify[1]);
+    shm_pool_finish(&frame.pool);
+    free(dst);
+    free(done);
     if (keyboard) {
         wl_keyboard_destroy(keyboard);
     }
@@ -552,7 +1031,7 @@ static int run_wayland_grid_viewer(const char **paths, int num_paths,
         wl_seat_destroy(seat);
     }
     wl_display_disconnect(display);
-    return 0;
+    return ret;
 }
 
 // X11 grid viewer
@@ -566,8 +1045,10 @@ static int run_x11_grid_viewer(const char **paths, int num_paths,
     }
 
     // Calculate total grid dimensions
-    int cell_width = requested_width > 0 ? requested_width / grid_cols : 400;
-    int cell_height = requested_height > 0 ? requested_height / grid_rows : 300;
+    int cell_width = requested_width > 0 ? requested_width / grid_cols
+                                         : THUMB_WIDTH;
+    int cell_height = requested_height > 0 ? requested_height / grid_rows
+                                           : THUMB_HEIGHT;
     int display_w = cell_width * grid_cols;
     int display_h = cell_height * grid_rows;
 
@@ -577,119 +1058,224 @@ static int run_x11_grid_viewer(const char **paths, int num_paths,
     fprintf(stderr, "[imageviewer] Grid view: %dx%d cells, %d images\n", 
             grid_cols, grid_rows, num_paths);
 
+    // Cells are scaled in the visual's channel order, so the display has to
+    // be known before decoding starts
     Display *dpy = XOpenDisplay(NULL);
     if (!dpy) {
         fprintf(stderr, "[imageviewer] Cannot open X11 display\n");
         return 1;
     }
+    ScaleFormat format;
+    if (x11_scale_format(dpy, &format) < 0) {
+        XCloseDisplay(dpy);
+        return 1;
+    }
 
-    int screen = DefaultScreen(dpy);
-    Window root = RootWindow(dpy, screen);
-    Window win =
-        XCreateSimpleWindow(dpy, root, 50, 50, display_w, display_h, 1,
-                          BlackPixel(dpy, screen), BlackPixel(dpy, screen));
-    XSelectInput(dpy, win, ExposureMask | KeyPressMask | ButtonPressMask);
-    XMapWindow(dpy, win);
-
-    // Create composite image for grid
-    unsigned char *composite_img = malloc(display_w * display_h * 4);
-    if (!composite_img) {
+    // Create composite image for grid. Workers write into it until their
+    // cell is reported, so only cells marked done are ever sent to X.
+    uint32_t *composite_img = malloc((size_t)display_w * display_h * 4);
+    unsigned char *done = calloc((size_t)grid_cols * grid_rows, 1);
+    if (!composite_img || !done) {
         fprintf(stderr, "[imageviewer] Memory allocation failed\n");
-        XDestroyWindow(dpy, win);
+        free(composite_img);
+        free(done);
         XCloseDisplay(dpy);
         return 1;
     }
 
-    // Clear background (dark gray)
-    for (int i = 0; i < display_w * display_h * 4; i += 4) {
-        composite_img[i] = 32;     // R
-        composite_img[i+1] = 32;   // G
-        composite_img[i+2] = 32;   // B
-        composite_img[i+3] = 255;  // A
+    // Clear background (dark gray, the same in any channel order)
+    for (int i = 0; i < display_w * display_h; i++) {
+        composite_img[i] = GRID_BACKGROUND;
     }
 
-    // Load and composite images
-    int images_placed = 0;
-    for (int row = 0; row < grid_rows; row++) {
-        for (int col = 0; col < grid_cols; col++) {
-            if (images_placed >= num_paths) break;
+    int notify[2];
+    if (create_notify_pipe(notify) < 0) {
+        perror("[imageviewer] pipe");
+        free(composite_img);
+        free(done);
+        XCloseDisplay(dpy);
+        return 1;
+    }
 
-            const char *path = paths[images_placed];
-            int w, h, ch;
-            unsigned char *img = stbi_load(path, &w, &h, &ch, 4);
-            if (!img) {
-                fprintf(stderr, "[imageviewer] Failed to load: %s\n", path);
-                images_placed++;
-                continue;
-            }
+    // Decode in the background while the window is created
+    GridDecoder decoder;
+    grid_decoder_start(&decoder, paths, num_paths, grid_cols, grid_rows,
+                       cell_width, cell_height, composite_img, display_w,
+                       &format, notify[1]);
 
-            int start_x = col * cell_width;
-            int start_y = row * cell_height;
-
-            // Simple scaling
-            for (int y = 0; y < cell_height; y++) {
-                for (int x = 0; x < cell_width; x++) {
-                    int src_x = (x * w) / cell_width;
-                    int src_y = (y * h) / cell_height;
-                    int src_idx = (src_y * w + src_x) * 4;
-                    int dst_idx = ((start_y + y) * display_w + (start_x + x)) * 4;
-
-                    // Only copy if pixel is not fully transparent
-                    if (img[src_idx + 3] > 0) {
-                        composite_img[dst_idx] = img[src_idx];
-                        composite_img[dst_idx + 1] = img[src_idx + 1];
-                        composite_img[dst_idx + 2] = img[src_idx + 2];
-                        composite_img[dst_idx + 3] = img[src_idx + 3];
-                    }
-                }
-            }
-            stbi_image_free(img);
-            images_placed++;
-        }
-    }
+    int screen = DefaultScreen(dpy);
+    Window root = RootWindow(dpy, screen);
+    Window win =
+        XCreateSimpleWindow(dpy, root, 50, 50, display_w, display_h, 1,
+                          BlackPixel(dpy, screen), BlackPixel(dpy, screen));
+    XSelectInput(dpy, win, ExposureMask | KeyPressMask | ButtonPressMask);
 
     XImage *xim =
         XCreateImage(dpy, DefaultVisual(dpy, screen), DefaultDepth(dpy, screen),
                    ZPixmap, 0, (char*)composite_img, display_w, display_h, 32, 0);
     if (!xim) {
         fprintf(stderr, "[imageviewer] XCreateImage failed\n");
+        grid_decoder_cancel(&decoder);
+        close(notify[0]);
+        close(notify[1]);
         free(composite_img);
+        free(done);
         XDestroyWindow(dpy, win);
         XCloseDisplay(dpy);
         return 1;
     }
 
-    GC gc = XCreateGC(dpy, win, 0, NULL);
+    // The placeholder color, the same in any channel order
+    XGCValues gc_values = {.foreground = GRID_BACKGROUND & 0xFFFFFF};
+    GC gc = XCreateGC(dpy, win, GCForeground, &gc_values);
     if (!gc) {
         fprintf(stderr, "[imageviewer] XCreateGC failed\n");
+        grid_decoder_cancel(&decoder);
+        close(notify[0]);
+        close(notify[1]);
         XDestroyImage(xim);
+        free(done);
         XDestroyWindow(dpy, win);
         XCloseDisplay(dpy);
         return 1;
     }
 
-    XEvent ev;
-    while (1) {
-        XNextEvent(dpy, &ev);
-        if (ev.type == Expose)
-            XPutImage(dpy, win, gc, xim, 0, 0, 0, 0, display_w, display_h);
-        if (ev.type == KeyPress || ev.type == ButtonPress)
+    // Map the placeholder grid right away, cells are drawn as they finish
+    XMapWindow(dpy, win);
+    XFlush(dpy);
+
+    int ret = 0;
+    int cells_done = 0;
+    int quit = 0;
+    struct pollfd fds[2] = {
+        {.fd = ConnectionNumber(dpy), .events = POLLIN},
+        {.fd = notify[0], .events = POLLIN},
+    };
+    while (!quit) {
+        XEvent ev;
+        while (XPending(dpy)) {
+            XNextEvent(dpy, &ev);
+            if (ev.type == Expose && ev.xexpose.count == 0) {
+                XFillRectangle(dpy, win, gc, 0, 0, display_w, display_h);
+                for (int cell = 0; cell < decoder.count; cell++) {
+                    if (!done[cell])
+                        continue;
+                    int x = (cell % grid_cols) * cell_width;
+                    int y = (cell / grid_cols) * cell_height;
+                    XPutImage(dpy, win, gc, xim, x, y, x, y, cell_width,
+                              cell_height);
+                }
+            }
+            if (ev.type == KeyPress || ev.type == ButtonPress)
+                quit = 1;
+        }
+        if (quit)
+            break;
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
             break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            int cells[64];
+            int count = read_finished_cells(notify[0], cells, 64);
+            for (int i = 0; i < count; i++) {
+                done[cells[i]] = 1;
+                int x = (cells[i] % grid_cols) * cell_width;
+                int y = (cells[i] / grid_cols) * cell_height;
+                XPutImage(dpy, win, gc, xim, x, y, x, y, cell_width,
+                          cell_height);
+            }
+            XFlush(dpy);
+
+            cells_done += count;
+            if (cells_done >= decoder.count) {
+                fds[1].fd = -1; // All decoded
+                if (decoder.loaded == 0) {
+                    fprintf(stderr, "[imageviewer] No images could be loaded\n");
+                    ret = 1;
+                    quit = 1;
+                }
+            }
+        }
     }
 
+    grid_decoder_cancel(&decoder);
+    close(notify[0]);
+    close(notify[1]);
     XDestroyImage(xim);
+    free(done);
     XFreeGC(dpy, gc);
     XDestroyWindow(dpy, win);
     XCloseDisplay(dpy);
-    return 0;
+    return ret;
+}
+
+// Wayland side of the view
+static void view_surface_configure(void *data, struct xdg_surface *surface,
+                                   uint32_t serial) {
+    View *view = data;
+    xdg_surface_ack_configure(surface, serial);
+    configured = 1;
+    view->dirty = 1;
+}
+
+static const struct xdg_surface_listener view_surface_listener = {
+    .configure = view_surface_configure};
+
+static void view_toplevel_configure(void *data, struct xdg_toplevel *toplevel,
+                                    int32_t width, int32_t height,
+                                    struct wl_array *states) {
+    (void)toplevel;
+    (void)states;
+    // 0 leaves the size to us
+    if (width > 0 && height > 0)
+        view_resize(data, width, height);
+}
+
+static const struct xdg_toplevel_listener view_toplevel_listener = {
+    .configure = view_toplevel_configure, .close = xdg_toplevel_close};
+
+static void view_frame_done(void *data, struct wl_callback *cb,
+                            uint32_t time) {
+    (void)data;
+    (void)time;
+    wl_callback_destroy(cb);
+    frame_pending = 0;
+}
+
+static const struct wl_callback_listener view_frame_listener = {
+    .done = view_frame_done};
+
+// Draw and commit the view if it changed and the compositor is ready for a
+// new frame, which keeps interactive resizing at the display's frame rate
+static void view_present(View *view, struct wl_surface *surface,
+                         ShmPool *pool) {
+    if (!view->dirty || frame_pending)
+        return;
+    ShmBuffer *buf = shm_pool_acquire(pool, view->width, view->height);
+    if (!buf)
+        return; // Both buffers are still shown, retried once one is released
+
+    if (view_render(view, buf->data, buf->stride, VIEW_BACKGROUND,
+                    &scale_argb8888) < 0)
+        fprintf(stderr, "[imageviewer] Out of memory scaling image\n");
+
+    wl_surface_attach(surface, buf->buffer, 0, 0);
+    wl_surface_damage_buffer(surface, 0, 0, view->width, view->height);
+    struct wl_callback *cb = wl_surface_frame(surface);
+    wl_callback_add_listener(cb, &view_frame_listener, NULL);
+    frame_pending = 1;
+    wl_surface_commit(surface);
 }
 
 // Wayland viewer for single image
 static int run_wayland_viewer(const char *path, int requested_width,
                               int requested_height) {
-    int w, h, ch;
-    unsigned char *img = stbi_load(path, &w, &h, &ch, 4);
-    if (!img) {
+    int w, h;
+    if (image_info(path, &w, &h) < 0) {
         fprintf(stderr, "[imageviewer] Failed to load image: %s\n", path);
         return 1;
     }
@@ -737,10 +1323,16 @@ static int run_wayland_viewer(const char *path, int requested_width,
         }
     }
 
+    View view;
+    if (view_init(&view, path, display_w, display_h) < 0) {
+        fprintf(stderr, "[imageviewer] Failed to load image: %s\n", path);
+        return 1;
+    }
+
     struct wl_display *display = wl_display_connect(NULL);
     if (!display) {
         fprintf(stderr, "[imageviewer] wl_display_connect failed\n");
-        stbi_image_free(img);
+        view_free(&view);
         return 1;
     }
 
@@ -750,106 +1342,52 @@ static int run_wayland_viewer(const char *path, int requested_width,
 
     if (!compositor || !shm || !wm_base) {
         fprintf(stderr, "[imageviewer] Missing Wayland globals\n");
-        stbi_image_free(img);
+        view_free(&view);
         wl_display_disconnect(display);
         return 1;
     }
     wl_display_roundtrip(display);
 
-    // Create scaled image buffer
-    int stride = display_w * 4;
-    int size = stride * display_h;
-    int fd = create_shm_file(size);
-    if (fd < 0) {
-        fprintf(stderr, "[imageviewer] create_shm_file failed\n");
-        stbi_image_free(img);
-        wl_display_disconnect(display);
-        return 1;
-    }
-
-    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (map == MAP_FAILED) {
-        perror("[imageviewer] mmap");
-        close(fd);
-        stbi_image_free(img);
-        wl_display_disconnect(display);
-        return 1;
-    }
-
-    // Simple nearest-neighbor scaling
-    uint32_t *dst = map;
-    for (int y = 0; y < display_h; ++y) {
-        for (int x = 0; x < display_w; ++x) {
-            int src_x = (x * w) / display_w;
-            int src_y = (y * h) / display_h;
-            int idx = (src_y * w + src_x) * 4;
-            uint8_t r = img[idx + 0], g = img[idx + 1], b = img[idx + 2],
-                    a = img[idx + 3];
-            dst[y * display_w + x] = ((uint32_t)a << 24) | ((uint32_t)r << 16) |
-                                   ((uint32_t)g << 8) | (uint32_t)b;
-        }
-    }
-    stbi_image_free(img);
-
-    struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, size);
-    struct wl_buffer *buffer = wl_shm_pool_create_buffer(
-        pool, 0, display_w, display_h, stride, WL_SHM_FORMAT_ARGB8888);
-    global_buffer = buffer;
-    wl_shm_pool_destroy(pool);
-    close(fd);
+    ShmPool pool;
+    shm_pool_init(&pool, shm, WL_SHM_FORMAT_ARGB8888, 2);
 
     struct wl_surface *surface = wl_compositor_create_surface(compositor);
-    int wh[2] = {display_w, display_h};
     struct xdg_surface *xdg_surface =
         xdg_wm_base_get_xdg_surface(wm_base, surface);
-    xdg_surface_add_listener(xdg_surface, &xdg_surface_listener, wh);
+    xdg_surface_add_listener(xdg_surface, &view_surface_listener, &view);
 
     struct xdg_toplevel *toplevel = xdg_surface_get_toplevel(xdg_surface);
     xdg_toplevel_set_title(toplevel, "Image Viewer");
-    xdg_toplevel_add_listener(toplevel, &toplevel_listener, wh);
-
-    // Set window geometry to match scaled image size
-    xdg_surface_set_window_geometry(xdg_surface, 0, 0, display_w, display_h);
-
-    // Set size hints
-    xdg_toplevel_set_min_size(toplevel, display_w, display_h);
-    xdg_toplevel_set_max_size(toplevel, display_w, display_h);
+    xdg_toplevel_add_listener(toplevel, &view_toplevel_listener, &view);
+    xdg_toplevel_set_min_size(toplevel, VIEW_MIN_SIZE, VIEW_MIN_SIZE);
 
     // Commit initial state
     wl_surface_commit(surface);
     wl_display_flush(display);
 
     // Wait for first configure
-    configured = 0;
-    int timeout = 0;
-    while (!configured && timeout < 100) {
-        wl_display_dispatch(display);
-        wl_display_flush(display);
-        usleep(10000);
-        timeout++;
-    }
-
-    if (!configured) {
+    if (wayland_wait_configure(display) < 0) {
         fprintf(stderr, "[imageviewer] Timeout waiting for configure\n");
-        munmap(map, size);
-        wl_buffer_destroy(buffer);
+        shm_pool_finish(&pool);
+        view_free(&view);
         if (keyboard) wl_keyboard_destroy(keyboard);
         if (seat) wl_seat_destroy(seat);
         wl_display_disconnect(display);
         return 1;
     }
-
-    // Attach buffer
-    wl_surface_attach(surface, buffer, 0, 0);
-    wl_surface_commit(surface);
-    wl_display_flush(display);
-
-    // Set up frame callback
-    struct wl_callback *cb = wl_surface_frame(surface);
-    static const struct wl_callback_listener listener = {.done = frame_done};
-    wl_callback_add_listener(cb, &listener, surface);
-    wl_surface_commit(surface);
+    active_view = &view;
+    view_present(&view, surface, &pool);
     wl_display_flush(display);
+    if (view_build_start(&view) < 0) {
+        perror("[imageviewer] pipe");
+        active_view = NULL;
+        shm_pool_finish(&pool);
+        view_free(&view);
+        if (keyboard) wl_keyboard_destroy(keyboard);
+        if (seat) wl_seat_destroy(seat);
+        wl_display_disconnect(display);
+        return 1;
+    }
 
     // Set up signal handler
     struct sigaction sa = {0};
@@ -857,21 +1395,56 @@ static int run_wayland_viewer(const char *path, int requested_width,
     sigaction(SIGINT, &sa, NULL);
 
     fprintf(stderr,
-            "[imageviewer] Image shown (%dx%d). Press 'q' or ESC to exit.\n",
-            display_w, display_h);
-
-    // Main loop
+            "[imageviewer] Image shown (%dx%d). +/- zoom, arrows pan, 0 resets, "
+            "'q' or ESC exits.\n",
+            view.width, view.height);
+
+    // Main loop: sleep until the compositor sends something, and redraw
+    // only when a resize or key changed the view
+    long start = monotonic_ms();
+    long deadline = idle_benchmark > 0 ? start + idle_benchmark * 1000L : -1;
+    struct rusage usage_start;
+    getrusage(RUSAGE_SELF, &usage_start);
+    int wakeups = 0;
+    int ret = 0;
     while (running) {
-        wl_display_dispatch(display);
-        wl_display_flush(display);
-        usleep(10000);
+        int timeout = -1;
+        if (deadline >= 0) {
+            long remaining = deadline - monotonic_ms();
+            if (remaining <= 0)
+                break;
+            timeout = remaining;
+        }
+        if (wayland_wait(display, view.build_fds[0], timeout) < 0)
+            break;
+        wakeups++;
+        if (!view.mip.count && view_build_finish(&view) < 0) {
+            fprintf(stderr, "[imageviewer] Failed to load image: %s\n", path);
+            ret = 1;
+            break;
+        }
+        view_present(&view, surface, &pool);
+    }
+
+    if (idle_benchmark > 0) {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        double seconds = (monotonic_ms() - start) / 1000.0;
+        double cpu_ms =
+            (usage.ru_utime.tv_sec - usage_start.ru_utime.tv_sec +
+             usage.ru_stime.tv_sec - usage_start.ru_stime.tv_sec) * 1000.0 +
+            (usage.ru_utime.tv_usec - usage_start.ru_utime.tv_usec +
+             usage.ru_stime.tv_usec - usage_start.ru_stime.tv_usec) / 1000.0;
+        printf("[imageviewer] Idle %.1fs: %d wakeups (%.2f/s), %.1f ms CPU\n",
+               seconds, wakeups, wakeups / seconds, cpu_ms);
     }
 
     fprintf(stderr, "[imageviewer] Exiting...\n");
 
     // Cleanup
-    munmap(map, size);
-    wl_buffer_destroy(buffer);
+    active_view = NULL;
+    shm_pool_finish(&pool);
+    view_free(&view);
     if (keyboard) {
         wl_keyboard_destroy(keyboard);
     }
@@ -879,15 +1452,38 @@ static int run_wayland_viewer(const char *path, int requested_width,
         wl_seat_destroy(seat);
     }
     wl_display_disconnect(display);
-    return 0;
+    return ret;
+}
+
+// Draw the view into xim, recreating it at the window size if needed
+static int x11_render_view(Display *dpy, View *view, const ScaleFormat *format,
+                           XImage **xim) {
+    if (!*xim || (*xim)->width != view->width ||
+        (*xim)->height != view->height) {
+        if (*xim)
+            XDestroyImage(*xim);
+        int screen = DefaultScreen(dpy);
+        *xim = XCreateImage(dpy, DefaultVisual(dpy, screen),
+                            DefaultDepth(dpy, screen), ZPixmap, 0, NULL,
+                            view->width, view->height, 32, 0);
+        if (!*xim)
+            return -1;
+        (*xim)->data = malloc((size_t)(*xim)->bytes_per_line * view->height);
+        if (!(*xim)->data) {
+            XDestroyImage(*xim);
+            *xim = NULL;
+            return -1;
+        }
+    }
+    // Zero is black in any 24-bit visual
+    return view_render(view, (*xim)->data, (*xim)->bytes_per_line, 0, format);
 }
 
 // X11 viewer for single image
 static int run_x11_viewer(const char *path, int requested_width,
                           int requested_height) {
-    int w, h, ch;
-    unsigned char *img = stbi_load(path, &w, &h, &ch, 4);
-    if (!img) {
+    int w, h;
+    if (image_info(path, &w, &h) < 0) {
         fprintf(stderr, "[imageviewer] Failed to load: %s\n", path);
         return 1;
     }
@@ -922,10 +1518,16 @@ static int run_x11_viewer(const char *path, int requested_width,
         }
     }
 
+    View view;
+    if (view_init(&view, path, display_w, display_h) < 0) {
+        fprintf(stderr, "[imageviewer] Failed to load: %s\n", path);
+        return 1;
+    }
+
     Display *dpy = XOpenDisplay(NULL);
     if (!dpy) {
         fprintf(stderr, "[imageviewer] Cannot open X11 display\n");
-        stbi_image_free(img);
+        view_free(&view);
         return 1;
     }
 
@@ -934,62 +1536,132 @@ static int run_x11_viewer(const char *path, int requested_width,
     Window win =
         XCreateSimpleWindow(dpy, root, 50, 50, display_w, display_h, 1,
                           BlackPixel(dpy, screen), BlackPixel(dpy, screen));
-    XSelectInput(dpy, win, ExposureMask | KeyPressMask | ButtonPressMask);
+    XSelectInput(dpy, win,
+                 ExposureMask | KeyPressMask | ButtonPressMask |
+                     StructureNotifyMask);
     XMapWindow(dpy, win);
 
-    // Scale image to display dimensions
-    unsigned char *scaled_img = malloc(display_w * display_h * 4);
-    if (!scaled_img) {
-        fprintf(stderr, "[imageviewer] Memory allocation failed\n");
-        stbi_image_free(img);
-        return 1;
-    }
-
-    // Simple nearest-neighbor scaling
-    for (int y = 0; y < display_h; ++y) {
-        for (int x = 0; x < display_w; ++x) {
-            int src_x = (x * w) / display_w;
-            int src_y = (y * h) / display_h;
-            int src_idx = (src_y * w + src_x) * 4;
-            int dst_idx = (y * display_w + x) * 4;
-
-            scaled_img[dst_idx + 0] = img[src_idx + 0];
-            scaled_img[dst_idx + 1] = img[src_idx + 1];
-            scaled_img[dst_idx + 2] = img[src_idx + 2];
-            scaled_img[dst_idx + 3] = img[src_idx + 3];
-        }
-    }
-
-    stbi_image_free(img);
-
-    XImage *xim =
-        XCreateImage(dpy, DefaultVisual(dpy, screen), DefaultDepth(dpy, screen), ZPixmap, 0, scaled_img, display_w, display_h, 32, 0);
-    if (!xim) {
-        fprintf(stderr, "[imageviewer] XCreateImage failed\n");
-        free(scaled_img);
+    ScaleFormat format;
+    if (x11_scale_format(dpy, &format) < 0) {
+        view_free(&view);
+        XDestroyWindow(dpy, win);
+        XCloseDisplay(dpy);
         return 1;
     }
 
     GC gc = XCreateGC(dpy, win, 0, NULL);
     if (!gc) {
         fprintf(stderr, "[imageviewer] XCreateGC failed\n");
-        XDestroyImage(xim);
+        view_free(&view);
+        XDestroyWindow(dpy, win);
+        XCloseDisplay(dpy);
         return 1;
     }
 
+    // Handle each batch of events, then redraw once if the view changed.
+    // While idle, wait for both X events and the pyramid build.
+    XImage *xim = NULL;
+    int exposed = 0;
+    int quit = 0;
+    int ret = 0;
     XEvent ev;
-    while (1) {
-        XNextEvent(dpy, &ev);
-        if (ev.type == Expose)
-            XPutImage(dpy, win, gc, xim, 0, 0, 0, 0, display_w, display_h);
-        if (ev.type == KeyPress || ev.type == ButtonPress)
+    while (!quit) {
+        if (!XPending(dpy)) {
+            struct pollfd fds[2] = {
+                {.fd = ConnectionNumber(dpy), .events = POLLIN},
+                {.fd = view.build_fds[0], .events = POLLIN},
+            };
+            XFlush(dpy);
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR)
+                    continue;
+                perror("[imageviewer] poll");
+                ret = 1;
+                break;
+            }
+            if (!(fds[1].revents & POLLIN))
+                continue;
+            // The pyramid is built: redraw from it
+            if (view_build_finish(&view) < 0) {
+                fprintf(stderr, "[imageviewer] Failed to load: %s\n", path);
+                ret = 1;
+                break;
+            }
+        } else {
+            XNextEvent(dpy, &ev);
+            if (ev.type == Expose && ev.xexpose.count == 0) {
+                exposed = 1;
+            } else if (ev.type == ConfigureNotify) {
+                view_resize(&view, ev.xconfigure.width, ev.xconfigure.height);
+            } else if (ev.type == KeyPress) {
+                KeySym sym = XLookupKeysym(&ev.xkey, 0);
+                if (sym == XK_q || sym == XK_Escape)
+                    quit = 1;
+                else if (sym == XK_equal || sym == XK_plus || sym == XK_KP_Add)
+                    view_action(&view, VIEW_ZOOM_IN);
+                else if (sym == XK_minus || sym == XK_KP_Subtract)
+                    view_action(&view, VIEW_ZOOM_OUT);
+                else if (sym == XK_0)
+                    view_action(&view, VIEW_RESET);
+                else if (sym == XK_Left || sym == XK_h)
+                    view_action(&view, VIEW_LEFT);
+                else if (sym == XK_Right || sym == XK_l)
+                    view_action(&view, VIEW_RIGHT);
+                else if (sym == XK_Up || sym == XK_k)
+                    view_action(&view, VIEW_UP);
+                else if (sym == XK_Down || sym == XK_j)
+                    view_action(&view, VIEW_DOWN);
+            } else if (ev.type == ButtonPress) {
+                // Wheel zooms, any other button closes
+                if (ev.xbutton.button == Button4)
+                    view_action(&view, VIEW_ZOOM_IN);
+                else if (ev.xbutton.button == Button5)
+                    view_action(&view, VIEW_ZOOM_OUT);
+                else
+                    quit = 1;
+            }
+            if (quit || XPending(dpy))
+                continue;
+        }
+
+        if (view.dirty) {
+            if (x11_render_view(dpy, &view, &format, &xim) < 0) {
+                fprintf(stderr, "[imageviewer] Out of memory drawing image\n");
+                ret = 1;
+                break;
+            }
+            exposed = 1;
+        }
+        if (exposed && xim) {
+            XPutImage(dpy, win, gc, xim, 0, 0, 0, 0, xim->width, xim->height);
+            exposed = 0;
+        }
+        // The preview is up: build the pyramid for zooming in
+        if (xim && view_build_start(&view) < 0) {
+            perror("[imageviewer] pipe");
+            ret = 1;
             break;
+        }
     }
 
-    XDestroyImage(xim);
+    if (xim)
+        XDestroyImage(xim);
+    view_free(&view);
     XFreeGC(dpy, gc);
     XDestroyWindow(dpy, win);
     XCloseDisplay(dpy);
+    return ret;
+}
+
+// Decode path at full size and time scaling it with every filter
+static int run_scale_benchmark(const char *path, int width, int height) {
+    Image image;
+    if (image_load(path, &image) < 0) {
+        fprintf(stderr, "[imageviewer] Failed to load image: %s\n", path);
+        return 1;
+    }
+    scale_benchmark(&image, width > 0 ? width : 800, height > 0 ? height : 600);
+    image_free(&image);
     return 0;
 }
 
@@ -999,6 +1671,7 @@ int main(int argc, char **argv) {
     int grid_mode = 0;
     int grid_cols = 3;
     int grid_rows = 2;
+    int benchmark = 0;
 
     // Store all image paths
     const char *paths[256];
@@ -1015,6 +1688,21 @@ int main(int argc, char **argv) {
             grid_cols = atoi(argv[++i]);
         } else if (strcmp(argv[i], "--rows") == 0 && i + 1 < argc) {
             grid_rows = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            if (scale_filter_parse(argv[++i], &scale_filter) < 0) {
+                fprintf(stderr, "Unknown filter: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--benchmark") == 0) {
+            benchmark = 1;
+        } else if (strcmp(argv[i], "--tile-cache") == 0 && i + 1 < argc) {
+            tile_budget = (size_t)atoi(argv[++i]) << 20;
+            if (tile_budget < MIP_MIN_BUDGET)
+                tile_budget = MIP_MIN_BUDGET; // Fewer tiles only thrash
+        } else if (strcmp(argv[i], "--thumb-cache") == 0 && i + 1 < argc) {
+            thumb_cache_max = (size_t)atoi(argv[++i]) << 20;
+        } else if (strcmp(argv[i], "--idle-benchmark") == 0 && i + 1 < argc) {
+            idle_benchmark = atoi(argv[++i]);
         } else if (strcmp(argv[i], "--help") == 0) {
             printf("Usage: imageviewer [OPTIONS] <image1> [image2 ...]\n");
             printf("Options:\n");
@@ -1023,6 +1711,18 @@ int main(int argc, char **argv) {
             printf("  -g, --grid   Enable grid view for multiple images\n");
             printf("  --cols N     Set grid columns (default: 3)\n");
             printf("  --rows N     Set grid rows (default: 2)\n");
+            printf("  --filter F   Scaling filter: nearest, box, bilinear or lanczos\n");
+            printf("               (default: %s)\n", scale_filter_name(SCALE_DEFAULT));
+            printf("  --benchmark  Time every scaling filter on the first image\n");
+            printf("               (scaled to -w/-h, default 800x600) and exit\n");
+            printf("  --tile-cache MB  Image tiles kept in memory (default: %d MB,\n",
+                   (int)(MIP_DEFAULT_BUDGET >> 20));
+            printf("               at least %d MB)\n", (int)(MIP_MIN_BUDGET >> 20));
+            printf("  --thumb-cache MB  Disk space for cached grid thumbnails,\n");
+            printf("               0 to disable (default: %d MB)\n",
+                   (int)(THUMB_CACHE_DEFAULT_MAX >> 20));
+            printf("  --idle-benchmark S  Show the image for S seconds, then\n");
+            printf("               report wakeups and CPU time (Wayland)\n");
             printf("  --help       Show this help\n");
             printf("\nExamples:\n");
             printf("  imageviewer image.jpg           # View single image\n");
@@ -1048,6 +1748,9 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    if (benchmark)
+        return run_scale_benchmark(paths[0], width, height);
+
     if (grid_mode) {
         fprintf(stderr, "[imageviewer] Grid mode: %d images, %dx%d grid\n", 
                 num_paths, grid_cols, grid_rows);
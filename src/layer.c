@@ -3,34 +3,61 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <ncurses.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
-#define MAX 4096
+#include "wallpaper-ipc.h"
+#include "wallpaper-x11.h"
+
 #define VERSION "0.2.0" // Major.Minor.Patch
 #define PATH_MAX_LEN 4096
 #define MAX_VIEWERS 10
+#define STAT_WORKERS_MAX 8
+#define STAT_BATCH 64 // Entries claimed by a stat worker at a time
+#define WALLPAPER_IPC_TIMEOUT_MS 300 // Longest the UI waits for the daemon
+#define WALLPAPER_START_MS 2000 // Time the daemon gets to start listening
+#define WALLPAPER_RETRY_MS 50   // Connect attempts while it starts
+#define WALLPAPER_REPLY_MS 10000 // Time the daemon gets to draw an image
+#define INDEX_MAGIC 0x58494c59 // "YLIX"
+#define INDEX_VERSION 2
+#define INDEX_CACHE_MAX (64ULL << 20) // Bytes of directory indices kept
+#define INDEX_MAX_AGE (90 * 86400)    // Seconds an unused index is kept
+#define INDEX_TEMP_MAX_AGE 3600 // Seconds before a stray temporary file goes
 
 // Global State Refactoring for Sorting and Directory Management
 typedef enum { FILE_IMAGE, FILE_DIR, FILE_PARENT } FileType;
 typedef enum { SORT_NAME, SORT_SIZE, SORT_DATE } SortMode;
 
+// Entries are kept small so that sorting and scanning huge directories stays
+// cheap: the name lives in a shared string pool and the full path is built
+// on demand from the directory prefix (see entry_path()).
 typedef struct {
-  char path[PATH_MAX_LEN];
-  char name[PATH_MAX_LEN];
-  long size;
-  time_t mtime;
+  uint32_t name; // Offset of the name in name_pool
   FileType type;
   int stats_fetched; // 0: Not fetched (lazy), 1: Fetched
+  long size;
+  time_t mtime;
+  char details[32];       // Formatted size/date shown next to the name
+  uint8_t details_sort;   // current_sort + 1 that details belong to, or 0
 } FileEntry;
 
 typedef struct {
@@ -39,10 +66,34 @@ typedef struct {
   int priority;
 } ViewerOption;
 
-static FileEntry list[MAX];
-static int n, sel, top;
+// Entry table. entries[] is filled in readdir order, order[] holds indices
+// into it and is the only thing that gets sorted; pos[] is its inverse.
+static FileEntry *entries;
+static int *order;
+static int *pos; // pos[order[i]] == i
+static int n, entries_cap;
+static char *name_pool;
+static size_t pool_len, pool_cap;
+static size_t dead_names; // Pool bytes of removed entries' names
+static char list_dir[PATH_MAX_LEN]; // Directory prefix shared by all entries
+static struct stat list_dir_st;     // list_dir as seen before it was read
+
+static int sel, top;
+static int inotify_fd = -1;
+static int watch_wd = -1;
+
+// Event loop state. While the TUI runs, SIGWINCH/SIGCHLD/SIGINT/SIGTERM are
+// blocked and read from signal_fd; background threads signal work_fd.
+static int signal_fd = -1;
+static int work_fd = -1;
+static sigset_t orig_sigmask;
+static int signals_blocked = 0;
+static int event_loop_running = 0;
+static volatile int stats_busy = 0; // Stat workers own the entry table
+static int stats_done = 0;          // Set by the stat thread, atomically
+static SortMode pending_sort = SORT_NAME;
 static char current_dir[PATH_MAX_LEN] = "";
-static char wallsetter[256] = "swaybg"; // feh
+static char wallsetter[256] = "swaybg"; // feh, builtin
 static char viewer[256] = "imageviewer";
 static SortMode current_sort = SORT_NAME;
 static int first_time = 1;
@@ -51,12 +102,446 @@ static int scan(const char *p);
 static int is_image(const char *filename);
 static void draw_menu();
 static void set_wallpaper_from_file(const char *file);
-static void handle_resize(int sig);
 static void set_random_wallpaper();
 static void enter_directory();
 static void kill_wallpaper_processes();
+static void show_status(const char *message);
+static int start_sort_prefetch(SortMode mode);
 static void show_preview();
 static void save_config();
+static void watch_directory();
+
+// Entry Table
+static FileEntry *entry_at(int i) { return &entries[order[i]]; }
+
+static const char *entry_name(const FileEntry *entry) {
+  return name_pool + entry->name;
+}
+
+// Full path of an entry. Returns a static buffer, copy it if it must survive
+// the next call.
+static const char *entry_path(const FileEntry *entry) {
+  static char path[PATH_MAX_LEN + 256];
+  if (entry->type == FILE_PARENT)
+    return list_dir;
+  snprintf(path, sizeof(path), "%s%s%s", list_dir,
+           strcmp(list_dir, "/") == 0 ? "" : "/", entry_name(entry));
+  return path;
+}
+
+static void clear_entries() {
+  n = 0;
+  pool_len = 0;
+  dead_names = 0;
+}
+
+// Make room for count more entries and pool_bytes more bytes of names
+static int reserve_entries(int count, size_t pool_bytes) {
+  if (pool_len + pool_bytes > pool_cap) {
+    size_t new_cap = pool_cap ? pool_cap : 16384;
+    while (pool_len + pool_bytes > new_cap)
+      new_cap *= 2;
+    char *new_pool = realloc(name_pool, new_cap);
+    if (!new_pool)
+      return -1;
+    name_pool = new_pool;
+    pool_cap = new_cap;
+  }
+
+  if (n + count > entries_cap) {
+    int new_cap = entries_cap ? entries_cap : 256;
+    while (n + count > new_cap)
+      new_cap *= 2;
+    FileEntry *new_entries = realloc(entries, new_cap * sizeof(*entries));
+    if (!new_entries)
+      return -1;
+    entries = new_entries;
+    int *new_order = realloc(order, new_cap * sizeof(*order));
+    if (!new_order)
+      return -1;
+    order = new_order;
+    int *new_pos = realloc(pos, new_cap * sizeof(*pos));
+    if (!new_pos)
+      return -1;
+    pos = new_pos;
+    entries_cap = new_cap;
+  }
+  return 0;
+}
+
+static FileEntry *add_entry(const char *name, FileType type) {
+  size_t len = strlen(name) + 1;
+  if (reserve_entries(1, len) < 0)
+    return NULL;
+
+  FileEntry *entry = &entries[n];
+  memcpy(name_pool + pool_len, name, len);
+  entry->name = (uint32_t)pool_len;
+  pool_len += len;
+  entry->type = type;
+  entry->stats_fetched = 0;
+  entry->size = 0;
+  entry->mtime = 0;
+  entry->details_sort = 0;
+  order[n] = n;
+  pos[n] = n;
+  n++;
+  return entry;
+}
+
+// FNV-1a, continuing from hash (start with FNV_OFFSET)
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+static uint64_t hash_string(uint64_t hash, const char *s) {
+  for (const char *c = s; *c; c++) {
+    hash ^= (unsigned char)*c;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+// Name Index
+// Open addressing table of entries[] indices by name (linear probing, -1
+// for a free slot), so inotify events find their entry without a scan.
+// The parent entry is left out. scan() rebuilds it, the inotify handlers
+// keep it current. Without it (out of memory) lookups fall back to a scan.
+static int *name_slots;
+static size_t name_slots_cap; // Power of two, at least twice n
+
+static size_t name_home(const char *name) {
+  return hash_string(FNV_OFFSET, name) & (name_slots_cap - 1);
+}
+
+static void name_index_insert(int index) {
+  size_t slot = name_home(entry_name(&entries[index]));
+  while (name_slots[slot] >= 0)
+    slot = (slot + 1) & (name_slots_cap - 1);
+  name_slots[slot] = index;
+}
+
+static void name_index_rebuild() {
+  size_t cap = 256;
+  while (cap < (size_t)n * 2)
+    cap *= 2;
+  if (cap != name_slots_cap) {
+    free(name_slots);
+    name_slots = malloc(cap * sizeof(*name_slots));
+    name_slots_cap = name_slots ? cap : 0;
+    if (!name_slots)
+      return;
+  }
+  memset(name_slots, 0xff, cap * sizeof(*name_slots)); // All -1
+  for (int i = 0; i < n; i++) {
+    if (entries[i].type != FILE_PARENT)
+      name_index_insert(i);
+  }
+}
+
+// Slot holding the entry called name, or -1
+static long name_index_find(const char *name) {
+  if (!name_slots)
+    return -1;
+  for (size_t slot = name_home(name); name_slots[slot] >= 0;
+       slot = (slot + 1) & (name_slots_cap - 1)) {
+    if (strcmp(entry_name(&entries[name_slots[slot]]), name) == 0)
+      return (long)slot;
+  }
+  return -1;
+}
+
+// Index entries[n - 1], just added
+static void name_index_add() {
+  if (!name_slots || (size_t)n * 2 > name_slots_cap)
+    name_index_rebuild();
+  else
+    name_index_insert(n - 1);
+}
+
+static void name_index_remove(const char *name) {
+  long found = name_index_find(name);
+  if (found < 0)
+    return;
+  // Shift later entries of the probe run back over the hole, unless that
+  // would move them before their home slot
+  size_t mask = name_slots_cap - 1;
+  size_t hole = (size_t)found;
+  for (size_t next = (hole + 1) & mask; name_slots[next] >= 0;
+       next = (next + 1) & mask) {
+    size_t home = name_home(entry_name(&entries[name_slots[next]]));
+    if (((next - home) & mask) >= ((next - hole) & mask)) {
+      name_slots[hole] = name_slots[next];
+      hole = next;
+    }
+  }
+  name_slots[hole] = -1;
+}
+
+// Directory Index Cache
+// The entry table of each scanned directory is stored under
+// $XDG_CACHE_HOME/layer/ together with the directory mtime. When the
+// directory has not changed since, scan() loads the table from there and
+// skips readdir and stat entirely. The file is laid out as
+//   IndexHeader | directory path | IndexRecord[count] | name pool
+// so that loading it is a handful of memcpy()s.
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t dir_dev;
+  uint64_t dir_ino;
+  int64_t dir_mtime_sec;
+  int64_t dir_mtime_nsec;
+  uint32_t count;
+  uint32_t pool_len;
+  uint32_t path_len; // Including the terminating NUL
+  uint32_t reserved;
+} IndexHeader;
+
+typedef struct {
+  uint32_t name;
+  uint8_t type;
+  uint8_t stats_fetched;
+  uint16_t reserved;
+  int64_t size;
+  int64_t mtime;
+} IndexRecord;
+
+static const char *get_cache_dir() {
+  static char cache_dir[PATH_MAX_LEN];
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  if (xdg && xdg[0] == '/') {
+    snprintf(cache_dir, sizeof(cache_dir), "%s/layer", xdg);
+  } else {
+    const char *home = getenv("HOME");
+    if (!home)
+      return NULL;
+    snprintf(cache_dir, sizeof(cache_dir), "%s/.cache/layer", home);
+  }
+
+  // Create the directory and its parent on first use
+  if (access(cache_dir, W_OK) != 0) {
+    char *slash = strrchr(cache_dir, '/');
+    *slash = '\0';
+    mkdir(cache_dir, 0755);
+    *slash = '/';
+    if (mkdir(cache_dir, 0755) < 0 && errno != EEXIST)
+      return NULL;
+  }
+  return cache_dir;
+}
+
+static int get_index_path(const char *dir, char *out, size_t size) {
+  const char *cache_dir = get_cache_dir();
+  if (!cache_dir)
+    return -1;
+
+  uint64_t hash = hash_string(FNV_OFFSET, dir);
+  snprintf(out, size, "%s/%016llx.idx", cache_dir, (unsigned long long)hash);
+  return 0;
+}
+
+// Check that a mapped index file belongs to list_dir in its current state
+static int index_matches(const IndexHeader *header, size_t file_size) {
+  size_t path_len = strlen(list_dir) + 1;
+  size_t expected = sizeof(IndexHeader) + header->path_len +
+                    (size_t)header->count * sizeof(IndexRecord) +
+                    header->pool_len;
+
+  if (header->magic != INDEX_MAGIC || header->version != INDEX_VERSION ||
+      file_size != expected || header->path_len != path_len)
+    return 0;
+  if (header->dir_dev != (uint64_t)list_dir_st.st_dev ||
+      header->dir_ino != (uint64_t)list_dir_st.st_ino ||
+      header->dir_mtime_sec != (int64_t)list_dir_st.st_mtim.tv_sec ||
+      header->dir_mtime_nsec != (int64_t)list_dir_st.st_mtim.tv_nsec)
+    return 0;
+
+  const char *path = (const char *)(header + 1);
+  const char *pool = path + path_len + header->count * sizeof(IndexRecord);
+  if (header->pool_len > 0 && pool[header->pool_len - 1] != '\0')
+    return 0;
+  return memcmp(path, list_dir, path_len) == 0;
+}
+
+static int load_index_entries(const IndexHeader *header) {
+  const IndexRecord *records =
+      (const IndexRecord *)((const char *)(header + 1) + header->path_len);
+  const char *pool = (const char *)(records + header->count);
+
+  clear_entries();
+  if (reserve_entries(header->count, header->pool_len) < 0)
+    return -1;
+  memcpy(name_pool, pool, header->pool_len);
+  pool_len = header->pool_len;
+
+  for (uint32_t i = 0; i < header->count; i++) {
+    const IndexRecord *record = &records[i];
+    if (record->name >= header->pool_len || record->type > FILE_PARENT) {
+      clear_entries();
+      return -1;
+    }
+    FileEntry *entry = &entries[n];
+    entry->name = record->name;
+    entry->type = (FileType)record->type;
+    entry->stats_fetched = record->stats_fetched;
+    entry->size = record->size;
+    entry->mtime = record->mtime;
+    entry->details_sort = 0;
+    order[n] = n;
+    pos[n] = n;
+    n++;
+  }
+  return 0;
+}
+
+// Load the cached entry table for list_dir. Returns 0 if the cache was
+// valid and the table has been filled.
+static int load_index() {
+  char index_path[PATH_MAX_LEN + 32];
+  if (get_index_path(list_dir, index_path, sizeof(index_path)) < 0)
+    return -1;
+
+  int fd = open(index_path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(IndexHeader))
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return -1;
+
+  int ret = -1;
+  if (index_matches(map, st.st_size))
+    ret = load_index_entries(map);
+  munmap(map, st.st_size);
+  if (ret == 0)
+    utimensat(AT_FDCWD, index_path, NULL, 0); // Mark it used for eviction
+  return ret;
+}
+
+// Index Cache Eviction
+// Every directory visited leaves an index behind. Loading one bumps its
+// mtime, and once per run the least recently used ones are deleted until
+// the cache is under INDEX_CACHE_MAX bytes, along with any older than
+// INDEX_MAX_AGE.
+typedef struct {
+  char name[32]; // "%016llx.idx"
+  struct timespec used;
+  off_t size;
+} IndexFile;
+
+static int compare_index_use(const void *a, const void *b) {
+  const struct timespec *ta = &((const IndexFile *)a)->used;
+  const struct timespec *tb = &((const IndexFile *)b)->used;
+  if (ta->tv_sec != tb->tv_sec)
+    return ta->tv_sec < tb->tv_sec ? -1 : 1;
+  return (ta->tv_nsec > tb->tv_nsec) - (ta->tv_nsec < tb->tv_nsec);
+}
+
+static void trim_index_cache() {
+  const char *cache_dir = get_cache_dir();
+  if (!cache_dir)
+    return;
+  DIR *d = opendir(cache_dir);
+  if (!d)
+    return;
+
+  IndexFile *files = NULL;
+  size_t count = 0, cap = 0;
+  unsigned long long total = 0;
+  time_t now = time(NULL);
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL) {
+    const char *ext = strstr(e->d_name, ".idx");
+    struct stat st;
+    if (!ext || fstatat(dirfd(d), e->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+        !S_ISREG(st.st_mode))
+      continue;
+    // Stale indices, and temporary files left behind by a dead writer
+    if (ext[4] != '\0' ? st.st_mtime < now - INDEX_TEMP_MAX_AGE
+                       : st.st_mtime < now - INDEX_MAX_AGE) {
+      unlinkat(dirfd(d), e->d_name, 0);
+      continue;
+    }
+    size_t len = strlen(e->d_name);
+    if (ext[4] != '\0' || len >= sizeof(files->name))
+      continue;
+    if (count == cap) {
+      size_t new_cap = cap ? cap * 2 : 256;
+      IndexFile *new_files = realloc(files, new_cap * sizeof(*files));
+      if (!new_files)
+        break;
+      files = new_files;
+      cap = new_cap;
+    }
+    memcpy(files[count].name, e->d_name, len + 1);
+    files[count].used = st.st_mtim;
+    files[count].size = st.st_size;
+    count++;
+    total += st.st_size;
+  }
+
+  // Least recently used first
+  if (total > INDEX_CACHE_MAX) {
+    qsort(files, count, sizeof(*files), compare_index_use);
+    for (size_t i = 0; i < count && total > INDEX_CACHE_MAX; i++)
+      if (unlinkat(dirfd(d), files[i].name, 0) == 0)
+        total -= files[i].size;
+  }
+  free(files);
+  closedir(d);
+}
+
+static void save_index() {
+  char index_path[PATH_MAX_LEN + 32];
+  if (get_index_path(list_dir, index_path, sizeof(index_path)) < 0)
+    return;
+
+  IndexRecord *records = malloc((n > 0 ? n : 1) * sizeof(*records));
+  if (!records)
+    return;
+  for (int i = 0; i < n; i++) {
+    records[i] = (IndexRecord){.name = entries[i].name,
+                               .type = (uint8_t)entries[i].type,
+                               .stats_fetched = (uint8_t)entries[i].stats_fetched,
+                               .size = entries[i].size,
+                               .mtime = entries[i].mtime};
+  }
+
+  IndexHeader header = {.magic = INDEX_MAGIC,
+                        .version = INDEX_VERSION,
+                        .dir_dev = list_dir_st.st_dev,
+                        .dir_ino = list_dir_st.st_ino,
+                        .dir_mtime_sec = list_dir_st.st_mtim.tv_sec,
+                        .dir_mtime_nsec = list_dir_st.st_mtim.tv_nsec,
+                        .count = (uint32_t)n,
+                        .pool_len = (uint32_t)pool_len,
+                        .path_len = (uint32_t)strlen(list_dir) + 1};
+
+  // Write to a temporary file and rename it so readers never see a
+  // partially written index
+  char tmp_path[PATH_MAX_LEN + 48];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%d", index_path, (int)getpid());
+  FILE *f = fopen(tmp_path, "wb");
+  if (f) {
+    int ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+             fwrite(list_dir, header.path_len, 1, f) == 1 &&
+             (n == 0 || fwrite(records, sizeof(*records), n, f) == (size_t)n) &&
+             (pool_len == 0 || fwrite(name_pool, pool_len, 1, f) == 1);
+    if (fclose(f) == 0 && ok)
+      rename(tmp_path, index_path);
+    else
+      unlink(tmp_path);
+  }
+  free(records);
+
+  static int trimmed = 0;
+  if (!trimmed) {
+    trimmed = 1;
+    trim_index_cache();
+  }
+}
 
 // Sorting Logic
 static const char *get_base_name(const char *full_path) {
@@ -93,8 +578,8 @@ static int is_image(const char *path) {
 
 // Sort by Name
 static int compare_by_name(const void *a, const void *b) {
-  const FileEntry *entry_a = (const FileEntry *)a;
-  const FileEntry *entry_b = (const FileEntry *)b;
+  const FileEntry *entry_a = &entries[*(const int *)a];
+  const FileEntry *entry_b = &entries[*(const int *)b];
 
   if (entry_a->type == FILE_PARENT)
     return -1;
@@ -106,7 +591,15 @@ static int compare_by_name(const void *a, const void *b) {
     return 1;
 
   // Natural sorting (case-insensitive for files)
-  return strcasecmp(entry_a->name, entry_b->name);
+  return strcasecmp(entry_name(entry_a), entry_name(entry_b));
+}
+
+static void fill_stats(FileEntry *entry, const struct stat *st) {
+  // Size is irrelevant for directories, mtime is used for date sorting
+  entry->size = (entry->type == FILE_IMAGE) ? st->st_size : 0;
+  entry->mtime = st->st_mtime;
+  entry->stats_fetched = 1;
+  entry->details_sort = 0;
 }
 
 static void fetch_stats(FileEntry *entry) {
@@ -114,23 +607,99 @@ static void fetch_stats(FileEntry *entry) {
     return;
 
   struct stat st;
-  if (lstat(entry->path, &st) < 0) {
+  if (lstat(entry_path(entry), &st) < 0) {
     entry->size = 0;
     entry->mtime = 0;
+    entry->stats_fetched = 1;
+    entry->details_sort = 0;
   } else {
-    entry->size = st.st_size;
-    entry->mtime = st.st_mtime;
+    fill_stats(entry, &st);
   }
-  entry->stats_fetched = 1;
+}
+
+// Batch Stat Prefetch
+// Size and date sorting need the stats of every entry. Rather than stat()ing
+// serially from inside the comparator, a small pool of threads claims
+// batches of entries and fstatat()s them relative to the directory fd.
+typedef struct {
+  int dir_fd;
+  int next; // Next unclaimed entry, advanced atomically
+} StatJob;
+
+static void *stat_worker(void *arg) {
+  StatJob *job = arg;
+  for (;;) {
+    int start = __atomic_fetch_add(&job->next, STAT_BATCH, __ATOMIC_RELAXED);
+    if (start >= n)
+      break;
+    int end = start + STAT_BATCH < n ? start + STAT_BATCH : n;
+    for (int i = start; i < end; i++) {
+      FileEntry *entry = &entries[i];
+      if (entry->stats_fetched)
+        continue;
+      struct stat st;
+      if (fstatat(job->dir_fd, entry_name(entry), &st, AT_SYMLINK_NOFOLLOW) <
+          0) {
+        entry->size = 0;
+        entry->mtime = 0;
+        entry->stats_fetched = 1;
+        entry->details_sort = 0;
+      } else {
+        fill_stats(entry, &st);
+      }
+    }
+  }
+  return NULL;
+}
+
+// Returns the number of entries that had to be stat()ed
+static int prefetch_stats() {
+  int missing = 0;
+  for (int i = 0; i < n; i++) {
+    if (!entries[i].stats_fetched)
+      missing++;
+  }
+  if (missing == 0)
+    return 0;
+
+  StatJob job = {.dir_fd = open(list_dir, O_RDONLY | O_DIRECTORY), .next = 0};
+  if (job.dir_fd < 0) {
+    for (int i = 0; i < n; i++)
+      fetch_stats(&entries[i]);
+    return missing;
+  }
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int workers = missing / STAT_BATCH;
+  if (workers > cpus)
+    workers = cpus;
+  // Stat latency is mostly I/O (think NFS), so use a couple of threads even
+  // on a single core
+  if (workers < 2)
+    workers = 2;
+  if (workers > STAT_WORKERS_MAX)
+    workers = STAT_WORKERS_MAX;
+
+  pthread_t threads[STAT_WORKERS_MAX];
+  int started = 0;
+  if (missing > STAT_BATCH) {
+    for (; started < workers; started++) {
+      if (pthread_create(&threads[started], NULL, stat_worker, &job) != 0)
+        break;
+    }
+  }
+  stat_worker(&job); // The caller helps out, and covers thread failures
+  for (int i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+
+  close(job.dir_fd);
+  return missing;
 }
 
 // Sort by Size (Ascending)
 static int compare_by_size(const void *a, const void *b) {
-  const FileEntry *fa = (const FileEntry *)a;
-  const FileEntry *fb = (const FileEntry *)b;
-
-  fetch_stats((FileEntry *)fa);
-  fetch_stats((FileEntry *)fb);
+  const FileEntry *fa = &entries[*(const int *)a];
+  const FileEntry *fb = &entries[*(const int *)b];
 
   if (fa->type != fb->type)
     return compare_by_name(a, b);
@@ -144,8 +713,8 @@ static int compare_by_size(const void *a, const void *b) {
 
 // Sort by Date Modified (Newest first)
 static int compare_by_date(const void *a, const void *b) {
-  const FileEntry *entry_a = (const FileEntry *)a;
-  const FileEntry *entry_b = (const FileEntry *)b;
+  const FileEntry *entry_a = &entries[*(const int *)a];
+  const FileEntry *entry_b = &entries[*(const int *)b];
 
   if (entry_a->type != entry_b->type)
     return compare_by_name(a, b);
@@ -170,7 +739,13 @@ static int get_current_comparator(const void *a, const void *b) {
 
 static void apply_sort() {
   if (n > 0) {
-    qsort(list, n, sizeof(FileEntry), get_current_comparator);
+    // Comparators rely on size and mtime being present. Keep the fetched
+    // stats in the directory index for the next start.
+    if (current_sort != SORT_NAME && prefetch_stats() > 0)
+      save_index();
+    qsort(order, n, sizeof(*order), get_current_comparator);
+    for (int i = 0; i < n; i++)
+      pos[order[i]] = i;
     sel = 0; // Reset selection after sorting
     top = 0;
   }
@@ -199,7 +774,7 @@ static void save_config() {
     fprintf(f, "SETTER=%s\n", wallsetter); // save wallpaper setter
     fprintf(f, "VIEWER=%s\n", viewer);     // save viewer
     fprintf(f, "SEL=%d\n", sel);           // Save scroll position
-    fprintf(f, "SORT=%d\n", current_sort); // Save sort mode
+    fprintf(f, "SORT=%d\n", stats_busy ? pending_sort : current_sort);
     fclose(f);
   }
 }
@@ -271,73 +846,97 @@ static void load_config() {
 }
 
 // Directory Scanning
-static int scan(const char *p) {
-  char canonical_dir[PATH_MAX_LEN];
-  if (realpath(p, canonical_dir) == NULL) {
-    fprintf(stderr, "Error: Could not resolve path %s\n", p);
-    return 0;
-  }
-  strncpy(current_dir, canonical_dir, sizeof(current_dir) - 1);
-  current_dir[sizeof(current_dir) - 1] = '\0';
-
-  n = 0;
-  DIR *d = opendir(current_dir);
+// Fill the entry table from list_dir
+static int read_directory() {
+  DIR *d = opendir(list_dir);
   if (!d) {
-    fprintf(stderr, "Error: Cannot open directory %s\n", current_dir);
-    return 0;
+    fprintf(stderr, "Error: Cannot open directory %s\n", list_dir);
+    return -1;
   }
 
-  if (strcmp(current_dir, "/") != 0 && n < MAX) {
-    FileEntry *entry = &list[n++];
-    snprintf(entry->path, sizeof(entry->path), "%s", current_dir);
-    strcpy(entry->name, "..");
-    entry->type = FILE_PARENT;
-    entry->stats_fetched = 1;
-    entry->size = 0;
-    entry->mtime = 0;
+  if (strcmp(list_dir, "/") != 0) {
+    FileEntry *entry = add_entry("..", FILE_PARENT);
+    if (entry)
+      entry->stats_fetched = 1;
   }
 
   struct dirent *e;
-  while ((e = readdir(d)) != NULL && n < MAX) {
+  while ((e = readdir(d)) != NULL) {
     if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) {
       continue;
     }
 
-    char full_path[PATH_MAX_LEN];
-    snprintf(full_path, sizeof(full_path), "%s/%s", canonical_dir, e->d_name);
-
+    // Classify from d_type and only fall back to a stat when the filesystem
+    // does not report it. Size and mtime are fetched lazily by fetch_stats().
+    int is_dir = 0;
     struct stat st;
-    if (lstat(full_path, &st) < 0) {
-      if (e->d_name[0] != '.') {
-        fprintf(stderr, "Error stating file %s: %s\n", full_path,
-                strerror(errno));
+    int have_stat = 0;
+    if (e->d_type == DT_DIR) {
+      is_dir = 1;
+    } else if (e->d_type == DT_UNKNOWN) {
+      if (fstatat(dirfd(d), e->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+        if (e->d_name[0] != '.') {
+          fprintf(stderr, "Error stating file %s/%s: %s\n", list_dir,
+                  e->d_name, strerror(errno));
+        }
+        continue; // Skip inaccessible files
       }
-      continue; // Skip inaccessible files
+      is_dir = S_ISDIR(st.st_mode);
+      have_stat = 1;
     }
 
-    FileEntry *entry = &list[n];
-    strncpy(entry->path, full_path, sizeof(entry->path) - 1);
-    entry->path[sizeof(entry->path) - 1] = '\0';
-    strncpy(entry->name, e->d_name, sizeof(entry->name) - 1);
-    entry->name[sizeof(entry->name) - 1] = '\0';
+    FileEntry *entry = NULL;
+    if (is_dir) {
+      entry = add_entry(e->d_name, FILE_DIR);
+    } else if (is_image(e->d_name)) {
+      entry = add_entry(e->d_name, FILE_IMAGE);
+    } else {
+      continue; // Skip non-image, non-directory files
+    }
 
-    if (S_ISDIR(st.st_mode)) {
-      entry->type = FILE_DIR;
-      entry->size = 0;            // Size is irrelevant for directories
-      entry->mtime = st.st_mtime; // for directory sorting
-      entry->stats_fetched = 1;
-      n++;
-    } else if (is_image(full_path)) {
-      entry->type = FILE_IMAGE;
-      entry->size = 0;
-      entry->mtime = 0;
-      entry->stats_fetched = 0;
-      n++;
+    if (entry && have_stat)
+      fill_stats(entry, &st);
+
+    if (!entry) {
+      fprintf(stderr, "Error: Out of memory while scanning %s\n", list_dir);
+      break;
     }
-    // Skip non-image, non-directory files
   }
   closedir(d);
+  return 0;
+}
 
+static int scan(const char *p) {
+  char canonical_dir[PATH_MAX_LEN];
+  if (realpath(p, canonical_dir) == NULL) {
+    fprintf(stderr, "Error: Could not resolve path %s\n", p);
+    return 0;
+  }
+  strncpy(current_dir, canonical_dir, sizeof(current_dir) - 1);
+  current_dir[sizeof(current_dir) - 1] = '\0';
+
+  clear_entries();
+  if (stat(current_dir, &list_dir_st) < 0 || !S_ISDIR(list_dir_st.st_mode)) {
+    fprintf(stderr, "Error: Cannot open directory %s\n", current_dir);
+    return 0;
+  }
+  strcpy(list_dir, current_dir);
+
+  // An unchanged directory is served from the index without touching it
+  if (load_index() != 0) {
+    if (read_directory() < 0)
+      return 0;
+    save_index();
+  }
+  name_index_rebuild();
+  watch_directory();
+
+  // Stats missing for size/date sorting are fetched in the background while
+  // the list is shown in name order. The config prompt rescans with ncurses
+  // suspended and sorts in place.
+  if (current_sort != SORT_NAME && !isendwin() &&
+      start_sort_prefetch(current_sort))
+    current_sort = SORT_NAME;
   apply_sort();
 
   if (sel >= n)
@@ -348,6 +947,210 @@ static int scan(const char *p) {
   return n;
 }
 
+// Directory Watching
+// While the TUI runs, list_dir is watched with inotify and changes are
+// applied to the entry table in place, so new files show up without a
+// rescan and without losing the selection.
+static void watch_directory() {
+  if (inotify_fd < 0)
+    return;
+  if (watch_wd >= 0)
+    inotify_rm_watch(inotify_fd, watch_wd);
+  watch_wd = inotify_add_watch(inotify_fd, list_dir,
+                               IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                   IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB |
+                                   IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+}
+
+static int find_entry(const char *name) {
+  if (name_slots) {
+    long slot = name_index_find(name);
+    return slot < 0 ? -1 : name_slots[slot];
+  }
+  for (int i = 0; i < n; i++) {
+    if (entries[i].type != FILE_PARENT &&
+        strcmp(entry_name(&entries[i]), name) == 0)
+      return i;
+  }
+  return -1;
+}
+
+// Insert entries[index], which must not be in order[0..n-1) yet, at its
+// sorted position. order[n - 1] is used as scratch space.
+static void insert_sorted(int index) {
+  int lo = 0, hi = n - 1;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (get_current_comparator(&index, &order[mid]) < 0)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  memmove(&order[lo + 1], &order[lo], (n - 1 - lo) * sizeof(*order));
+  order[lo] = index;
+  for (int i = lo; i < n; i++)
+    pos[order[i]] = i;
+}
+
+// Take entries[index] out of the sorted view, moving it to order[n - 1]
+static void unlink_sorted(int index) {
+  int i = pos[index];
+  memmove(&order[i], &order[i + 1], (n - 1 - i) * sizeof(*order));
+  order[n - 1] = index;
+  for (; i < n; i++)
+    pos[order[i]] = i;
+}
+
+// Drop names of removed entries once they make up half of the pool
+static void compact_name_pool() {
+  if (dead_names < pool_len / 2)
+    return;
+  char *new_pool = malloc(pool_cap);
+  if (!new_pool)
+    return;
+  size_t len = 0;
+  for (int i = 0; i < n; i++) {
+    size_t name_len = strlen(entry_name(&entries[i])) + 1;
+    memcpy(new_pool + len, entry_name(&entries[i]), name_len);
+    entries[i].name = (uint32_t)len;
+    len += name_len;
+  }
+  free(name_pool);
+  name_pool = new_pool;
+  pool_len = len;
+  dead_names = 0;
+}
+
+static void directory_entry_added(const char *name, int is_dir) {
+  int index = find_entry(name);
+  if (index >= 0) {
+    // Replaced by a rename, treat it as a modification
+    FileEntry *entry = &entries[index];
+    entry->stats_fetched = 0;
+    if (current_sort != SORT_NAME)
+      fetch_stats(entry);
+    unlink_sorted(index);
+    insert_sorted(index);
+    return;
+  }
+  if (!is_dir && !is_image(name))
+    return;
+
+  FileEntry *entry = add_entry(name, is_dir ? FILE_DIR : FILE_IMAGE);
+  if (!entry)
+    return;
+  name_index_add();
+  if (current_sort != SORT_NAME)
+    fetch_stats(entry);
+  insert_sorted(n - 1);
+}
+
+static void directory_entry_removed(const char *name) {
+  int index = find_entry(name);
+  if (index < 0)
+    return;
+  dead_names += strlen(name) + 1;
+  name_index_remove(name);
+
+  // Move the last entry into the freed slot and fix up its order[] slot
+  unlink_sorted(index);
+  int last = n - 1;
+  if (index != last) {
+    long slot = name_index_find(entry_name(&entries[last]));
+    if (slot >= 0)
+      name_slots[slot] = index;
+    entries[index] = entries[last];
+    order[pos[last]] = index;
+    pos[index] = pos[last];
+  }
+  n--;
+}
+
+static void directory_entry_changed(const char *name) {
+  int index = find_entry(name);
+  if (index < 0)
+    return;
+  FileEntry *entry = &entries[index];
+  entry->stats_fetched = 0;
+  if (current_sort != SORT_NAME) {
+    fetch_stats(entry);
+    unlink_sorted(index);
+    insert_sorted(index);
+  }
+}
+
+// Apply pending inotify events. Returns 1 if the list changed.
+static int handle_directory_events() {
+  char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+  int changed = 0, rescan = 0;
+
+  // Remember the selection by name, entry indices move around below
+  char selected[PATH_MAX_LEN] = "";
+  if (n > 0 && entry_at(sel)->type != FILE_PARENT)
+    snprintf(selected, sizeof(selected), "%s", entry_name(entry_at(sel)));
+
+  ssize_t len;
+  while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+    for (char *p = buf; p < buf + len;) {
+      const struct inotify_event *ev = (const struct inotify_event *)p;
+      p += sizeof(struct inotify_event) + ev->len;
+
+      if (ev->mask & IN_Q_OVERFLOW) {
+        rescan = 1;
+        continue;
+      }
+      if (ev->wd != watch_wd)
+        continue; // Left over from a previous directory
+      if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        rescan = 1;
+        continue;
+      }
+      if (ev->len == 0 || ev->name[0] == '\0')
+        continue;
+
+      if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+        directory_entry_added(ev->name, (ev->mask & IN_ISDIR) != 0);
+      } else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        directory_entry_removed(ev->name);
+      } else if (ev->mask & (IN_CLOSE_WRITE | IN_ATTRIB)) {
+        directory_entry_changed(ev->name);
+      }
+      changed = 1;
+    }
+  }
+
+  if (rescan) {
+    char dir[PATH_MAX_LEN];
+    strcpy(dir, list_dir);
+    // Walk up if the watched directory itself went away
+    while (scan(dir) == 0 && strcmp(dir, "/") != 0) {
+      char *last_slash = strrchr(dir, '/');
+      if (last_slash == dir)
+        last_slash[1] = '\0';
+      else
+        *last_slash = '\0';
+    }
+    changed = 1;
+  } else if (changed) {
+    compact_name_pool();
+  }
+
+  if (changed && selected[0]) {
+    int index = find_entry(selected);
+    if (index >= 0)
+      sel = pos[index];
+  }
+  if (sel >= n)
+    sel = (n > 0) ? n - 1 : 0;
+
+  int max_display = LINES - 3;
+  if (sel < top)
+    top = sel;
+  else if (sel >= top + max_display)
+    top = sel - max_display + 1;
+  return changed;
+}
+
 // UI
 static const char *get_sort_name(SortMode mode) {
   switch (mode) {
@@ -380,8 +1183,61 @@ static const char *format_size(long bytes) {
   return buffer;
 }
 
+// Size or date of an entry for the current sort mode, formatted once and
+// cached in the entry
+static const char *entry_details(FileEntry *entry) {
+  if (current_sort == SORT_NAME)
+    return "";
+  if (stats_busy)
+    return " (...)"; // The stat workers own the entries until joined
+  fetch_stats(entry);
+  if (entry->details_sort != current_sort + 1) {
+    if (current_sort == SORT_SIZE) {
+      snprintf(entry->details, sizeof(entry->details), " (%.28s)",
+               format_size(entry->size));
+    } else {
+      char time_str[30];
+      strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M",
+               localtime(&entry->mtime));
+      snprintf(entry->details, sizeof(entry->details), " (%.28s)",
+               time_str);
+    }
+    entry->details_sort = current_sort + 1;
+  }
+  return entry->details;
+}
+
+// Repaint a single list row, without refreshing the screen
+static void draw_row(int i) {
+  int max_display = LINES - 3;
+  if (i < top || i >= top + max_display)
+    return;
+  int y = i - top + 2;
+  move(y, 0);
+  clrtoeol();
+  if (i >= n)
+    return;
+
+  FileEntry *entry = entry_at(i);
+  char line[PATH_MAX_LEN];
+  int attrs = (i == sel) ? A_REVERSE : 0;
+  if (entry->type == FILE_DIR || entry->type == FILE_PARENT) {
+    snprintf(line, sizeof(line), "%s %s/", i == sel ? ">" : " ",
+             entry_name(entry));
+    attrs |= A_BOLD;
+  } else {
+    // Display file size/date based on sort mode
+    snprintf(line, sizeof(line), "%s %s%s", i == sel ? ">" : " ",
+             entry_name(entry), entry_details(entry));
+  }
+
+  attron(attrs);
+  mvaddnstr(y, 0, line, COLS); // Never wrap into the next row
+  attroff(attrs);
+}
+
 static void draw_menu() {
-  clear();
+  erase();
   mvprintw(0, 0,
            "[j/k or Arrow Keys] Navigate | [Enter] Select/Set | [r] Random | "
            "[s] Sort: %s | [F1] Config | [q] Quit",
@@ -394,76 +1250,356 @@ static void draw_menu() {
     mvprintw(5, 0, "Press 'F1' to change directory/config.");
   } else {
     int max_display = LINES - 3;
-    for (int i = top; i < n && i < top + max_display; i++) {
-      FileEntry *entry = &list[i];
-      int y = i - top + 2;
+    for (int i = top; i < n && i < top + max_display; i++)
+      draw_row(i);
+  }
+  if (stats_busy)
+    mvprintw(LINES - 1, 0, "Fetching file stats...");
+  refresh();
+}
+
+// Move the selection, repainting only the rows that changed. Moving past
+// the visible window scrolls the list region by a line instead of redrawing
+// every row.
+static void move_selection(int new_sel) {
+  int max_display = LINES - 3;
+  if (new_sel < 0 || new_sel >= n || new_sel == sel)
+    return;
+
+  int old_sel = sel;
+  sel = new_sel;
+
+  int scroll = 0;
+  if (sel < top)
+    scroll = sel - top;
+  else if (sel >= top + max_display)
+    scroll = sel - (top + max_display - 1);
+
+  if (scroll < -1 || scroll > 1 || max_display < 2) {
+    top += scroll;
+    draw_menu();
+    return;
+  }
+
+  if (scroll != 0) {
+    setscrreg(2, 2 + max_display - 1);
+    scrollok(stdscr, TRUE);
+    scrl(scroll);
+    scrollok(stdscr, FALSE);
+    setscrreg(0, LINES - 1);
+    top += scroll;
+  }
+  draw_row(old_sel);
+  draw_row(sel);
+  refresh();
+}
+
+// Process Helpers
+// fork() for children that exec or exit. They get back the signal mask
+// layer was started with instead of the one blocking the event loop signals.
+static pid_t spawn_child() {
+  pid_t pid = fork();
+  if (pid == 0 && signals_blocked)
+    sigprocmask(SIG_SETMASK, &orig_sigmask, NULL);
+  return pid;
+}
+
+// system() replacement built on spawn_child()
+static int run_command(const char *command) {
+  pid_t pid = spawn_child();
+  if (pid < 0)
+    return -1;
+  if (pid == 0) {
+    execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+    _exit(127);
+  }
+
+  int status;
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR)
+      return -1;
+  }
+  return status;
+}
+
+// --- Action Functions
+static void notify_wallpaper_set(const char *file, const char *setter) {
+  char command[PATH_MAX_LEN + 256];
+  const char *filename = get_base_name(file);
+
+  snprintf(command, sizeof(command),
+           "if command -v dunstify >/dev/null 2>&1; then "
+           "dunstify -h string:x-dunst-stack-tag:sheet-wp -t 3000 \"Wallpaper "
+           "Set\" \"\\\"%s\\\" set via %s\"; "
+           "elif command -v notify-send >/dev/null 2>&1; then "
+           "notify-send -t 3000 \"Wallpaper Set\" \"\\\"%s\\\" set via %s\"; "
+           "fi",
+           filename, setter, filename, setter);
+
+  // Fork process to run notification command and detach it
+  if (spawn_child() == 0) {
+    setsid();
+    int ret = run_command(command);
+    (void)ret;
+    exit(0);
+  }
+}
+
+// Executable Lookup
+// Finding viewers used to mean a `command -v` shell per candidate and an
+// access() walk over $PATH on every preview. Instead each $PATH directory is
+// read once and the programs layer knows about are picked out of it. The
+// result is kept in memory and in $XDG_CACHE_HOME/layer/programs, and stays
+// valid while $PATH and the mtimes of the directories that were read are
+// unchanged.
+#define MAX_PROGRAMS (MAX_VIEWERS + 1)
+
+typedef struct {
+  char *dir;
+  struct timespec mtime; // tv_sec is -1 if the directory did not exist
+} PathDir;
+
+static const char *program_names[MAX_PROGRAMS];
+static char *program_paths[MAX_PROGRAMS];
+static int program_count = 0;
+static PathDir *path_dirs = NULL;
+static int path_dir_count = 0;
+static uint64_t programs_hash = 0;
+
+static void clear_programs() {
+  for (int i = 0; i < program_count; i++) {
+    free(program_paths[i]);
+    program_paths[i] = NULL;
+  }
+  for (int i = 0; i < path_dir_count; i++)
+    free(path_dirs[i].dir);
+  free(path_dirs);
+  path_dirs = NULL;
+  path_dir_count = 0;
+  programs_hash = 0;
+}
+
+static int add_path_dir(const char *dir, const struct timespec *mtime) {
+  PathDir *new_dirs =
+      realloc(path_dirs, (path_dir_count + 1) * sizeof(*new_dirs));
+  if (!new_dirs)
+    return -1;
+  path_dirs = new_dirs;
+  path_dirs[path_dir_count].dir = strdup(dir);
+  if (!path_dirs[path_dir_count].dir)
+    return -1;
+  path_dirs[path_dir_count].mtime = *mtime;
+  path_dir_count++;
+  return 0;
+}
+
+static int find_program_index(const char *name) {
+  for (int i = 0; i < program_count; i++) {
+    if (strcmp(program_names[i], name) == 0)
+      return i;
+  }
+  return -1;
+}
+
+// Check the lookup table against $PATH and the directories it was built from
+static int programs_current(uint64_t hash) {
+  if (hash != programs_hash || path_dir_count == 0)
+    return 0;
+  for (int i = 0; i < path_dir_count; i++) {
+    struct stat st;
+    if (stat(path_dirs[i].dir, &st) < 0) {
+      if (path_dirs[i].mtime.tv_sec != -1)
+        return 0;
+    } else if (st.st_mtim.tv_sec != path_dirs[i].mtime.tv_sec ||
+               st.st_mtim.tv_nsec != path_dirs[i].mtime.tv_nsec) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Read every $PATH directory once, in order, until all programs are found
+static void scan_path_dirs(const char *path_env) {
+  char *path_copy = strdup(path_env);
+  if (!path_copy)
+    return;
 
-      if (i == sel) {
-        attron(A_REVERSE);
+  int missing = program_count;
+  char *saveptr;
+  for (char *dir = strtok_r(path_copy, ":", &saveptr); dir && missing > 0;
+       dir = strtok_r(NULL, ":", &saveptr)) {
+    struct timespec mtime = {.tv_sec = -1};
+    DIR *d = opendir(dir);
+    if (d) {
+      struct stat st;
+      if (fstat(dirfd(d), &st) == 0)
+        mtime = st.st_mtim;
+      struct dirent *e;
+      while ((e = readdir(d)) && missing > 0) {
+        int i = find_program_index(e->d_name);
+        if (i < 0 || program_paths[i])
+          continue;
+        struct stat prog_st;
+        if (fstatat(dirfd(d), e->d_name, &prog_st, 0) < 0 ||
+            !S_ISREG(prog_st.st_mode) ||
+            faccessat(dirfd(d), e->d_name, X_OK, 0) < 0)
+          continue;
+        size_t len = strlen(dir) + strlen(e->d_name) + 2;
+        program_paths[i] = malloc(len);
+        if (program_paths[i]) {
+          snprintf(program_paths[i], len, "%s/%s", dir, e->d_name);
+          missing--;
+        }
       }
+      closedir(d);
+    }
+    add_path_dir(dir, &mtime);
+  }
+  free(path_copy);
+}
+
+static int get_programs_cache_path(char *out, size_t size) {
+  const char *cache_dir = get_cache_dir();
+  if (!cache_dir)
+    return -1;
+  snprintf(out, size, "%s/programs", cache_dir);
+  return 0;
+}
 
-      if (entry->type == FILE_DIR || entry->type == FILE_PARENT) {
-        attron(A_BOLD);
-        mvprintw(y, 0, "%s %s/", i == sel ? ">" : " ", entry->name);
-        attroff(A_BOLD);
-      } else {
-        // Display file size/date based on sort mode
-        char details[100] = "";
-        if (current_sort == SORT_SIZE) {
-          snprintf(details, sizeof(details), " (%s)", format_size(entry->size));
-        } else if (current_sort == SORT_DATE) {
-          char time_str[30];
-          strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M",
-                   localtime(&entry->mtime));
-          snprintf(details, sizeof(details), " (%s)", time_str);
-        }
-        mvprintw(y, 0, "%s %s%s", i == sel ? ">" : " ", entry->name, details);
-      }
+// Cache file format, one record per line:
+//   HASH=<hash of $PATH and program names>
+//   DIR=<mtime sec> <mtime nsec> <directory>
+//   PROG=<name> <full path>
+static int load_programs_cache(uint64_t hash) {
+  char cache_path[PATH_MAX_LEN + 16];
+  if (get_programs_cache_path(cache_path, sizeof(cache_path)) < 0)
+    return -1;
+  FILE *f = fopen(cache_path, "r");
+  if (!f)
+    return -1;
 
-      if (i == sel) {
-        attroff(A_REVERSE);
-      }
+  char line[PATH_MAX_LEN + 64];
+  int valid = 0;
+  while (fgets(line, sizeof(line), f)) {
+    line[strcspn(line, "\n")] = '\0';
+    if (strncmp(line, "HASH=", 5) == 0) {
+      unsigned long long file_hash = strtoull(line + 5, NULL, 16);
+      if (file_hash != hash)
+        break;
+      programs_hash = hash;
+      valid = 1;
+    } else if (!valid) {
+      break;
+    } else if (strncmp(line, "DIR=", 4) == 0) {
+      struct timespec mtime;
+      long long sec, nsec;
+      int offset;
+      if (sscanf(line + 4, "%lld %lld %n", &sec, &nsec, &offset) < 2)
+        continue;
+      mtime.tv_sec = sec;
+      mtime.tv_nsec = nsec;
+      add_path_dir(line + 4 + offset, &mtime);
+    } else if (strncmp(line, "PROG=", 5) == 0) {
+      char *space = strchr(line + 5, ' ');
+      if (!space)
+        continue;
+      *space = '\0';
+      int i = find_program_index(line + 5);
+      if (i >= 0 && !program_paths[i])
+        program_paths[i] = strdup(space + 1);
     }
   }
-  refresh();
+  fclose(f);
+  return valid ? 0 : -1;
 }
 
-// --- Action Functions
-static void notify_wallpaper_set(const char *file) {
-  char command[PATH_MAX_LEN + 256];
-  const char *filename = get_base_name(file);
+static void save_programs_cache() {
+  char cache_path[PATH_MAX_LEN + 16];
+  if (get_programs_cache_path(cache_path, sizeof(cache_path)) < 0)
+    return;
 
-  snprintf(command, sizeof(command),
-           "if command -v dunstify >/dev/null 2>&1; then "
-           "dunstify -h string:x-dunst-stack-tag:sheet-wp -t 3000 \"Wallpaper "
-           "Set\" \"\\\"%s\\\" set via %s\"; "
-           "elif command -v notify-send >/dev/null 2>&1; then "
-           "notify-send -t 3000 \"Wallpaper Set\" \"\\\"%s\\\" set via %s\"; "
-           "fi",
-           filename, wallsetter, filename, wallsetter);
+  char tmp_path[PATH_MAX_LEN + 32];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%d", cache_path, (int)getpid());
+  FILE *f = fopen(tmp_path, "w");
+  if (!f)
+    return;
+  fprintf(f, "HASH=%016llx\n", (unsigned long long)programs_hash);
+  for (int i = 0; i < path_dir_count; i++) {
+    fprintf(f, "DIR=%lld %lld %s\n", (long long)path_dirs[i].mtime.tv_sec,
+            (long long)path_dirs[i].mtime.tv_nsec, path_dirs[i].dir);
+  }
+  for (int i = 0; i < program_count; i++) {
+    if (program_paths[i])
+      fprintf(f, "PROG=%s %s\n", program_names[i], program_paths[i]);
+  }
+  if (fclose(f) == 0)
+    rename(tmp_path, cache_path);
+  else
+    unlink(tmp_path);
+}
 
-  // Fork process to run notification command and detach it
-  if (fork() == 0) {
-    setsid();
-    int ret = system(command);
-    (void)ret;
-    exit(0);
+// Make sure the lookup table matches the current $PATH
+static void resolve_programs() {
+  const char *path_env = getenv("PATH");
+  if (!path_env)
+    path_env = "";
+
+  if (program_count == 0) {
+    for (int i = 0; i < viewer_count; i++)
+      program_names[program_count++] = viewer_options[i].name;
+    program_names[program_count++] = "wallpaper-daemon";
+  }
+
+  uint64_t hash = hash_string(FNV_OFFSET, path_env);
+  for (int i = 0; i < program_count; i++)
+    hash = hash_string(hash_string(hash, ":"), program_names[i]);
+  if (programs_current(hash))
+    return;
+
+  clear_programs();
+  if (load_programs_cache(hash) == 0 && programs_current(hash))
+    return;
+
+  clear_programs();
+  programs_hash = hash;
+  scan_path_dirs(path_env);
+  save_programs_cache();
+}
+
+// Full path of a program in $PATH, or NULL. Names that are not in
+// program_names are looked up directly. The result may be a static buffer.
+static const char *find_program(const char *name) {
+  if (strchr(name, '/'))
+    return access(name, X_OK) == 0 ? name : NULL;
+
+  resolve_programs();
+  int i = find_program_index(name);
+  if (i >= 0)
+    return program_paths[i];
+
+  static char full_path[PATH_MAX_LEN];
+  const char *path_env = getenv("PATH");
+  char *path_copy = path_env ? strdup(path_env) : NULL;
+  if (!path_copy)
+    return NULL;
+  char *saveptr;
+  for (char *dir = strtok_r(path_copy, ":", &saveptr); dir;
+       dir = strtok_r(NULL, ":", &saveptr)) {
+    snprintf(full_path, sizeof(full_path), "%s/%s", dir, name);
+    if (access(full_path, X_OK) == 0) {
+      free(path_copy);
+      return full_path;
+    }
   }
+  free(path_copy);
+  return NULL;
 }
 
 static int detect_available_viewers(char *available_viewers[], int max_count) {
   int count = 0;
-  char *path_env = getenv("PATH");
-
-  if (!path_env)
-    return 0;
 
   for (int i = 0; i < viewer_count; i++) {
-    char command[256];
-    snprintf(command, sizeof(command), "command -v %s >/dev/null 2>&1",
-             viewer_options[i].name);
-
-    if (system(command) == 0) {
+    if (find_program(viewer_options[i].name)) {
       available_viewers[count] = viewer_options[i].name;
       count++;
       if (count >= max_count)
@@ -474,85 +1610,70 @@ static int detect_available_viewers(char *available_viewers[], int max_count) {
   return count;
 }
 
-static int imageviewer_exists() {
-  // Check binary in current dir
-  if (access("./imageviewer", X_OK) == 0) {
-    return 1;
-  }
-
-  // Check in build directory
-  if (access("./build/imageviewer", X_OK) == 0) {
-    return 1;
+// Locate imageviewer: next to the current directory's build, next to the
+// layer binary, then $PATH. Returns 0 and fills path if found.
+static int find_imageviewer(char *path, size_t len) {
+  // Check binary in current dir, then in build directory
+  const char *local[] = {"./imageviewer", "./build/imageviewer", NULL};
+  for (int i = 0; local[i]; i++) {
+    if (access(local[i], X_OK) == 0) {
+      snprintf(path, len, "%s", local[i]);
+      return 0;
+    }
   }
 
   // Check executables in layer dir
-  char layer_path[4096];
-  if (readlink("/proc/self/exe", layer_path, sizeof(layer_path) - 1) != -1) {
+  char layer_path[PATH_MAX_LEN];
+  ssize_t layer_len = readlink("/proc/self/exe", layer_path,
+                               sizeof(layer_path) - 1);
+  if (layer_len > 0) {
+    layer_path[layer_len] = '\0';
     char *last_slash = strrchr(layer_path, '/');
     if (last_slash) {
       *last_slash = '\0';
-      char full_path[4096];
-      snprintf(full_path, sizeof(full_path), "%s/imageviewer", layer_path);
-      full_path[sizeof(full_path) - 1] = '\0';
-      if (access(full_path, X_OK) == 0) {
-        return 1;
-      }
-      snprintf(full_path, sizeof(full_path), "%s/build/imageviewer",
-               layer_path);
-      full_path[sizeof(full_path) - 1] = '\0';
-      if (access(full_path, X_OK) == 0) {
-        return 1;
-      }
+      snprintf(path, len, "%s/imageviewer", layer_path);
+      if (access(path, X_OK) == 0)
+        return 0;
+      snprintf(path, len, "%s/build/imageviewer", layer_path);
+      if (access(path, X_OK) == 0)
+        return 0;
     }
   }
 
   // Check in PATH
-  char *path = getenv("PATH");
-  if (path) {
-    char *path_copy = strdup(path);
-    char *dir = strtok(path_copy, ":");
-    while (dir) {
-      char full_path[4096];
-      snprintf(full_path, sizeof(full_path), "%s/imageviewer", dir);
-      full_path[sizeof(full_path) - 1] = '\0';
-      if (access(full_path, X_OK) == 0) {
-        free(path_copy);
-        return 1;
-      }
-      dir = strtok(NULL, ":");
-    }
-    free(path_copy);
+  const char *found = find_program("imageviewer");
+  if (found) {
+    snprintf(path, len, "%s", found);
+    return 0;
   }
+  return -1;
+}
 
-  return 0;
+static int imageviewer_exists() {
+  char path[PATH_MAX_LEN + 16];
+  return find_imageviewer(path, sizeof(path)) == 0;
 }
 
 static void show_preview() {
-  if (n == 0 || list[sel].type != FILE_IMAGE)
+  if (n == 0 || entry_at(sel)->type != FILE_IMAGE)
     return;
 
   def_prog_mode();
   endwin();
 
-  const char *file = list[sel].path;
+  const char *file = entry_path(entry_at(sel));
   printf("\nOpening image: %s\n", file);
   fflush(stdout);
 
   int viewer_launched = 0;
 
   // First, try the configured viewer
-  if (strcmp(viewer, "imageviewer") == 0 && imageviewer_exists()) {
+  char imageviewer_path[PATH_MAX_LEN + 16];
+  if (strcmp(viewer, "imageviewer") == 0 &&
+      find_imageviewer(imageviewer_path, sizeof(imageviewer_path)) == 0) {
     printf("Trying built-in imageviewer...\n");
     fflush(stdout);
 
-    char imageviewer_path[4096] = "imageviewer"; // default
-
-    if (access("./build/imageviewer", X_OK) == 0) {
-      strcpy(imageviewer_path, "./build/imageviewer");
-    } else if (access("./imageviewer", X_OK) == 0) {
-      strcpy(imageviewer_path, "./imageviewer");
-    }
-
     // Calculate preview size based on terminal size
     struct winsize ws;
     int term_width = 80;
@@ -584,12 +1705,12 @@ static void show_preview() {
     printf("Running: %s\n", command);
     fflush(stdout);
 
-    int ret = system(command);
+    int ret = run_command(command);
     if (ret != 32512 && ret != 127 && ret != -1) {
       viewer_launched = 1;
       printf("imageviewer exited with status %d\n", WEXITSTATUS(ret));
     } else {
-      printf("system() returned error: %d\n", ret);
+      printf("Running the viewer failed: %d\n", ret);
     }
   }
 
@@ -615,30 +1736,108 @@ static void show_preview() {
   refresh();
 }
 
-static void kill_wallpaper_processes() {
-  pid_t pid = fork();
-  if (pid == 0) {
-    execlp("pkill", "pkill", "-9", "feh", NULL);
-    exit(0);
+// Built-in Wallpaper Setter
+// With the "builtin" setter, on Wayland wallpaper-daemon keeps a background
+// surface on every output and layer only sends it the new path (see
+// wallpaper-ipc.h). On X11 the root window pixmap is set from here directly.
+static int is_wayland_session() {
+  char *xdg_session = getenv("XDG_SESSION_TYPE");
+  char *wayland_display = getenv("WAYLAND_DISPLAY");
+  return (xdg_session && strcasecmp(xdg_session, "wayland") == 0) ||
+         wayland_display;
+}
+
+// Send a request line and wait for the daemon's reply line. This runs on
+// the UI thread, so the reply is only waited for briefly. Returns -1 if no
+// daemon is listening, and 1 if the request was sent but the daemon has not
+// answered yet (it is still decoding a large image, say).
+static int wallpaper_ipc_request(const char *request, char *response,
+                                 size_t len) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (wallpaper_ipc_path(addr.sun_path, sizeof(addr.sun_path)) < 0)
+    return -1;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
   }
-  waitpid(pid, NULL, 0);
 
-  pid = fork();
-  if (pid == 0) {
-    execlp("pkill", "pkill", "-9", "swaybg", NULL);
-    exit(0);
+  struct timeval timeout = {.tv_usec = WALLPAPER_IPC_TIMEOUT_MS * 1000};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  size_t sent = 0, request_len = strlen(request);
+  while (sent < request_len) {
+    ssize_t ret = send(fd, request + sent, request_len - sent, MSG_NOSIGNAL);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0) {
+      close(fd);
+      return -1;
+    }
+    sent += ret;
   }
-  waitpid(pid, NULL, 0);
+
+  size_t got = 0;
+  int timed_out = 0;
+  while (got < len - 1) {
+    ssize_t ret = read(fd, response + got, len - 1 - got);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0) {
+      timed_out = ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+      break;
+    }
+    got += ret;
+    if (memchr(response, '\n', got))
+      break;
+  }
+  response[got] = '\0';
+  response[strcspn(response, "\n")] = '\0';
+  close(fd);
+  return timed_out ? 1 : 0;
 }
 
-static void set_wallpaper_from_file(const char *file) {
-  if (strlen(file) == 0)
-    return;
-  kill_wallpaper_processes();
+// Prefer the wallpaper-daemon built next to layer, then $PATH
+static void find_wallpaper_daemon(char *path, size_t len) {
+  char exe[PATH_MAX_LEN];
+  ssize_t exe_len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+  if (exe_len > 0) {
+    exe[exe_len] = '\0';
+    char *last_slash = strrchr(exe, '/');
+    if (last_slash) {
+      *last_slash = '\0';
+      snprintf(path, len, "%s/wallpaper-daemon", exe);
+      if (access(path, X_OK) == 0)
+        return;
+    }
+  }
+  const char *found = find_program("wallpaper-daemon");
+  snprintf(path, len, "%s", found ? found : "wallpaper-daemon");
+}
 
-  pid_t pid = fork();
+// Stop swaybg and feh. Only called from children, which may wait for pkill.
+static void pkill_setters() {
+  const char *names[] = {"feh", "swaybg"};
+  for (size_t i = 0; i < sizeof(names) / sizeof(*names); i++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      execlp("pkill", "pkill", "-9", names[i], (char *)NULL);
+      _exit(0);
+    }
+    if (pid > 0)
+      waitpid(pid, NULL, 0);
+  }
+}
+
+// Fork a wallpaper setter detached from the terminal. With replace, the
+// child stops swaybg/feh before it execs, so pkill can't catch the new one.
+static pid_t spawn_setter(char *const args[], int replace) {
+  pid_t pid = spawn_child();
   if (pid == 0) {
-    // Child process: Detach and execute wallpaper setter
     int devnull = open("/dev/null", O_WRONLY);
     if (devnull >= 0) {
       dup2(devnull, STDOUT_FILENO);
@@ -649,42 +1848,348 @@ static void set_wallpaper_from_file(const char *file) {
     }
 
     setsid();
+    if (replace)
+      pkill_setters();
+    execvp(args[0], args);
+    exit(1);
+  }
+  return pid;
+}
+
+// pkill runs in a child of its own, reaped through the SIGCHLD signalfd
+static void kill_external_setters() {
+  if (spawn_child() == 0) {
+    pkill_setters();
+    _exit(0);
+  }
+}
+
+// Daemon Requests
+// Starting the daemon, waiting for it to listen and waiting for its reply
+// all happen from the event loop, which polls daemon_req.fd and
+// daemon_req.timer_fd. The change is reported once the daemon has answered.
+typedef enum { DAEMON_IDLE, DAEMON_STARTING, DAEMON_WAITING } DaemonState;
+
+static struct {
+  DaemonState state;
+  pid_t pid;    // Daemon started by us, until it listens
+  int tries;    // Connect attempts left while it starts
+  int fd;       // Connection waiting for the reply
+  int timer_fd; // Connect retries, then the reply deadline
+  size_t got;
+  char response[256];
+  char file[PATH_MAX_LEN];
+} daemon_req = {.fd = -1, .timer_fd = -1};
+
+static void arm_daemon_timer(int ms, int repeat) {
+  struct itimerspec its = {0};
+  its.it_value.tv_sec = ms / 1000;
+  its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+  if (repeat)
+    its.it_interval = its.it_value;
+  timerfd_settime(daemon_req.timer_fd, 0, &its, NULL);
+}
+
+static void cancel_daemon_request() {
+  if (daemon_req.fd >= 0)
+    close(daemon_req.fd);
+  if (daemon_req.state == DAEMON_STARTING)
+    kill(daemon_req.pid, SIGTERM); // Don't let it show up after we fell back
+  if (daemon_req.timer_fd >= 0)
+    arm_daemon_timer(0, 0);
+  daemon_req.fd = -1;
+  daemon_req.pid = 0;
+  daemon_req.state = DAEMON_IDLE;
+}
+
+static void stop_wallpaper_daemon() {
+  char response[64];
+  cancel_daemon_request();
+  wallpaper_ipc_request("quit\n", response, sizeof(response));
+}
+
+static void kill_wallpaper_processes() {
+  stop_wallpaper_daemon();
+  kill_external_setters();
+}
+
+// Run swaybg or feh in place of whatever setter is running
+static int set_external_wallpaper(const char *file, const char *setter) {
+  stop_wallpaper_daemon();
+
+  if (strcmp(setter, "swaybg") == 0) {
+    char *args[] = {"swaybg", "-m", "fill", "-i", (char *)file, NULL};
+    return spawn_setter(args, 1) < 0 ? -1 : 0;
+  }
+  char *args[] = {"feh", "--bg-scale", (char *)file, NULL};
+  return spawn_setter(args, 1) < 0 ? -1 : 0;
+}
 
-    if (strcmp(wallsetter, "swaybg") == 0) {
-      char *args[] = {"swaybg", "-m", "fill", "-i", (char *)file, NULL};
-      execvp("swaybg", args);
+// Report a wallpaper change. error says why the builtin setter failed, in
+// which case the external setter of the session takes over rather than
+// leaving no wallpaper at all.
+static void finish_wallpaper(const char *file, const char *error) {
+  const char *setter = wallsetter;
+  if (error)
+    setter = is_wayland_session() ? "swaybg" : "feh";
+  if (strcmp(setter, "builtin") != 0 &&
+      set_external_wallpaper(file, setter) < 0) {
+    if (!isendwin()) {
+      mvprintw(LINES - 1, 0, "Could not set wallpaper: %s",
+               get_base_name(file));
+      clrtoeol();
+      refresh();
     } else {
-      char *args[] = {"feh", "--bg-scale", (char *)file, NULL};
-      execvp("feh", args);
+      fprintf(stderr, "Could not set wallpaper: %s\n", file);
     }
-    exit(1);
-  } else if (pid > 0) {
-    save_last_wallpaper(file);
-    // Parent
-    if (!isendwin()) { // draw only if ncurses is active
+    return;
+  }
+
+  save_last_wallpaper(file);
+  if (!isendwin()) { // draw only if ncurses is active
+    if (error)
+      mvprintw(LINES - 1, 0, "Wallpaper set with %s (builtin: %s): %s",
+               setter, error, get_base_name(file));
+    else
       mvprintw(LINES - 1, 0, "Wallpaper set: %s", get_base_name(file));
-      clrtoeol();
-      refresh();
+    clrtoeol();
+    refresh();
+  } else if (error) {
+    fprintf(stderr, "Builtin setter failed (%s), using %s\n", error, setter);
+  }
+  // Send desktop notification
+  notify_wallpaper_set(file, setter);
+}
+
+static void finish_daemon_request(const char *error) {
+  char file[PATH_MAX_LEN];
+  snprintf(file, sizeof(file), "%s", daemon_req.file);
+  cancel_daemon_request();
+  // The daemon has drawn the image, only now can swaybg/feh go
+  if (!error)
+    kill_external_setters();
+  finish_wallpaper(file, error);
+}
+
+// Connect and send the request. Returns 1 if the daemon doesn't listen yet.
+static int send_daemon_request() {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  char request[WALLPAPER_IPC_MAX_LINE];
+  if (wallpaper_ipc_path(addr.sun_path, sizeof(addr.sun_path)) < 0 ||
+      snprintf(request, sizeof(request), "set %s\n", daemon_req.file) >=
+          (int)sizeof(request))
+    return -1;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    int err = errno;
+    close(fd);
+    return err == ENOENT || err == ECONNREFUSED || err == EAGAIN ? 1 : -1;
+  }
+
+  // A request line fits the socket buffer, so it goes out in one send
+  size_t len = strlen(request);
+  if (send(fd, request, len, MSG_NOSIGNAL) != (ssize_t)len) {
+    close(fd);
+    return -1;
+  }
+  daemon_req.state = DAEMON_WAITING;
+  daemon_req.pid = 0;
+  daemon_req.fd = fd;
+  daemon_req.got = 0;
+  arm_daemon_timer(WALLPAPER_REPLY_MS, 0);
+  return 0;
+}
+
+// Send the daemon the new wallpaper, starting it first if it isn't running.
+// Returns -1 if the request can't be made at all.
+static int start_daemon_request(const char *file) {
+  if (strchr(file, '\n') || strlen(file) >= sizeof(daemon_req.file))
+    return -1;
+  if (daemon_req.timer_fd < 0)
+    daemon_req.timer_fd =
+        timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (daemon_req.timer_fd < 0)
+    return -1;
+
+  snprintf(daemon_req.file, sizeof(daemon_req.file), "%s", file);
+  if (daemon_req.state == DAEMON_STARTING)
+    return 0; // Sent once it listens
+  cancel_daemon_request(); // The newer image supersedes a pending reply
+  int ret = send_daemon_request();
+  if (ret <= 0)
+    return ret;
+
+  // No daemon yet: start one and keep connecting until it listens
+  char daemon_path[PATH_MAX_LEN + 32];
+  find_wallpaper_daemon(daemon_path, sizeof(daemon_path));
+  char *args[] = {daemon_path, NULL};
+  pid_t pid = spawn_setter(args, 0);
+  if (pid < 0)
+    return -1;
+  daemon_req.state = DAEMON_STARTING;
+  daemon_req.pid = pid;
+  daemon_req.tries = WALLPAPER_START_MS / WALLPAPER_RETRY_MS;
+  arm_daemon_timer(WALLPAPER_RETRY_MS, 1);
+  return 0;
+}
+
+static void handle_daemon_timer() {
+  uint64_t expirations;
+  if (read(daemon_req.timer_fd, &expirations, sizeof(expirations)) < 0)
+    return;
+
+  if (daemon_req.state == DAEMON_WAITING) {
+    finish_daemon_request("no reply from wallpaper-daemon");
+  } else if (daemon_req.state == DAEMON_STARTING) {
+    // Exited, or already reaped by the SIGCHLD handler
+    if (waitpid(daemon_req.pid, NULL, WNOHANG) != 0) {
+      daemon_req.state = DAEMON_IDLE;
+      finish_daemon_request("wallpaper-daemon exited");
+      return;
+    }
+    int ret = send_daemon_request();
+    if (ret < 0)
+      finish_daemon_request("cannot reach wallpaper-daemon");
+    else if (ret == 1 && --daemon_req.tries <= 0)
+      finish_daemon_request("wallpaper-daemon did not start");
+  }
+}
+
+static void handle_daemon_reply() {
+  size_t room = sizeof(daemon_req.response) - 1 - daemon_req.got;
+  ssize_t ret;
+  do {
+    ret = read(daemon_req.fd, daemon_req.response + daemon_req.got, room);
+  } while (ret < 0 && errno == EINTR);
+  if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return;
+  if (ret > 0) {
+    daemon_req.got += ret;
+    daemon_req.response[daemon_req.got] = '\0';
+    if (!strchr(daemon_req.response, '\n') && (size_t)ret < room)
+      return; // Rest of the line still to come
+  }
+
+  char *response = daemon_req.response;
+  response[daemon_req.got] = '\0';
+  response[strcspn(response, "\n")] = '\0';
+  if (strcmp(response, "ok") == 0)
+    finish_daemon_request(NULL);
+  else if (strncmp(response, "error ", 6) == 0)
+    finish_daemon_request(response + 6);
+  else
+    finish_daemon_request("no reply from wallpaper-daemon");
+}
+
+// Drive a daemon request to its end without the event loop, for command line
+// use where there is nothing else to do meanwhile
+static void wait_daemon_request() {
+  while (daemon_req.state != DAEMON_IDLE) {
+    struct pollfd fds[2] = {{.fd = daemon_req.fd, .events = POLLIN},
+                            {.fd = daemon_req.timer_fd, .events = POLLIN}};
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      finish_daemon_request("poll failed");
+      break;
     }
-    // Send desktop notification
-    notify_wallpaper_set(file);
+    if (fds[0].revents)
+      handle_daemon_reply();
+    else if (fds[1].revents & POLLIN)
+      handle_daemon_timer();
+  }
+}
+
+// X11 Wallpapers
+// x11_set_wallpaper() decodes and scales on a thread with a display
+// connection of its own. The result is reported from finish_background_work()
+// and a change asked for meanwhile waits in queued.
+static struct {
+  int busy;
+  int done; // Set by the thread, atomically
+  int ret;
+  char file[PATH_MAX_LEN];
+  char queued[PATH_MAX_LEN];
+} x11_job;
+
+static void *x11_wallpaper_thread(void *arg) {
+  (void)arg;
+  x11_job.ret = x11_set_wallpaper(x11_job.file);
+  __atomic_store_n(&x11_job.done, 1, __ATOMIC_RELEASE);
+  uint64_t one = 1;
+  ssize_t ret = write(work_fd, &one, sizeof(one));
+  (void)ret;
+  return NULL;
+}
+
+static void start_x11_wallpaper(const char *file) {
+  if (x11_job.busy) {
+    snprintf(x11_job.queued, sizeof(x11_job.queued), "%s", file);
+    return;
+  }
+
+  pthread_t thread;
+  snprintf(x11_job.file, sizeof(x11_job.file), "%s", file);
+  x11_job.done = 0;
+  if (pthread_create(&thread, NULL, x11_wallpaper_thread, NULL) != 0) {
+    finish_wallpaper(file, x11_wallpaper_error(x11_set_wallpaper(file)));
+    return;
+  }
+  pthread_detach(thread);
+  x11_job.busy = 1;
+  show_status("Setting wallpaper...");
+}
+
+static void finish_x11_wallpaper() {
+  x11_job.busy = 0;
+  finish_wallpaper(x11_job.file, x11_wallpaper_error(x11_job.ret));
+  if (x11_job.queued[0]) {
+    char file[PATH_MAX_LEN];
+    snprintf(file, sizeof(file), "%s", x11_job.queued);
+    x11_job.queued[0] = '\0';
+    start_x11_wallpaper(file);
+  }
+}
+
+static void set_wallpaper_from_file(const char *file) {
+  if (strlen(file) == 0)
+    return;
+
+  if (strcmp(wallsetter, "builtin") != 0) {
+    finish_wallpaper(file, NULL);
+  } else if (!is_wayland_session()) {
+    if (event_loop_running)
+      start_x11_wallpaper(file);
+    else
+      finish_wallpaper(file, x11_wallpaper_error(x11_set_wallpaper(file)));
+  } else if (start_daemon_request(file) < 0) {
+    finish_wallpaper(file, "cannot reach wallpaper-daemon");
+  } else if (!event_loop_running) {
+    wait_daemon_request();
+  } else {
+    show_status("Setting wallpaper...");
   }
 }
 
 static void set_wallpaper() {
-  if (n == 0 || list[sel].type != FILE_IMAGE)
+  if (n == 0 || entry_at(sel)->type != FILE_IMAGE)
     return;
-  set_wallpaper_from_file(list[sel].path);
+  set_wallpaper_from_file(entry_path(entry_at(sel)));
 }
 
 static void set_random_wallpaper() {
   if (n == 0)
     return;
 
-  int image_indices[MAX];
+  int *image_indices = malloc(n * sizeof(*image_indices));
+  if (!image_indices)
+    return;
   int image_count = 0;
   for (int i = 0; i < n; i++) {
-    if (list[i].type == FILE_IMAGE) {
+    if (entry_at(i)->type == FILE_IMAGE) {
       image_indices[image_count++] = i;
     }
   }
@@ -697,12 +2202,14 @@ static void set_random_wallpaper() {
     } else {
       fprintf(stderr, "No images found for random selection.\n");
     }
+    free(image_indices);
     return;
   }
 
   // Seed rand with current time
   srand(time(NULL) * getpid());
   int random_index_in_list = image_indices[rand() % image_count];
+  free(image_indices);
 
   if (!isendwin()) {
     sel = random_index_in_list;
@@ -715,7 +2222,7 @@ static void set_random_wallpaper() {
     draw_menu();
   }
 
-  set_wallpaper_from_file(list[random_index_in_list].path);
+  set_wallpaper_from_file(entry_path(entry_at(random_index_in_list)));
 }
 
 static void restore_last_wallpaper() {
@@ -755,8 +2262,8 @@ static void set_wallpaper_dmenu() {
   }
 
   for (int i = 0; i < n; i++) {
-    if (list[i].type == FILE_IMAGE) {
-      dprintf(input_fd, "%s\n", list[i].name);
+    if (entry_at(i)->type == FILE_IMAGE) {
+      dprintf(input_fd, "%s\n", entry_name(entry_at(i)));
     }
   }
   close(input_fd);
@@ -767,9 +2274,9 @@ static void set_wallpaper_dmenu() {
            "cat '%s' | dmenu -l 20 -p 'Select wallpaper:' > '%s'", input_file,
            temp_file);
 
-  int ret = system(command);
+  int ret = run_command(command);
   if (ret == -1) {
-    perror("system");
+    perror("dmenu");
     unlink(temp_file);
     unlink(input_file);
     return;
@@ -792,8 +2299,10 @@ static void set_wallpaper_dmenu() {
   // Find and set the selected wallpaper
   if (selected[0]) {
     for (int i = 0; i < n; i++) {
-      if (list[i].type == FILE_IMAGE && strcmp(list[i].name, selected) == 0) {
-        set_wallpaper_from_file(list[i].path);
+      FileEntry *entry = entry_at(i);
+      if (entry->type == FILE_IMAGE &&
+          strcmp(entry_name(entry), selected) == 0) {
+        set_wallpaper_from_file(entry_path(entry));
         break;
       }
     }
@@ -804,10 +2313,11 @@ static void enter_directory() {
   if (n == 0)
     return;
 
-  if (list[sel].type == FILE_DIR || list[sel].type == FILE_PARENT) {
+  FileEntry *selected = entry_at(sel);
+  if (selected->type == FILE_DIR || selected->type == FILE_PARENT) {
     char new_dir[PATH_MAX_LEN];
 
-    if (list[sel].type == FILE_PARENT) {
+    if (selected->type == FILE_PARENT) {
       char *last_slash = strrchr(current_dir, '/');
       if (last_slash) {
         if (strcmp(current_dir, "/") == 0) {
@@ -820,7 +2330,7 @@ static void enter_directory() {
       }
       strcpy(new_dir, current_dir);
     } else {
-      strncpy(new_dir, list[sel].path, sizeof(new_dir) - 1);
+      strncpy(new_dir, entry_path(selected), sizeof(new_dir) - 1);
       new_dir[sizeof(new_dir) - 1] = '\0';
     }
 
@@ -831,14 +2341,13 @@ static void enter_directory() {
     } else {
       scan(current_dir);
       if (!isendwin()) {
+        draw_menu();
         mvprintw(LINES - 1, 0, "Error opening directory");
         clrtoeol();
         refresh();
-        getch();
-        draw_menu();
       }
     }
-  } else if (list[sel].type == FILE_IMAGE) {
+  } else if (selected->type == FILE_IMAGE) {
     set_wallpaper();
   }
 }
@@ -870,14 +2379,15 @@ static void change_config() {
 
   char new_setter[256];
   printf("\nCurrent wallpaper setter: %s\n", wallsetter);
-  printf("Enter new setter (feh or swaybg, empty to keep): ");
+  printf("Enter new setter (feh, swaybg or builtin, empty to keep): ");
   fflush(stdout);
   if (fgets(new_setter, sizeof(new_setter), stdin) == NULL) {
     new_setter[0] = '\0';
   }
   new_setter[strcspn(new_setter, "\n")] = 0;
   if (strlen(new_setter) > 0 &&
-      (strcmp(new_setter, "feh") == 0 || strcmp(new_setter, "swaybg") == 0))
+      (strcmp(new_setter, "feh") == 0 || strcmp(new_setter, "swaybg") == 0 ||
+       strcmp(new_setter, "builtin") == 0))
     strncpy(wallsetter, new_setter, sizeof(wallsetter) - 1);
 
   /* char new_viewer[256]; */
@@ -925,11 +2435,7 @@ static void change_config() {
       strncpy(viewer, new_viewer, sizeof(viewer) - 1);
     } else {
       // Check if viewer exists
-      char test_cmd[512];
-      snprintf(test_cmd, sizeof(test_cmd), "command -v %s >/dev/null 2>&1",
-               new_viewer);
-
-      if (system(test_cmd) == 0 ||
+      if (find_program(new_viewer) ||
           (strcmp(new_viewer, "imageviewer") == 0 && imageviewer_exists())) {
         strncpy(viewer, new_viewer, sizeof(viewer) - 1);
       } else {
@@ -959,12 +2465,7 @@ static void first_time_setup() {
   printf("Welcome to Layer (v%s)!\n\n", VERSION);
 
   // Auto-detect session type
-  char *xdg_session = getenv("XDG_SESSION_TYPE");
-  char *wayland_display = getenv("WAYLAND_DISPLAY");
-  int is_wayland = (xdg_session && strcasecmp(xdg_session, "wayland") == 0) ||
-                   wayland_display;
-
-  if (is_wayland) {
+  if (is_wayland_session()) {
     printf("Detected: Wayland session (using swaybg as default)\n");
     strcpy(wallsetter, "swaybg");
   } else {
@@ -998,12 +2499,15 @@ static void first_time_setup() {
   }
 
   char setter_choice[10];
-  printf("\n[1] swaybg (Wayland)\n[2] feh (X11)\n");
-  printf("Choose wallpaper setter (1/2): ");
+  printf("\n[1] swaybg (Wayland)\n[2] feh (X11)\n"
+         "[3] builtin (wallpaper-daemon on Wayland, root window on X11)\n");
+  printf("Choose wallpaper setter (1/2/3): ");
   fflush(stdout);
   if (fgets(setter_choice, sizeof(setter_choice), stdin)) {
     if (setter_choice[0] == '1')
       strcpy(wallsetter, "swaybg");
+    else if (setter_choice[0] == '3')
+      strcpy(wallsetter, "builtin");
     else
       strcpy(wallsetter, "feh");
   }
@@ -1041,15 +2545,145 @@ static void print_help() {
 
 static void print_version() { printf("layer version %s\n", VERSION); }
 
-// Terminal Resize Handler
-static void handle_resize(int sig) {
-  (void)sig;
-  if (!isendwin()) {
-    endwin();
-    refresh();
-    clear();
+// Event Loop Handlers
+static void show_status(const char *message) {
+  mvprintw(LINES - 1, 0, "%s", message);
+  clrtoeol();
+  refresh();
+}
+
+static void *sort_stats_thread(void *arg) {
+  (void)arg;
+  prefetch_stats();
+  __atomic_store_n(&stats_done, 1, __ATOMIC_RELEASE);
+  uint64_t one = 1;
+  ssize_t ret = write(work_fd, &one, sizeof(one));
+  (void)ret;
+  return NULL;
+}
+
+// Fetch the stats missing for sorting by mode on a thread, and switch to it
+// in finish_background_work(). Returns 1 if the fetch was started, 0 if
+// nothing is missing or there is no event loop to finish it.
+static int start_sort_prefetch(SortMode mode) {
+  int missing = 0;
+  if (mode != SORT_NAME) {
+    for (int i = 0; i < n && !missing; i++)
+      missing = !entries[i].stats_fetched;
+  }
+
+  pthread_t thread;
+  stats_done = 0;
+  if (!missing || work_fd < 0 ||
+      pthread_create(&thread, NULL, sort_stats_thread, NULL) != 0)
+    return 0;
+  pthread_detach(thread);
+  stats_busy = 1;
+  pending_sort = mode;
+  return 1;
+}
+
+// Switch the sort mode. The list keeps its current order until the stats
+// it needs are in.
+static void request_sort(SortMode mode) {
+  if (start_sort_prefetch(mode)) {
+    show_status("Fetching file stats...");
+    return;
+  }
+
+  current_sort = mode;
+  apply_sort();
+  draw_menu();
+}
+
+static void finish_background_work() {
+  uint64_t count;
+  if (read(work_fd, &count, sizeof(count)) < 0)
+    return;
+  if (x11_job.busy && __atomic_load_n(&x11_job.done, __ATOMIC_ACQUIRE))
+    finish_x11_wallpaper();
+  if (!stats_busy || !__atomic_load_n(&stats_done, __ATOMIC_ACQUIRE))
+    return;
+  stats_busy = 0;
+  save_index();
+  current_sort = pending_sort;
+  apply_sort();
+  draw_menu();
+}
+
+// Returns 0 when the loop should exit
+static int handle_signals() {
+  struct signalfd_siginfo info;
+  int running = 1;
+  while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+    if (info.ssi_signo == SIGCHLD) {
+      // Reap wallpaper setters and notification helpers
+      while (waitpid(-1, NULL, WNOHANG) > 0)
+        ;
+    } else if (info.ssi_signo == SIGWINCH) {
+      struct winsize ws;
+      if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0)
+        resizeterm(ws.ws_row, ws.ws_col);
+      int max_display = LINES - 3;
+      if (max_display > 0 && sel >= top + max_display)
+        top = sel - max_display + 1;
+      draw_menu();
+    } else if (info.ssi_signo == SIGINT || info.ssi_signo == SIGTERM) {
+      running = 0;
+    }
+  }
+  return running;
+}
+
+// Returns 0 when the loop should exit
+static int handle_key(int ch) {
+  if (ch == 'q' || ch == 'Q')
+    return 0;
+
+  // Everything that rebuilds or reorders the table waits for the workers
+  int modifies_table = ch == '\n' || ch == KEY_RIGHT || ch == 'l' ||
+                       ch == KEY_LEFT || ch == 'h' || ch == 's' ||
+                       ch == KEY_F(1) || ch == 'd';
+  if (stats_busy && modifies_table) {
+    show_status("Fetching file stats...");
+    return 1;
+  }
+
+  if (ch == KEY_DOWN || ch == 'j') {
+    move_selection(sel + 1);
+  } else if (ch == KEY_UP || ch == 'k') {
+    move_selection(sel - 1);
+  } else if (ch == '\n' || ch == KEY_RIGHT || ch == 'l') {
+    enter_directory();
+  } else if (ch == KEY_LEFT || ch == 'h') {
+    for (int i = 0; i < n; i++) {
+      if (entry_at(i)->type == FILE_PARENT) {
+        sel = i;
+        enter_directory();
+        break;
+      }
+    }
+  } else if (ch == 'v' && n > 0 && entry_at(sel)->type == FILE_IMAGE) {
+    show_preview();
+    draw_menu();
+  } else if (ch == 'r') {
+    set_random_wallpaper();
+  } else if (ch == 's') {
+    request_sort((current_sort + 1) % 3);
+  } else if (ch == 'K') {
+    kill_wallpaper_processes();
+    show_status("Wallpaper killed");
+  } else if (ch == KEY_F(1)) {
+    change_config();
+    draw_menu();
+  } else if (ch == 'd') {
+    change_config();
+    draw_menu();
+  } else if (ch == 'm') {
+    set_wallpaper_dmenu();
     draw_menu();
   }
+  return 1;
 }
 
 static void ncurses_exit_handler(int sig) {
@@ -1063,7 +2697,6 @@ static void ncurses_exit_handler(int sig) {
 int main(int argc, char **argv) {
   signal(SIGINT, ncurses_exit_handler);
   signal(SIGTERM, ncurses_exit_handler);
-  signal(SIGWINCH, handle_resize);
 
   int dmenu_mode = 0;
 
@@ -1133,13 +2766,30 @@ int main(int argc, char **argv) {
     snprintf(current_dir, sizeof(current_dir), "%s/Pictures", getenv("HOME"));
   }
 
+  // Created before the first scan, so that its stat prefetch already runs
+  // in the background
+  work_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
   n = scan(current_dir);
 
+  // Route the signals the event loop cares about through a signalfd
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGWINCH);
+  sigaddset(&mask, SIGCHLD);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  if (sigprocmask(SIG_BLOCK, &mask, &orig_sigmask) == 0) {
+    signals_blocked = 1;
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  }
+
   // ncurses initialization
   initscr();
   cbreak();
   noecho();
   keypad(stdscr, TRUE);
+  nodelay(stdscr, TRUE);
+  idlok(stdscr, TRUE); // Let scrl() use the terminal's scrolling
   curs_set(0);
 
   if (sel >= n)
@@ -1154,6 +2804,9 @@ int main(int argc, char **argv) {
     top = 0;
   }
 
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  watch_directory();
+
   // Initiate draw
   draw_menu();
 
@@ -1166,61 +2819,50 @@ int main(int argc, char **argv) {
     return 0;
   }
 
-  int ch;
-  while (1) {
-    ch = getch();
-    if (ch == 'q' || ch == 'Q')
+  // Event loop: keyboard, signals, directory changes and background work
+  // are multiplexed on one poll() so that nothing blocks the UI
+  enum {
+    FD_STDIN,
+    FD_SIGNAL,
+    FD_INOTIFY,
+    FD_WORK,
+    FD_DAEMON,
+    FD_DAEMON_TIMER,
+    FD_COUNT
+  };
+  int running = 1;
+  event_loop_running = 1;
+  while (running) {
+    struct pollfd fds[FD_COUNT] = {
+        [FD_STDIN] = {.fd = STDIN_FILENO, .events = POLLIN},
+        [FD_SIGNAL] = {.fd = signal_fd, .events = POLLIN},
+        // Directory events wait while the stat workers own the table
+        [FD_INOTIFY] = {.fd = stats_busy ? -1 : inotify_fd, .events = POLLIN},
+        [FD_WORK] = {.fd = work_fd, .events = POLLIN},
+        [FD_DAEMON] = {.fd = daemon_req.fd, .events = POLLIN},
+        [FD_DAEMON_TIMER] = {.fd = daemon_req.timer_fd, .events = POLLIN}};
+    if (poll(fds, FD_COUNT, -1) < 0) {
+      if (errno == EINTR)
+        continue;
       break;
+    }
 
-    max_display = LINES - 3;
-
-    if (ch == KEY_DOWN || ch == 'j') {
-      if (sel + 1 < n) {
-        sel++;
-        if (sel >= top + max_display)
-          top++;
-        draw_menu();
-      }
-    } else if (ch == KEY_UP || ch == 'k') {
-      if (sel > 0) {
-        sel--;
-        if (sel < top)
-          top--;
-        draw_menu();
-      }
-    } else if (ch == '\n' || ch == KEY_RIGHT || ch == 'l') {
-      enter_directory();
-    } else if (ch == KEY_LEFT || ch == 'h') {
-      for (int i = 0; i < n; i++) {
-        if (list[i].type == FILE_PARENT) {
-          sel = i;
-          enter_directory();
-          break;
-        }
-      }
-    } else if (ch == 'v' && n > 0 && list[sel].type == FILE_IMAGE) {
-      show_preview();
-      draw_menu();
-    } else if (ch == 'r') {
-      set_random_wallpaper();
-    } else if (ch == 's') {
-      current_sort = (current_sort + 1) % 3;
-      apply_sort();
-      draw_menu();
-    } else if (ch == 'K') {
-      kill_wallpaper_processes();
-      mvprintw(LINES - 1, 0, "Wallpaper killed");
-      clrtoeol();
-      refresh();
-    } else if (ch == KEY_F(1)) {
-      change_config();
-      draw_menu();
-    } else if (ch == 'd') {
-      change_config();
-      draw_menu();
-    } else if (ch == 'm') {
-      set_wallpaper_dmenu();
+    if (fds[FD_SIGNAL].revents & POLLIN)
+      running = handle_signals();
+    if (fds[FD_WORK].revents & POLLIN)
+      finish_background_work();
+    if (fds[FD_DAEMON].revents)
+      handle_daemon_reply();
+    if (fds[FD_DAEMON_TIMER].revents & POLLIN)
+      handle_daemon_timer();
+    if ((fds[FD_INOTIFY].revents & POLLIN) && handle_directory_events())
       draw_menu();
+    if (fds[FD_STDIN].revents & POLLIN) {
+      int ch;
+      while (running && (ch = getch()) != ERR)
+        running = handle_key(ch);
+    } else if (fds[FD_STDIN].revents & (POLLHUP | POLLERR)) {
+      running = 0; // Terminal went away
     }
   }
 
@@ -0,0 +1,360 @@
+#define _GNU_SOURCE // mkostemp
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "mip.h"
+
+// Tiles are stored whole, edge tiles padded, level after level and row of
+// tiles after row of tiles, so a row of tiles is one contiguous write
+#define TILE_BYTES ((size_t)MIP_TILE_SIZE * MIP_TILE_SIZE * 4)
+#define TILE_STRIDE (MIP_TILE_SIZE * 4)
+
+struct MipTile {
+  int level, col, row;
+  unsigned char *pixels;
+  MipTile *newer, *older;
+};
+
+// Backing file
+static int create_backing_file(void) {
+  // Tiles can be large, so prefer a disk over tmpfs
+  const char *dir = getenv("TMPDIR");
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/layer-mip-XXXXXX", dir ? dir : "/var/tmp");
+  int fd = mkostemp(path, O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  unlink(path);
+  return fd;
+}
+
+static int write_all(int fd, const unsigned char *data, size_t size,
+                     long long offset) {
+  while (size > 0) {
+    ssize_t n = pwrite(fd, data, size, offset);
+    if (n <= 0)
+      return -1;
+    data += n;
+    size -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+static int read_all(int fd, unsigned char *data, size_t size,
+                    long long offset) {
+  while (size > 0) {
+    ssize_t n = pread(fd, data, size, offset);
+    if (n <= 0)
+      return -1;
+    data += n;
+    size -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+// Building
+// Rows arrive top to bottom. Each level collects a row of tiles (a band)
+// and writes it out once full, and every pair of rows is averaged into a
+// row of the next level.
+typedef struct {
+  MipPyramid *mip;
+  unsigned char *band[MIP_MAX_LEVELS];    // cols tiles, laid out as on disk
+  unsigned char *pending[MIP_MAX_LEVELS]; // Even row waiting for its pair
+  unsigned char *halved[MIP_MAX_LEVELS];  // Scratch row for the next level
+  int y[MIP_MAX_LEVELS];                  // Rows received per level
+} MipBuilder;
+
+// Place the levels one after another, returning their total size
+static long long layout_levels(MipPyramid *mip, int width, int height) {
+  long long offset = 0;
+  mip->width = width;
+  mip->height = height;
+  mip->count = 0;
+  while (mip->count < MIP_MAX_LEVELS) {
+    MipLevel *level = &mip->levels[mip->count++];
+    level->width = width;
+    level->height = height;
+    level->cols = (width + MIP_TILE_SIZE - 1) / MIP_TILE_SIZE;
+    level->rows = (height + MIP_TILE_SIZE - 1) / MIP_TILE_SIZE;
+    level->offset = offset;
+    offset += (long long)level->cols * level->rows * TILE_BYTES;
+
+    if (width <= MIP_MIN_SIZE && height <= MIP_MIN_SIZE)
+      break;
+    width = (width + 1) / 2;
+    height = (height + 1) / 2;
+  }
+  return offset;
+}
+
+// Average two rows and neighbouring pixel pairs into a row half as wide.
+// An odd last pixel is averaged with itself.
+static void halve_rows(const unsigned char *row0, const unsigned char *row1,
+                       int width, unsigned char *out) {
+  int half = (width + 1) / 2;
+  for (int x = 0; x < half; x++) {
+    int x0 = 2 * x * 4;
+    int x1 = 2 * x + 1 < width ? x0 + 4 : x0;
+    for (int c = 0; c < 4; c++) {
+      out[x * 4 + c] =
+          (row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) >> 2;
+    }
+  }
+}
+
+static int add_row(MipBuilder *b, int l, const unsigned char *rgba) {
+  MipPyramid *mip = b->mip;
+  const MipLevel *level = &mip->levels[l];
+  int y = b->y[l]++;
+
+  // Into the band, a tile at a time
+  unsigned char *band = b->band[l] + (size_t)(y % MIP_TILE_SIZE) * TILE_STRIDE;
+  for (int col = 0; col < level->cols; col++) {
+    int x = col * MIP_TILE_SIZE;
+    int w = level->width - x < MIP_TILE_SIZE ? level->width - x : MIP_TILE_SIZE;
+    memcpy(band + col * TILE_BYTES, rgba + (size_t)x * 4, (size_t)w * 4);
+  }
+  if ((y + 1) % MIP_TILE_SIZE == 0 || y + 1 == level->height) {
+    long long offset = level->offset + (long long)(y / MIP_TILE_SIZE) *
+                                           level->cols * TILE_BYTES;
+    if (mip->pixels)
+      memcpy(mip->pixels + offset, b->band[l], level->cols * TILE_BYTES);
+    else if (write_all(mip->fd, b->band[l], level->cols * TILE_BYTES,
+                       offset) < 0)
+      return -1;
+  }
+
+  if (l + 1 == mip->count)
+    return 0;
+  if (y % 2 == 0) {
+    // Pair it with the next row, or with itself if this is the last one
+    memcpy(b->pending[l], rgba, (size_t)level->width * 4);
+    if (y + 1 < level->height)
+      return 0;
+    rgba = b->pending[l];
+  }
+  halve_rows(b->pending[l], rgba, level->width, b->halved[l]);
+  return add_row(b, l + 1, b->halved[l]);
+}
+
+static int build_row(void *data, const unsigned char *rgba, int y, int width,
+                     int height) {
+  (void)y;
+  MipBuilder *b = data;
+  MipPyramid *mip = b->mip;
+  if (mip->count == 0) {
+    // First row: now the size is known, and whether it all fits in memory
+    long long size = layout_levels(mip, width, height);
+    if (size <= (long long)mip->budget) {
+      mip->pixels = malloc(size);
+      if (!mip->pixels)
+        return -1;
+    } else {
+      mip->fd = create_backing_file();
+      if (mip->fd < 0) {
+        fprintf(stderr, "Failed to create tile file\n");
+        return -1;
+      }
+      // A scaled row crosses a whole row of tiles, and the filter reaches
+      // into the next one: keep both resident or every row rereads them
+      size_t rows_budget = (size_t)mip->levels[0].cols * 2 * TILE_BYTES;
+      if (mip->budget < rows_budget)
+        mip->budget = rows_budget;
+    }
+    for (int l = 0; l < mip->count; l++) {
+      const MipLevel *level = &mip->levels[l];
+      b->band[l] = calloc(level->cols, TILE_BYTES);
+      b->pending[l] = malloc((size_t)level->width * 4);
+      b->halved[l] = malloc((size_t)level->width * 4);
+      if (!b->band[l] || !b->pending[l] || !b->halved[l])
+        return -1;
+    }
+  }
+  return add_row(b, 0, rgba);
+}
+
+int mip_open(MipPyramid *mip, const char *path, size_t budget) {
+  memset(mip, 0, sizeof(*mip));
+  mip->budget = budget;
+  mip->fd = -1;
+
+  MipBuilder builder = {.mip = mip};
+  int ret = image_load_rows(path, build_row, &builder);
+  for (int l = 0; l < MIP_MAX_LEVELS; l++) {
+    free(builder.band[l]);
+    free(builder.pending[l]);
+    free(builder.halved[l]);
+  }
+  if (ret < 0 || mip->count == 0 ||
+      builder.y[0] != mip->levels[0].height) {
+    mip_free(mip);
+    return -1;
+  }
+
+  for (int l = 0; l < mip->count && !mip->pixels; l++) {
+    MipLevel *level = &mip->levels[l];
+    level->tiles = calloc((size_t)level->cols * level->rows, sizeof(MipTile *));
+    if (!level->tiles) {
+      mip_free(mip);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Tile cache
+static void unlink_tile(MipPyramid *mip, MipTile *tile) {
+  if (tile->newer)
+    tile->newer->older = tile->older;
+  else
+    mip->recent = tile->older;
+  if (tile->older)
+    tile->older->newer = tile->newer;
+  else
+    mip->oldest = tile->newer;
+}
+
+static void push_recent(MipPyramid *mip, MipTile *tile) {
+  tile->newer = NULL;
+  tile->older = mip->recent;
+  if (mip->recent)
+    mip->recent->newer = tile;
+  else
+    mip->oldest = tile;
+  mip->recent = tile;
+}
+
+static void evict_tile(MipPyramid *mip, MipTile *tile) {
+  unlink_tile(mip, tile);
+  MipLevel *level = &mip->levels[tile->level];
+  level->tiles[tile->row * level->cols + tile->col] = NULL;
+  mip->resident -= TILE_BYTES;
+  free(tile->pixels);
+  free(tile);
+}
+
+// The tile at (col, row) of level l, read back in if needed, evicting the
+// least recently used tiles beyond the budget. The one tile always fits.
+static MipTile *get_tile(MipPyramid *mip, int l, int col, int row) {
+  MipLevel *level = &mip->levels[l];
+  MipTile **slot = &level->tiles[row * level->cols + col];
+  if (*slot) {
+    if (*slot != mip->recent) {
+      unlink_tile(mip, *slot);
+      push_recent(mip, *slot);
+    }
+    return *slot;
+  }
+
+  while (mip->oldest && mip->resident + TILE_BYTES > mip->budget)
+    evict_tile(mip, mip->oldest);
+
+  MipTile *tile = malloc(sizeof(*tile));
+  unsigned char *pixels = malloc(TILE_BYTES);
+  long long offset =
+      level->offset + ((long long)row * level->cols + col) * TILE_BYTES;
+  if (!tile || !pixels || read_all(mip->fd, pixels, TILE_BYTES, offset) < 0) {
+    free(tile);
+    free(pixels);
+    return NULL;
+  }
+  tile->level = l;
+  tile->col = col;
+  tile->row = row;
+  tile->pixels = pixels;
+  push_recent(mip, tile);
+  *slot = tile;
+  mip->resident += TILE_BYTES;
+  return tile;
+}
+
+void mip_free(MipPyramid *mip) {
+  while (mip->oldest)
+    evict_tile(mip, mip->oldest);
+  for (int l = 0; l < mip->count; l++)
+    free(mip->levels[l].tiles);
+  free(mip->pixels);
+  if (mip->fd >= 0)
+    close(mip->fd);
+  memset(mip, 0, sizeof(*mip));
+  mip->fd = -1;
+}
+
+// Scaling
+// Source rows for the scaler, gathered from the tiles they cross
+typedef struct {
+  MipPyramid *mip;
+  int level;
+  int x, y, width;
+  unsigned char *row;
+} MipRows;
+
+static const unsigned char *mip_row(void *data, int y) {
+  MipRows *rows = data;
+  y += rows->y;
+  int row = y / MIP_TILE_SIZE;
+  size_t offset = (size_t)(y % MIP_TILE_SIZE) * TILE_STRIDE;
+
+  int x = rows->x;
+  int end = rows->x + rows->width;
+  while (x < end) {
+    int col = x / MIP_TILE_SIZE;
+    int tile_x = x % MIP_TILE_SIZE;
+    int n = MIP_TILE_SIZE - tile_x;
+    if (n > end - x)
+      n = end - x;
+    const unsigned char *pixels;
+    if (rows->mip->pixels) {
+      const MipLevel *level = &rows->mip->levels[rows->level];
+      pixels = rows->mip->pixels + level->offset +
+               ((size_t)row * level->cols + col) * TILE_BYTES;
+    } else {
+      MipTile *tile = get_tile(rows->mip, rows->level, col, row);
+      if (!tile)
+        return NULL;
+      pixels = tile->pixels;
+    }
+    memcpy(rows->row + (size_t)(x - rows->x) * 4,
+           pixels + offset + (size_t)tile_x * 4, (size_t)n * 4);
+    x += n;
+  }
+  return rows->row;
+}
+
+int mip_scale(MipPyramid *mip, int src_x, int src_y, int src_w, int src_h,
+              void *dst, int width, int height, int stride, ScaleFilter filter,
+              const ScaleFormat *format) {
+  int l = 0;
+  while (l + 1 < mip->count && (src_w >> (l + 1)) >= width &&
+         (src_h >> (l + 1)) >= height)
+    l++;
+
+  // The rectangle on that level, rounded outwards
+  const MipLevel *level = &mip->levels[l];
+  int round = (1 << l) - 1;
+  int x0 = src_x >> l;
+  int y0 = src_y >> l;
+  int x1 = (src_x + src_w + round) >> l;
+  int y1 = (src_y + src_h + round) >> l;
+  if (x1 > level->width)
+    x1 = level->width;
+  if (y1 > level->height)
+    y1 = level->height;
+  if (x1 <= x0 || y1 <= y0)
+    return 0;
+
+  MipRows rows = {mip, l, x0, y0, x1 - x0, malloc((size_t)(x1 - x0) * 4)};
+  if (!rows.row)
+    return -1;
+  int ret = scale_rows(mip_row, &rows, x1 - x0, y1 - y0, dst, width, height,
+                       stride, filter, format);
+  free(rows.row);
+  return ret;
+}
@@ -0,0 +1,52 @@
+#ifndef LAYER_MIP_H
+#define LAYER_MIP_H
+
+#include <stddef.h>
+
+#include "scale.h"
+
+#define MIP_MAX_LEVELS 16
+#define MIP_MIN_SIZE 256  // Stop halving once both sides are this small
+#define MIP_TILE_SIZE 256 // Tiles are MIP_TILE_SIZE pixels square
+#define MIP_DEFAULT_BUDGET ((size_t)64 << 20)
+#define MIP_MIN_BUDGET ((size_t)8 << 20) // Smallest budget worth asking for
+
+typedef struct MipTile MipTile;
+
+typedef struct {
+  int width, height;
+  int cols, rows;   // In tiles
+  long long offset; // Of the level's first tile in the tile store
+  MipTile **tiles;  // cols * rows, NULL where not resident (file only)
+} MipLevel;
+
+// An image and successively halved copies of it, split into tiles, so any
+// view of it can be scaled from a level no more than twice the output size.
+// A pyramid of no more than budget bytes is kept in memory whole. A larger
+// one lives in an unlinked backing file, and only recently used tiles are
+// kept in memory, up to budget bytes, but never fewer than two rows of
+// tiles of the full size level, so scaling a row never rereads tiles.
+typedef struct {
+  int width, height; // Of the full image
+  MipLevel levels[MIP_MAX_LEVELS];
+  int count;
+  unsigned char *pixels; // Every tile, when it fits in budget
+  int fd;                // Backing file otherwise, -1 if none
+  size_t budget, resident;
+  MipTile *recent, *oldest; // Resident tiles, most recently used first
+} MipPyramid;
+
+// Decode the image at path into a pyramid, streaming it through a few rows
+// of tiles at a time. Returns 0 on success, -1 on failure.
+int mip_open(MipPyramid *mip, const char *path, size_t budget);
+
+void mip_free(MipPyramid *mip);
+
+// Like scale_image(), with the src_w x src_h rectangle at (src_x, src_y)
+// given in full image pixels, scaling from the smallest level that still
+// covers width x height
+int mip_scale(MipPyramid *mip, int src_x, int src_y, int src_w, int src_h,
+              void *dst, int width, int height, int stride, ScaleFilter filter,
+              const ScaleFormat *format);
+
+#endif
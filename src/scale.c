@@ -0,0 +1,734 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "scale.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCALE_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) && !defined(__ARM_BIG_ENDIAN)
+#define SCALE_NEON
+#include <arm_neon.h>
+#endif
+
+// Images are resampled in two separable passes: every source row the output
+// needs is scaled horizontally into a small ring of rows, and each output
+// row is then a weighted sum of the ring rows, shuffled into the
+// destination's byte order on the way out. Weights are fixed point with
+// SCALE_BITS fractional bits, so one output pixel's weights sum to
+// 1 << SCALE_BITS.
+#define SCALE_BITS 14
+#define SCALE_ROUND (1 << (SCALE_BITS - 1))
+
+#define SCALE_PI 3.14159265358979323846
+
+// Output byte shuffle for four pixels at a time
+typedef struct {
+  unsigned char order[4];    // ScaleFormat order
+  unsigned char shuffle[16]; // Source byte of each output byte, 0x80 for none
+  unsigned char opaque[16];  // 0xff where an output byte is always 0xff
+} Swizzle;
+
+// Coefficient table for one axis
+typedef struct {
+  int taps;      // Weights per output pixel, the same for all of them
+  int *start;    // First source index of every output pixel
+  int16_t *coef; // taps weights per output pixel
+} Kernel;
+
+// Horizontal pass: width RGBA pixels from the source row src into dst
+typedef void (*HorizontalFn)(const unsigned char *src, unsigned char *dst,
+                             const Kernel *kernel, int width);
+// Vertical pass: width pixels from taps ring rows into dst
+typedef void (*VerticalFn)(const unsigned char *const *rows,
+                           const int16_t *coef, int taps, unsigned char *dst,
+                           int width, const Swizzle *swizzle);
+
+typedef struct {
+  const char *name;
+  int (*supported)();
+  HorizontalFn horizontal;
+  VerticalFn vertical;
+} ScaleImpl;
+
+static const char *filter_names[] = {"nearest", "box", "bilinear", "lanczos"};
+
+const ScaleFormat scale_argb8888 = {
+    {SCALE_BLUE, SCALE_GREEN, SCALE_RED, SCALE_ALPHA}};
+const ScaleFormat scale_xrgb8888 = {
+    {SCALE_BLUE, SCALE_GREEN, SCALE_RED, SCALE_OPAQUE}};
+const ScaleFormat scale_rgba8888 = {
+    {SCALE_RED, SCALE_GREEN, SCALE_BLUE, SCALE_ALPHA}};
+
+int scale_filter_parse(const char *name, ScaleFilter *filter) {
+  for (int i = 0; i < (int)(sizeof(filter_names) / sizeof(*filter_names));
+       i++) {
+    if (strcmp(name, filter_names[i]) == 0) {
+      *filter = (ScaleFilter)i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+const char *scale_filter_name(ScaleFilter filter) {
+  return filter_names[filter];
+}
+
+int scale_format_from_masks(unsigned long red_mask, unsigned long green_mask,
+                            unsigned long blue_mask, int lsb_first,
+                            ScaleFormat *format) {
+  const unsigned long masks[3] = {red_mask, green_mask, blue_mask};
+  // X visuals have no alpha; the byte no channel claims is padding
+  memset(format->order, SCALE_OPAQUE, sizeof(format->order));
+  for (int c = 0; c < 3; c++) {
+    int byte = 0;
+    while (byte < 4 && masks[c] != 0xffUL << (byte * 8))
+      byte++;
+    if (byte == 4)
+      return -1;
+    format->order[lsb_first ? byte : 3 - byte] = (unsigned char)c;
+  }
+  return 0;
+}
+
+static void build_swizzle(Swizzle *swizzle, const ScaleFormat *format) {
+  memcpy(swizzle->order, format->order, sizeof(swizzle->order));
+  for (int i = 0; i < 16; i++) {
+    int channel = format->order[i % 4];
+    int opaque = channel == SCALE_OPAQUE;
+    swizzle->shuffle[i] = opaque ? 0x80 : (unsigned char)(i / 4 * 4 + channel);
+    swizzle->opaque[i] = opaque ? 0xff : 0;
+  }
+}
+
+// Filters
+static double filter_support(ScaleFilter filter) {
+  switch (filter) {
+  case SCALE_BILINEAR:
+    return 1.0;
+  case SCALE_LANCZOS:
+    return 3.0;
+  default:
+    return 0.5;
+  }
+}
+
+static double sinc(double x) {
+  if (x == 0.0)
+    return 1.0;
+  x *= SCALE_PI;
+  return sin(x) / x;
+}
+
+static double filter_weight(ScaleFilter filter, double x) {
+  switch (filter) {
+  case SCALE_BILINEAR:
+    x = fabs(x);
+    return x < 1.0 ? 1.0 - x : 0.0;
+  case SCALE_LANCZOS:
+    return x > -3.0 && x < 3.0 ? sinc(x) * sinc(x / 3.0) : 0.0;
+  default:
+    return x > -0.5 && x <= 0.5 ? 1.0 : 0.0;
+  }
+}
+
+static void free_kernel(Kernel *kernel) {
+  free(kernel->start);
+  free(kernel->coef);
+}
+
+// Build the weights that map src_len pixels starting at src_off onto
+// dst_len pixels. Windows near the edges are shifted inwards rather than
+// clipped, so every output pixel reads exactly taps in-range pixels.
+static int build_kernel(Kernel *kernel, ScaleFilter filter, int src_off,
+                        int src_len, int dst_len) {
+  double scale = (double)src_len / dst_len;
+  double filter_scale = scale > 1.0 ? scale : 1.0; // Widen when shrinking
+  double support = filter_support(filter) * filter_scale;
+  int taps = filter == SCALE_NEAREST ? 1 : (int)ceil(support) * 2 + 1;
+  if (taps > src_len)
+    taps = src_len;
+
+  kernel->taps = taps;
+  kernel->start = malloc(dst_len * sizeof(*kernel->start));
+  kernel->coef = calloc((size_t)dst_len * taps, sizeof(*kernel->coef));
+  double *weights = malloc(taps * sizeof(*weights));
+  if (!kernel->start || !kernel->coef || !weights) {
+    free_kernel(kernel);
+    free(weights);
+    return -1;
+  }
+
+  for (int i = 0; i < dst_len; i++) {
+    double center = (i + 0.5) * scale;
+    int16_t *coef = kernel->coef + (size_t)i * taps;
+
+    int lo = (int)(center - support + 0.5);
+    int hi = (int)(center + support + 0.5);
+    if (lo < 0)
+      lo = 0;
+    if (hi > src_len)
+      hi = src_len;
+    if (hi - lo > taps)
+      hi = lo + taps;
+
+    double sum = 0.0;
+    if (filter != SCALE_NEAREST) {
+      for (int x = lo; x < hi; x++) {
+        weights[x - lo] =
+            filter_weight(filter, (x - center + 0.5) / filter_scale);
+        sum += weights[x - lo];
+      }
+    }
+    if (sum <= 0.0) {
+      // Nearest neighbour, or nothing in reach of the filter
+      lo = (int)center < src_len ? (int)center : src_len - 1;
+      hi = lo + 1;
+      weights[0] = sum = 1.0;
+    }
+
+    int start = lo < src_len - taps ? lo : src_len - taps;
+    kernel->start[i] = src_off + start;
+
+    // Quantize, and give the rounding error to the heaviest weight so flat
+    // areas come out unchanged
+    int total = 0, peak = lo - start;
+    for (int x = lo; x < hi; x++) {
+      int c = (int)lround(weights[x - lo] / sum * (1 << SCALE_BITS));
+      coef[x - start] = (int16_t)c;
+      total += c;
+      if (c > coef[peak])
+        peak = x - start;
+    }
+    coef[peak] += (1 << SCALE_BITS) - total;
+  }
+
+  free(weights);
+  return 0;
+}
+
+// Portable C
+static inline unsigned char clamp8(int v) {
+  v >>= SCALE_BITS;
+  return v < 0 ? 0 : v > 255 ? 255 : (unsigned char)v;
+}
+
+static void horizontal_c(const unsigned char *src, unsigned char *dst,
+                         const Kernel *kernel, int width) {
+  for (int x = 0; x < width; x++) {
+    const unsigned char *p = src + (size_t)kernel->start[x] * 4;
+    const int16_t *coef = kernel->coef + (size_t)x * kernel->taps;
+    int r = SCALE_ROUND, g = SCALE_ROUND, b = SCALE_ROUND, a = SCALE_ROUND;
+    for (int j = 0; j < kernel->taps; j++, p += 4) {
+      r += p[0] * coef[j];
+      g += p[1] * coef[j];
+      b += p[2] * coef[j];
+      a += p[3] * coef[j];
+    }
+    dst[x * 4 + 0] = clamp8(r);
+    dst[x * 4 + 1] = clamp8(g);
+    dst[x * 4 + 2] = clamp8(b);
+    dst[x * 4 + 3] = clamp8(a);
+  }
+}
+
+// Pixels from..width of a vertical pass; the SIMD versions finish with this
+static void vertical_tail(const unsigned char *const *rows,
+                          const int16_t *coef, int taps, unsigned char *dst,
+                          int from, int width, const Swizzle *swizzle) {
+  for (int x = from; x < width; x++) {
+    int sum[4] = {SCALE_ROUND, SCALE_ROUND, SCALE_ROUND, SCALE_ROUND};
+    for (int j = 0; j < taps; j++) {
+      const unsigned char *p = rows[j] + x * 4;
+      sum[0] += p[0] * coef[j];
+      sum[1] += p[1] * coef[j];
+      sum[2] += p[2] * coef[j];
+      sum[3] += p[3] * coef[j];
+    }
+    for (int i = 0; i < 4; i++) {
+      int channel = swizzle->order[i];
+      dst[x * 4 + i] = channel == SCALE_OPAQUE ? 0xff : clamp8(sum[channel]);
+    }
+  }
+}
+
+static void vertical_c(const unsigned char *const *rows, const int16_t *coef,
+                       int taps, unsigned char *dst, int width,
+                       const Swizzle *swizzle) {
+  vertical_tail(rows, coef, taps, dst, 0, width, swizzle);
+}
+
+static int supported_c() { return 1; }
+
+#ifdef SCALE_X86
+// x86: SSSE3 and AVX2, picked at runtime. Two weights are packed into each
+// 32-bit lane so pmaddwd applies a pair of taps at once, and pshufb puts
+// the channels in destination order.
+static inline int coef_pair(int16_t c0, int16_t c1) {
+  return (int)((uint32_t)(uint16_t)c0 | (uint32_t)(uint16_t)c1 << 16);
+}
+
+__attribute__((target("ssse3"))) static void
+horizontal_ssse3(const unsigned char *src, unsigned char *dst,
+                 const Kernel *kernel, int width) {
+  const __m128i zero = _mm_setzero_si128();
+  int taps = kernel->taps;
+  for (int x = 0; x < width; x++) {
+    const unsigned char *p = src + (size_t)kernel->start[x] * 4;
+    const int16_t *coef = kernel->coef + (size_t)x * taps;
+    __m128i sum = _mm_set1_epi32(SCALE_ROUND);
+    int j = 0;
+    for (; j + 1 < taps; j += 2) {
+      // r0 g0 b0 a0 r1 g1 b1 a1 -> r0 r1 g0 g1 b0 b1 a0 a1
+      __m128i pix = _mm_unpacklo_epi8(
+          _mm_loadl_epi64((const __m128i *)(p + j * 4)), zero);
+      pix = _mm_unpacklo_epi16(pix, _mm_srli_si128(pix, 8));
+      sum = _mm_add_epi32(
+          sum, _mm_madd_epi16(pix, _mm_set1_epi32(coef_pair(coef[j],
+                                                            coef[j + 1]))));
+    }
+    if (j < taps) {
+      int last;
+      memcpy(&last, p + j * 4, 4);
+      __m128i pix = _mm_unpacklo_epi8(_mm_cvtsi32_si128(last), zero);
+      pix = _mm_unpacklo_epi16(pix, zero);
+      sum = _mm_add_epi32(sum, _mm_madd_epi16(pix, _mm_set1_epi32(
+                                                       coef_pair(coef[j], 0))));
+    }
+    sum = _mm_srai_epi32(sum, SCALE_BITS);
+    sum = _mm_packs_epi32(sum, sum);
+    int out = _mm_cvtsi128_si32(_mm_packus_epi16(sum, sum));
+    memcpy(dst + x * 4, &out, 4);
+  }
+}
+
+
+__attribute__((target("ssse3"))) static void
+vertical_ssse3(const unsigned char *const *rows, const int16_t *coef, int taps,
+               unsigned char *dst, int width, const Swizzle *swizzle) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i shuffle = _mm_loadu_si128((const __m128i *)swizzle->shuffle);
+  const __m128i opaque = _mm_loadu_si128((const __m128i *)swizzle->opaque);
+  int x = 0;
+  for (; x + 4 <= width; x += 4) {
+    __m128i s0 = _mm_set1_epi32(SCALE_ROUND), s1 = s0, s2 = s0, s3 = s0;
+    for (int j = 0; j < taps; j += 2) {
+      __m128i a = _mm_loadu_si128((const __m128i *)(rows[j] + x * 4));
+      __m128i b = zero;
+      __m128i c = _mm_set1_epi32(coef_pair(coef[j], 0));
+      if (j + 1 < taps) {
+        b = _mm_loadu_si128((const __m128i *)(rows[j + 1] + x * 4));
+        c = _mm_set1_epi32(coef_pair(coef[j], coef[j + 1]));
+      }
+      // Interleave the two rows so each 32-bit lane holds one channel of
+      // both, then widen to 16 bits
+      __m128i lo = _mm_unpacklo_epi8(a, b);
+      __m128i hi = _mm_unpackhi_epi8(a, b);
+      s0 = _mm_add_epi32(s0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), c));
+      s1 = _mm_add_epi32(s1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), c));
+      s2 = _mm_add_epi32(s2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), c));
+      s3 = _mm_add_epi32(s3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), c));
+    }
+    __m128i p01 = _mm_packs_epi32(_mm_srai_epi32(s0, SCALE_BITS),
+                                  _mm_srai_epi32(s1, SCALE_BITS));
+    __m128i p23 = _mm_packs_epi32(_mm_srai_epi32(s2, SCALE_BITS),
+                                  _mm_srai_epi32(s3, SCALE_BITS));
+    __m128i out = _mm_shuffle_epi8(_mm_packus_epi16(p01, p23), shuffle);
+    _mm_storeu_si128((__m128i *)(dst + x * 4), _mm_or_si128(out, opaque));
+  }
+  vertical_tail(rows, coef, taps, dst, x, width, swizzle);
+}
+
+__attribute__((target("avx2"))) static void
+horizontal_avx2(const unsigned char *src, unsigned char *dst,
+                const Kernel *kernel, int width) {
+  const __m128i zero = _mm_setzero_si128();
+  // Per 128-bit lane: pixels a, b as 16-bit rgba -> ra rb ga gb ba bb aa ab
+  const __m256i interleave = _mm256_setr_epi8(
+      0, 1, 8, 9, 2, 3, 10, 11, 4, 5, 12, 13, 6, 7, 14, 15, 0, 1, 8, 9, 2, 3,
+      10, 11, 4, 5, 12, 13, 6, 7, 14, 15);
+  int taps = kernel->taps;
+  for (int x = 0; x < width; x++) {
+    const unsigned char *p = src + (size_t)kernel->start[x] * 4;
+    const int16_t *coef = kernel->coef + (size_t)x * taps;
+    __m256i sum4 = _mm256_setzero_si256();
+    int j = 0;
+    for (; j + 3 < taps; j += 4) {
+      // Taps j, j+1 in the low lane and j+2, j+3 in the high lane
+      __m256i pix = _mm256_cvtepu8_epi16(
+          _mm_loadu_si128((const __m128i *)(p + j * 4)));
+      pix = _mm256_shuffle_epi8(pix, interleave);
+      int c01 = coef_pair(coef[j], coef[j + 1]);
+      int c23 = coef_pair(coef[j + 2], coef[j + 3]);
+      sum4 = _mm256_add_epi32(
+          sum4, _mm256_madd_epi16(pix, _mm256_setr_epi32(c01, c01, c01, c01,
+                                                         c23, c23, c23, c23)));
+    }
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(sum4),
+                                _mm256_extracti128_si256(sum4, 1));
+    sum = _mm_add_epi32(sum, _mm_set1_epi32(SCALE_ROUND));
+    for (; j + 1 < taps; j += 2) {
+      __m128i pix = _mm_unpacklo_epi8(
+          _mm_loadl_epi64((const __m128i *)(p + j * 4)), zero);
+      pix = _mm_unpacklo_epi16(pix, _mm_srli_si128(pix, 8));
+      sum = _mm_add_epi32(
+          sum, _mm_madd_epi16(pix, _mm_set1_epi32(coef_pair(coef[j],
+                                                            coef[j + 1]))));
+    }
+    if (j < taps) {
+      int last;
+      memcpy(&last, p + j * 4, 4);
+      __m128i pix = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(last));
+      sum = _mm_add_epi32(sum, _mm_madd_epi16(pix, _mm_set1_epi32(
+                                                       coef_pair(coef[j], 0))));
+    }
+    sum = _mm_srai_epi32(sum, SCALE_BITS);
+    sum = _mm_packs_epi32(sum, sum);
+    int out = _mm_cvtsi128_si32(_mm_packus_epi16(sum, sum));
+    memcpy(dst + x * 4, &out, 4);
+  }
+}
+
+__attribute__((target("avx2"))) static void
+vertical_avx2(const unsigned char *const *rows, const int16_t *coef, int taps,
+              unsigned char *dst, int width, const Swizzle *swizzle) {
+  const __m256i zero = _mm256_setzero_si256();
+  // Both lanes hold four pixels, so they take the same shuffle
+  const __m256i shuffle = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128((const __m128i *)swizzle->shuffle));
+  const __m256i opaque = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128((const __m128i *)swizzle->opaque));
+  int x = 0;
+  // Everything stays within 128-bit lanes, so the unpacks and packs below
+  // undo each other and the pixels come out in order
+  for (; x + 8 <= width; x += 8) {
+    __m256i s0 = _mm256_set1_epi32(SCALE_ROUND), s1 = s0, s2 = s0, s3 = s0;
+    for (int j = 0; j < taps; j += 2) {
+      __m256i a = _mm256_loadu_si256((const __m256i *)(rows[j] + x * 4));
+      __m256i b = zero;
+      __m256i c = _mm256_set1_epi32(coef_pair(coef[j], 0));
+      if (j + 1 < taps) {
+        b = _mm256_loadu_si256((const __m256i *)(rows[j + 1] + x * 4));
+        c = _mm256_set1_epi32(coef_pair(coef[j], coef[j + 1]));
+      }
+      __m256i lo = _mm256_unpacklo_epi8(a, b);
+      __m256i hi = _mm256_unpackhi_epi8(a, b);
+      s0 = _mm256_add_epi32(s0,
+                            _mm256_madd_epi16(_mm256_unpacklo_epi8(lo, zero), c));
+      s1 = _mm256_add_epi32(s1,
+                            _mm256_madd_epi16(_mm256_unpackhi_epi8(lo, zero), c));
+      s2 = _mm256_add_epi32(s2,
+                            _mm256_madd_epi16(_mm256_unpacklo_epi8(hi, zero), c));
+      s3 = _mm256_add_epi32(s3,
+                            _mm256_madd_epi16(_mm256_unpackhi_epi8(hi, zero), c));
+    }
+    __m256i p01 = _mm256_packs_epi32(_mm256_srai_epi32(s0, SCALE_BITS),
+                                     _mm256_srai_epi32(s1, SCALE_BITS));
+    __m256i p23 = _mm256_packs_epi32(_mm256_srai_epi32(s2, SCALE_BITS),
+                                     _mm256_srai_epi32(s3, SCALE_BITS));
+    __m256i out = _mm256_shuffle_epi8(_mm256_packus_epi16(p01, p23), shuffle);
+    _mm256_storeu_si256((__m256i *)(dst + x * 4), _mm256_or_si256(out, opaque));
+  }
+  vertical_tail(rows, coef, taps, dst, x, width, swizzle);
+}
+
+static int supported_ssse3() { return __builtin_cpu_supports("ssse3"); }
+static int supported_avx2() { return __builtin_cpu_supports("avx2"); }
+#endif
+
+#ifdef SCALE_NEON
+// AArch64: NEON is always there
+static void horizontal_neon(const unsigned char *src, unsigned char *dst,
+                            const Kernel *kernel, int width) {
+  int taps = kernel->taps;
+  for (int x = 0; x < width; x++) {
+    const unsigned char *p = src + (size_t)kernel->start[x] * 4;
+    const int16_t *coef = kernel->coef + (size_t)x * taps;
+    int32x4_t sum = vdupq_n_s32(SCALE_ROUND);
+    int j = 0;
+    for (; j + 1 < taps; j += 2) {
+      int16x8_t pix = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(p + j * 4)));
+      sum = vmlal_n_s16(sum, vget_low_s16(pix), coef[j]);
+      sum = vmlal_n_s16(sum, vget_high_s16(pix), coef[j + 1]);
+    }
+    if (j < taps) {
+      uint32_t last;
+      memcpy(&last, p + j * 4, 4);
+      int16x8_t pix = vreinterpretq_s16_u16(
+          vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(last))));
+      sum = vmlal_n_s16(sum, vget_low_s16(pix), coef[j]);
+    }
+    uint16x4_t narrow = vqmovun_s32(vshrq_n_s32(sum, SCALE_BITS));
+    uint8x8_t out = vqmovn_u16(vcombine_u16(narrow, narrow));
+    uint32_t word = vget_lane_u32(vreinterpret_u32_u8(out), 0);
+    memcpy(dst + x * 4, &word, 4);
+  }
+}
+
+static void vertical_neon(const unsigned char *const *rows,
+                          const int16_t *coef, int taps, unsigned char *dst,
+                          int width, const Swizzle *swizzle) {
+  // tbl gives 0 for the out of range 0x80 entries, like pshufb
+  const uint8x16_t shuffle = vld1q_u8(swizzle->shuffle);
+  const uint8x16_t opaque = vld1q_u8(swizzle->opaque);
+  int x = 0;
+  for (; x + 4 <= width; x += 4) {
+    int32x4_t s0 = vdupq_n_s32(SCALE_ROUND), s1 = s0, s2 = s0, s3 = s0;
+    for (int j = 0; j < taps; j++) {
+      uint8x16_t pix = vld1q_u8(rows[j] + x * 4);
+      int16x8_t lo = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(pix)));
+      int16x8_t hi = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(pix)));
+      s0 = vmlal_n_s16(s0, vget_low_s16(lo), coef[j]);
+      s1 = vmlal_n_s16(s1, vget_high_s16(lo), coef[j]);
+      s2 = vmlal_n_s16(s2, vget_low_s16(hi), coef[j]);
+      s3 = vmlal_n_s16(s3, vget_high_s16(hi), coef[j]);
+    }
+    uint16x8_t lo = vcombine_u16(vqmovun_s32(vshrq_n_s32(s0, SCALE_BITS)),
+                                 vqmovun_s32(vshrq_n_s32(s1, SCALE_BITS)));
+    uint16x8_t hi = vcombine_u16(vqmovun_s32(vshrq_n_s32(s2, SCALE_BITS)),
+                                 vqmovun_s32(vshrq_n_s32(s3, SCALE_BITS)));
+    uint8x16_t out = vcombine_u8(vqmovn_u16(lo), vqmovn_u16(hi));
+    vst1q_u8(dst + x * 4, vorrq_u8(vqtbl1q_u8(out, shuffle), opaque));
+  }
+  vertical_tail(rows, coef, taps, dst, x, width, swizzle);
+}
+
+static int supported_neon() { return 1; }
+#endif
+
+// Fastest first
+static const ScaleImpl impls[] = {
+#ifdef SCALE_X86
+    {"avx2", supported_avx2, horizontal_avx2, vertical_avx2},
+    {"ssse3", supported_ssse3, horizontal_ssse3, vertical_ssse3},
+#endif
+#ifdef SCALE_NEON
+    {"neon", supported_neon, horizontal_neon, vertical_neon},
+#endif
+    {"c", supported_c, horizontal_c, vertical_c},
+};
+
+#define NUM_IMPLS ((int)(sizeof(impls) / sizeof(*impls)))
+
+// Resolved once, as decode threads scale concurrently
+static const ScaleImpl *best = NULL;
+static pthread_once_t best_once = PTHREAD_ONCE_INIT;
+
+static void pick_best_impl() {
+  for (int i = 0; i < NUM_IMPLS && !best; i++)
+    if (impls[i].supported())
+      best = &impls[i];
+}
+
+static const ScaleImpl *best_impl() {
+  pthread_once(&best_once, pick_best_impl);
+  return best;
+}
+
+// Resampling
+static int scale_with(const ScaleImpl *impl, ScaleRowFn row, void *data,
+                      int src_w, int src_h, void *dst, int width, int height,
+                      int stride, ScaleFilter filter,
+                      const ScaleFormat *format) {
+  if (width <= 0 || height <= 0 || src_w <= 0 || src_h <= 0)
+    return 0;
+
+  Swizzle swizzle;
+  build_swizzle(&swizzle, format);
+
+  Kernel horizontal, vertical;
+  if (build_kernel(&horizontal, filter, 0, src_w, width) < 0)
+    return -1;
+  if (build_kernel(&vertical, filter, 0, src_h, height) < 0) {
+    free_kernel(&horizontal);
+    return -1;
+  }
+
+  // Source row r is kept, scaled horizontally, in ring slot r % taps
+  int taps = vertical.taps;
+  size_t row_bytes = (size_t)width * 4;
+  unsigned char *ring = malloc(row_bytes * taps);
+  const unsigned char **rows = malloc(taps * sizeof(*rows));
+  if (!ring || !rows) {
+    free(ring);
+    free(rows);
+    free_kernel(&horizontal);
+    free_kernel(&vertical);
+    return -1;
+  }
+
+  int next_row = 0;
+  for (int y = 0; y < height; y++) {
+    int first = vertical.start[y];
+    if (next_row < first)
+      next_row = first;
+    for (; next_row < first + taps; next_row++) {
+      const unsigned char *src = row(data, next_row);
+      if (!src) {
+        free(ring);
+        free(rows);
+        free_kernel(&horizontal);
+        free_kernel(&vertical);
+        return -1;
+      }
+      impl->horizontal(src, ring + (size_t)(next_row % taps) * row_bytes,
+                       &horizontal, width);
+    }
+
+    for (int j = 0; j < taps; j++)
+      rows[j] = ring + (size_t)((first + j) % taps) * row_bytes;
+    impl->vertical(rows, vertical.coef + (size_t)y * taps, taps,
+                   (unsigned char *)dst + (size_t)y * stride, width, &swizzle);
+  }
+
+  free(ring);
+  free(rows);
+  free_kernel(&horizontal);
+  free_kernel(&vertical);
+  return 0;
+}
+
+// A rectangle of an Image, as rows for scale_with()
+typedef struct {
+  const Image *image;
+  int x, y;
+} ImageRect;
+
+static const unsigned char *image_rect_row(void *data, int y) {
+  const ImageRect *rect = data;
+  const Image *image = rect->image;
+  return image->data + ((size_t)(rect->y + y) * image->width + rect->x) * 4;
+}
+
+int scale_image(const Image *image, int src_x, int src_y, int src_w, int src_h,
+                void *dst, int width, int height, int stride,
+                ScaleFilter filter, const ScaleFormat *format) {
+  if (!image->data)
+    return 0;
+  ImageRect rect = {image, src_x, src_y};
+  return scale_with(best_impl(), image_rect_row, &rect, src_w, src_h, dst,
+                    width, height, stride, filter, format);
+}
+
+int scale_rows(ScaleRowFn row, void *data, int src_w, int src_h, void *dst,
+               int width, int height, int stride, ScaleFilter filter,
+               const ScaleFormat *format) {
+  return scale_with(best_impl(), row, data, src_w, src_h, dst, width, height,
+                    stride, filter, format);
+}
+
+// Pick the source window of an image_w x image_h image with the aspect
+// ratio of width x height, centered
+static void cover_rect(int image_w, int image_h, int width, int height,
+                       int *src_x, int *src_y, int *src_w, int *src_h) {
+  *src_w = image_w;
+  *src_h = image_h;
+  *src_x = *src_y = 0;
+  if ((long long)image_w * height > (long long)image_h * width) {
+    *src_w = (int)((long long)image_h * width / height);
+    *src_x = (image_w - *src_w) / 2;
+  } else {
+    *src_h = (int)((long long)image_w * height / width);
+    *src_y = (image_h - *src_h) / 2;
+  }
+  if (*src_w < 1)
+    *src_w = 1;
+  if (*src_h < 1)
+    *src_h = 1;
+}
+
+int scale_image_cover(const Image *image, void *dst, int width, int height,
+                      int stride, ScaleFilter filter,
+                      const ScaleFormat *format) {
+  if (width <= 0 || height <= 0 || !image->data)
+    return 0;
+  int src_x, src_y, src_w, src_h;
+  cover_rect(image->width, image->height, width, height, &src_x, &src_y,
+             &src_w, &src_h);
+  return scale_image(image, src_x, src_y, src_w, src_h, dst, width, height,
+                     stride, filter, format);
+}
+
+// A rectangle of an ImageReader, as rows for scale_with()
+typedef struct {
+  ImageReader *reader;
+  int x, y;
+} ReaderRect;
+
+static const unsigned char *reader_rect_row(void *data, int y) {
+  const ReaderRect *rect = data;
+  const unsigned char *row = image_reader_row(rect->reader, rect->y + y);
+  return row ? row + (size_t)rect->x * 4 : NULL;
+}
+
+int scale_reader(ImageReader *reader, int src_x, int src_y, int src_w,
+                 int src_h, void *dst, int width, int height, int stride,
+                 ScaleFilter filter, const ScaleFormat *format) {
+  ReaderRect rect = {reader, src_x, src_y};
+  return scale_with(best_impl(), reader_rect_row, &rect, src_w, src_h, dst,
+                    width, height, stride, filter, format);
+}
+
+int scale_reader_cover(ImageReader *reader, void *dst, int width, int height,
+                       int stride, ScaleFilter filter,
+                       const ScaleFormat *format) {
+  if (width <= 0 || height <= 0)
+    return 0;
+  int src_x, src_y, src_w, src_h;
+  cover_rect(reader->width, reader->height, width, height, &src_x, &src_y,
+             &src_w, &src_h);
+  return scale_reader(reader, src_x, src_y, src_w, src_h, dst, width, height,
+                      stride, filter, format);
+}
+
+// Benchmark
+static double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void scale_benchmark(const Image *image, int width, int height) {
+  unsigned char *dst = malloc((size_t)width * height * 4);
+  if (!dst) {
+    fprintf(stderr, "Out of memory\n");
+    return;
+  }
+
+  printf("Scaling %dx%d to %dx%d, MPix/s of source pixels\n", image->width,
+         image->height, width, height);
+  printf("%-10s", "filter");
+  for (int i = 0; i < NUM_IMPLS; i++)
+    if (impls[i].supported())
+      printf("%10s", impls[i].name);
+  printf("\n");
+
+  double mpix = (double)image->width * image->height / 1e6;
+  ImageRect rect = {image, 0, 0};
+  for (int f = SCALE_NEAREST; f <= SCALE_LANCZOS; f++) {
+    printf("%-10s", filter_names[f]);
+    for (int i = 0; i < NUM_IMPLS; i++) {
+      if (!impls[i].supported())
+        continue;
+      // Repeat for at least half a second to smooth out the noise
+      int runs = 0;
+      double start = now_seconds(), elapsed;
+      do {
+        scale_with(&impls[i], image_rect_row, &rect, image->width,
+                   image->height, dst, width, height, width * 4, (ScaleFilter)f,
+                   &scale_argb8888);
+        runs++;
+        elapsed = now_seconds() - start;
+      } while (elapsed < 0.5);
+      printf("%10.1f", mpix * runs / elapsed);
+    }
+    printf("\n");
+    fflush(stdout);
+  }
+  free(dst);
+}
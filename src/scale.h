@@ -0,0 +1,81 @@
+#ifndef LAYER_SCALE_H
+#define LAYER_SCALE_H
+
+#include <stdint.h>
+
+#include "image.h"
+
+// Resampling filters, from fastest to sharpest
+typedef enum {
+  SCALE_NEAREST,
+  SCALE_BOX,      // Area averaging when shrinking
+  SCALE_BILINEAR, // Triangle filter, widened when shrinking
+  SCALE_LANCZOS,  // Lanczos3
+} ScaleFilter;
+
+#define SCALE_DEFAULT SCALE_BILINEAR
+
+// Source channels, as used in ScaleFormat
+enum { SCALE_RED, SCALE_GREEN, SCALE_BLUE, SCALE_ALPHA, SCALE_OPAQUE };
+
+// Memory layout of a 32-bit destination pixel: the channel each of its four
+// bytes takes, SCALE_OPAQUE for a constant 0xff
+typedef struct {
+  unsigned char order[4];
+} ScaleFormat;
+
+extern const ScaleFormat scale_argb8888; // WL_SHM_FORMAT_ARGB8888
+extern const ScaleFormat scale_xrgb8888; // WL_SHM_FORMAT_XRGB8888
+extern const ScaleFormat scale_rgba8888; // Same as Image
+
+// Layout of 32-bit pixels with the given channel masks, in LSBFirst or
+// MSBFirst byte order (as on an X visual), with the spare byte set to 0xff.
+// Returns -1 unless every channel is a whole byte.
+int scale_format_from_masks(unsigned long red_mask, unsigned long green_mask,
+                            unsigned long blue_mask, int lsb_first,
+                            ScaleFormat *format);
+
+// Look up a filter by name ("nearest", "box", "bilinear", "lanczos").
+// Returns 0 on success, -1 if the name is unknown.
+int scale_filter_parse(const char *name, ScaleFilter *filter);
+const char *scale_filter_name(ScaleFilter filter);
+
+// Resample the src_w x src_h rectangle at (src_x, src_y) of image to
+// width x height pixels in format at dst. stride is in bytes.
+// Returns 0 on success, -1 if out of memory.
+int scale_image(const Image *image, int src_x, int src_y, int src_w, int src_h,
+                void *dst, int width, int height, int stride,
+                ScaleFilter filter, const ScaleFormat *format);
+
+// Source of scale_rows(): a pointer to the src_w pixels (RGBA) of source
+// row y, valid until the next call, or NULL to abort
+typedef const unsigned char *(*ScaleRowFn)(void *data, int y);
+
+// Like scale_image(), for a src_w x src_h source that is read a row at a
+// time. Rows are requested in increasing order, each at most once.
+int scale_rows(ScaleRowFn row, void *data, int src_w, int src_h, void *dst,
+               int width, int height, int stride, ScaleFilter filter,
+               const ScaleFormat *format);
+
+// Scale image to cover a width x height area, cropping the overflow (like
+// swaybg -m fill)
+int scale_image_cover(const Image *image, void *dst, int width, int height,
+                      int stride, ScaleFilter filter,
+                      const ScaleFormat *format);
+
+// Like scale_image() and scale_image_cover(), pulling source rows from
+// reader as they are decoded. Only the rows the filter still needs are kept,
+// so the whole source is never in memory when reader streams it. Returns -1
+// on a decode error too.
+int scale_reader(ImageReader *reader, int src_x, int src_y, int src_w,
+                 int src_h, void *dst, int width, int height, int stride,
+                 ScaleFilter filter, const ScaleFormat *format);
+int scale_reader_cover(ImageReader *reader, void *dst, int width, int height,
+                       int stride, ScaleFilter filter,
+                       const ScaleFormat *format);
+
+// Print the throughput of every filter on every instruction set this CPU
+// supports, scaling image to width x height
+void scale_benchmark(const Image *image, int width, int height);
+
+#endif
@@ -0,0 +1,129 @@
+#define _GNU_SOURCE // memfd_create, mkostemp
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "shm-pool.h"
+
+int shm_create_file(size_t size) {
+  int fd = memfd_create("layer-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    // No memfd (Linux < 3.17): an unlinked file on the runtime dir's tmpfs
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/layer-shm-XXXXXX", dir ? dir : "/tmp");
+    fd = mkostemp(path, O_CLOEXEC);
+    if (fd < 0)
+      return -1;
+    unlink(path);
+  }
+
+  if (ftruncate(fd, size) < 0) {
+    close(fd);
+    return -1;
+  }
+  // The compositor maps the file too, so it must never shrink under it
+  fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL);
+  return fd;
+}
+
+static void destroy_buffer(ShmBuffer *buf) {
+  if (buf->buffer)
+    wl_buffer_destroy(buf->buffer);
+  if (buf->data)
+    munmap(buf->data, buf->size);
+  buf->buffer = NULL;
+  buf->data = NULL;
+  buf->busy = 0;
+}
+
+static void buffer_release(void *data, struct wl_buffer *buffer) {
+  (void)buffer;
+  ShmBuffer *buf = data;
+  ShmPool *pool = buf->pool;
+  buf->busy = 0;
+  // Left over from before a resize
+  if (buf->width != pool->width || buf->height != pool->height)
+    destroy_buffer(buf);
+  if (pool->release)
+    pool->release(pool->data);
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+    .release = buffer_release,
+};
+
+static int create_buffer(ShmPool *pool, ShmBuffer *buf, int width,
+                         int height) {
+  int stride = width * 4;
+  size_t size = (size_t)stride * height;
+
+  int fd = shm_create_file(size);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to create shm file\n");
+    return -1;
+  }
+  void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Failed to mmap shm file\n");
+    close(fd);
+    return -1;
+  }
+
+  struct wl_shm_pool *shm_pool = wl_shm_create_pool(pool->shm, fd, size);
+  buf->buffer = wl_shm_pool_create_buffer(shm_pool, 0, width, height, stride,
+                                          pool->format);
+  wl_shm_pool_destroy(shm_pool);
+  close(fd);
+  wl_buffer_add_listener(buf->buffer, &buffer_listener, buf);
+
+  buf->pool = pool;
+  buf->data = data;
+  buf->size = size;
+  buf->width = width;
+  buf->height = height;
+  buf->stride = stride;
+  buf->busy = 0;
+  return 0;
+}
+
+void shm_pool_init(ShmPool *pool, struct wl_shm *shm, uint32_t format,
+                   int max_buffers) {
+  memset(pool, 0, sizeof(*pool));
+  pool->shm = shm;
+  pool->format = format;
+  pool->max_buffers = max_buffers < SHM_POOL_MAX ? max_buffers : SHM_POOL_MAX;
+}
+
+ShmBuffer *shm_pool_acquire(ShmPool *pool, int width, int height) {
+  pool->width = width;
+  pool->height = height;
+
+  ShmBuffer *empty = NULL;
+  for (int i = 0; i < pool->max_buffers; i++) {
+    ShmBuffer *buf = &pool->buffers[i];
+    if (buf->buffer && !buf->busy &&
+        (buf->width != width || buf->height != height))
+      destroy_buffer(buf);
+    if (buf->buffer && !buf->busy) {
+      buf->busy = 1;
+      return buf;
+    }
+    if (!buf->buffer && !empty)
+      empty = buf;
+  }
+
+  if (!empty || create_buffer(pool, empty, width, height) < 0)
+    return NULL;
+  empty->busy = 1;
+  return empty;
+}
+
+void shm_pool_finish(ShmPool *pool) {
+  for (int i = 0; i < pool->max_buffers; i++)
+    destroy_buffer(&pool->buffers[i]);
+}
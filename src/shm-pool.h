@@ -0,0 +1,51 @@
+#ifndef LAYER_SHM_POOL_H
+#define LAYER_SHM_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <wayland-client.h>
+
+#define SHM_POOL_MAX 3
+
+struct ShmPool;
+
+// A wl_buffer with its pixels mapped in our address space
+typedef struct {
+  struct ShmPool *pool;
+  struct wl_buffer *buffer;
+  void *data;
+  size_t size;
+  int width, height, stride;
+  int busy; // Handed out and not released by the compositor yet
+} ShmBuffer;
+
+// Up to max_buffers buffers of one size, reused once the compositor
+// releases them
+typedef struct ShmPool {
+  struct wl_shm *shm;
+  uint32_t format;
+  int max_buffers;
+  int width, height; // Size of the last acquire
+  ShmBuffer buffers[SHM_POOL_MAX];
+  void (*release)(void *data); // Optional, called when a buffer frees up
+  void *data;
+} ShmPool;
+
+// Create an anonymous, sealable shared memory file of size bytes. Returns
+// the fd, or -1 on failure.
+int shm_create_file(size_t size);
+
+void shm_pool_init(ShmPool *pool, struct wl_shm *shm, uint32_t format,
+                   int max_buffers);
+
+// Hand out a width x height buffer the compositor is not using, creating
+// it if needed. Its contents are whatever was last drawn into it. The
+// buffer stays busy until the compositor releases it, so it has to be
+// attached and committed. Returns NULL if every buffer is busy or on
+// failure.
+ShmBuffer *shm_pool_acquire(ShmPool *pool, int width, int height);
+
+// Destroy all buffers
+void shm_pool_finish(ShmPool *pool);
+
+#endif
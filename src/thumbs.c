@@ -0,0 +1,330 @@
+#define _GNU_SOURCE // mkostemp
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "thumbs.h"
+
+// Grid thumbnails of imageviewer, one file each of raw pixels that a later
+// run maps as they are. This is not the freedesktop ~/.cache/thumbnails
+// layout: that stores PNGs, and this tree has no PNG encoder, nor would a
+// PNG map straight into a grid.
+#define THUMB_MAGIC 0x48544c59 // "YLTH"
+#define THUMB_VERSION 1
+#define THUMB_TEMP_MAX_AGE 3600 // Seconds before a stray temporary file goes
+
+// Thumbnail Files
+// Every thumbnail is a file of its own under the cache directory, named
+// after a hash of its header and source path and laid out as
+//   ThumbHeader | source path | RGBA pixels
+// It is written to a temporary file and renamed into place, so readers in
+// any process never see a partial one, and read back with a single mmap().
+// The header repeats everything the name was hashed from, so a collision
+// is a miss rather than a wrong picture. The file's mtime is bumped on each
+// use and is what thumb_cache_trim() evicts by.
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint32_t filter;
+  uint32_t path_len; // Including the terminating NUL
+  int64_t source_size;
+  int64_t source_mtime_sec;
+  int64_t source_mtime_nsec;
+} ThumbHeader;
+
+static int get_thumb_dir(char *dir, size_t size) {
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  if (xdg && xdg[0] == '/')
+    snprintf(dir, size, "%s/layer/thumbnails", xdg);
+  else if (home)
+    snprintf(dir, size, "%s/.cache/layer/thumbnails", home);
+  else
+    return -1;
+  return 0;
+}
+
+// Create dir along with any missing parents
+static int make_dirs(char *dir) {
+  if (mkdir(dir, 0755) == 0 || errno == EEXIST)
+    return 0;
+  char *slash = strrchr(dir, '/');
+  if (errno != ENOENT || !slash || slash == dir)
+    return -1;
+  *slash = '\0';
+  int ret = make_dirs(dir);
+  *slash = '/';
+  if (ret < 0)
+    return -1;
+  return mkdir(dir, 0755) == 0 || errno == EEXIST ? 0 : -1;
+}
+
+// FNV-1a, continuing from hash (start with FNV_OFFSET)
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t size) {
+  const unsigned char *bytes = data;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static int get_thumb_path(const ThumbHeader *header, const char *source,
+                          char *out, size_t size) {
+  char dir[PATH_MAX];
+  if (get_thumb_dir(dir, sizeof(dir)) < 0)
+    return -1;
+  uint64_t hash = hash_bytes(FNV_OFFSET, header, sizeof(*header));
+  hash = hash_bytes(hash, source, header->path_len);
+  snprintf(out, size, "%s/%016llx.thm", dir, (unsigned long long)hash);
+  return 0;
+}
+
+static size_t thumb_file_size(const ThumbHeader *header) {
+  return sizeof(*header) + header->path_len +
+         (size_t)header->width * header->height * 4;
+}
+
+// Map the thumbnail file at file if it was made as header describes
+static int map_thumb(const char *file, const ThumbHeader *header,
+                     const char *source, Thumb *thumb) {
+  int fd = open(file, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  size_t size = thumb_file_size(header);
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size == size)
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map != MAP_FAILED &&
+      (memcmp(map, header, sizeof(*header)) != 0 ||
+       memcmp((const char *)map + sizeof(*header), source,
+              header->path_len) != 0)) {
+    munmap(map, size);
+    map = MAP_FAILED;
+  }
+  if (map != MAP_FAILED)
+    futimens(fd, NULL); // Most recently used now
+  close(fd);
+  if (map == MAP_FAILED)
+    return -1;
+
+  thumb->pixels = (const unsigned char *)map + sizeof(*header) +
+                  header->path_len;
+  thumb->width = header->width;
+  thumb->height = header->height;
+  thumb->map = map;
+  thumb->map_size = size;
+  return 0;
+}
+
+static int write_all(int fd, const void *data, size_t size) {
+  const unsigned char *bytes = data;
+  while (size > 0) {
+    ssize_t n = write(fd, bytes, size);
+    if (n <= 0)
+      return -1;
+    bytes += n;
+    size -= n;
+  }
+  return 0;
+}
+
+static void store_thumb(const char *file, const ThumbHeader *header,
+                        const char *source, const Thumb *thumb) {
+  char dir[PATH_MAX];
+  if (get_thumb_dir(dir, sizeof(dir)) < 0 || make_dirs(dir) < 0)
+    return;
+
+  char tmp_path[PATH_MAX + 48];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", file);
+  int fd = mkostemp(tmp_path, O_CLOEXEC);
+  if (fd < 0)
+    return;
+  int ok = write_all(fd, header, sizeof(*header)) == 0 &&
+           write_all(fd, source, header->path_len) == 0 &&
+           write_all(fd, thumb->pixels,
+                     (size_t)thumb->width * thumb->height * 4) == 0;
+  if (close(fd) < 0 || !ok || rename(tmp_path, file) < 0)
+    unlink(tmp_path);
+}
+
+// Making Thumbnails
+// Source rows with fully transparent pixels on THUMB_BACKGROUND
+typedef struct {
+  ImageReader reader;
+  unsigned char *row;
+} ThumbSource;
+
+static const unsigned char *thumb_source_row(void *data, int y) {
+  ThumbSource *src = data;
+  const unsigned char *rgba = image_reader_row(&src->reader, y);
+  if (!rgba)
+    return NULL;
+  unsigned char *p = src->row;
+  memcpy(p, rgba, (size_t)src->reader.width * 4);
+  for (int x = 0; x < src->reader.width; x++, p += 4) {
+    if (p[3] == 0) {
+      p[0] = (THUMB_BACKGROUND >> 16) & 0xff;
+      p[1] = (THUMB_BACKGROUND >> 8) & 0xff;
+      p[2] = THUMB_BACKGROUND & 0xff;
+      p[3] = 0xff;
+    }
+  }
+  return src->row;
+}
+
+// Decode path and scale it as it is decoded, holding a few rows of it
+static int make_thumb(const char *path, int width, int height,
+                      ScaleFilter filter, Thumb *thumb) {
+  // Thumbnails are small, so JPEGs can be decoded at a fraction of their size
+  ThumbSource src;
+  if (image_reader_open(&src.reader, path, width, height) < 0)
+    return -1;
+
+  unsigned char *pixels = malloc((size_t)width * height * 4);
+  src.row = malloc((size_t)src.reader.width * 4);
+  int ret = -1;
+  if (pixels && src.row)
+    ret = scale_rows(thumb_source_row, &src, src.reader.width,
+                     src.reader.height, pixels, width, height, width * 4,
+                     filter, &scale_rgba8888);
+  free(src.row);
+  image_reader_close(&src.reader);
+  if (ret < 0) {
+    free(pixels);
+    return -1;
+  }
+
+  thumb->pixels = pixels;
+  thumb->width = width;
+  thumb->height = height;
+  thumb->map = NULL;
+  thumb->map_size = 0;
+  return 0;
+}
+
+int thumb_get(const char *path, int width, int height, ScaleFilter filter,
+              int cache, Thumb *thumb) {
+  if (width <= 0 || height <= 0)
+    return -1;
+
+  // Thumbnails are shared by absolute path, across processes
+  char source[PATH_MAX];
+  struct stat st;
+  char file[PATH_MAX + 32];
+  ThumbHeader header = {0};
+  if (cache && (!realpath(path, source) || stat(source, &st) < 0))
+    cache = 0;
+  if (cache) {
+    header = (ThumbHeader){.magic = THUMB_MAGIC,
+                           .version = THUMB_VERSION,
+                           .width = (uint32_t)width,
+                           .height = (uint32_t)height,
+                           .filter = (uint32_t)filter,
+                           .path_len = (uint32_t)strlen(source) + 1,
+                           .source_size = st.st_size,
+                           .source_mtime_sec = st.st_mtim.tv_sec,
+                           .source_mtime_nsec = st.st_mtim.tv_nsec};
+    if (get_thumb_path(&header, source, file, sizeof(file)) < 0)
+      cache = 0;
+  }
+
+  if (cache && map_thumb(file, &header, source, thumb) == 0)
+    return 0;
+  if (make_thumb(path, width, height, filter, thumb) < 0)
+    return -1;
+  if (cache)
+    store_thumb(file, &header, source, thumb);
+  return 0;
+}
+
+void thumb_release(Thumb *thumb) {
+  if (thumb->map)
+    munmap(thumb->map, thumb->map_size);
+  else
+    free((void *)thumb->pixels);
+  thumb->pixels = NULL;
+  thumb->map = NULL;
+}
+
+// Eviction
+typedef struct {
+  char name[24]; // "%016llx.thm"
+  struct timespec used;
+  off_t size;
+} CacheFile;
+
+static int compare_by_use(const void *a, const void *b) {
+  const struct timespec *ta = &((const CacheFile *)a)->used;
+  const struct timespec *tb = &((const CacheFile *)b)->used;
+  if (ta->tv_sec != tb->tv_sec)
+    return ta->tv_sec < tb->tv_sec ? -1 : 1;
+  return (ta->tv_nsec > tb->tv_nsec) - (ta->tv_nsec < tb->tv_nsec);
+}
+
+void thumb_cache_trim(size_t max_bytes) {
+  char dir[PATH_MAX];
+  if (get_thumb_dir(dir, sizeof(dir)) < 0)
+    return;
+  DIR *d = opendir(dir);
+  if (!d)
+    return;
+
+  CacheFile *files = NULL;
+  size_t count = 0, cap = 0;
+  unsigned long long total = 0;
+  time_t now = time(NULL);
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL) {
+    struct stat st;
+    if (e->d_name[0] == '.' || fstatat(dirfd(d), e->d_name, &st, 0) < 0 ||
+        !S_ISREG(st.st_mode))
+      continue;
+    size_t len = strlen(e->d_name);
+    if (len < 4 || strcmp(e->d_name + len - 4, ".thm") != 0) {
+      // Left behind by a writer that died before renaming it
+      if (st.st_mtime < now - THUMB_TEMP_MAX_AGE)
+        unlinkat(dirfd(d), e->d_name, 0);
+      continue;
+    }
+    if (len >= sizeof(files->name))
+      continue;
+    if (count == cap) {
+      size_t new_cap = cap ? cap * 2 : 256;
+      CacheFile *new_files = realloc(files, new_cap * sizeof(*files));
+      if (!new_files)
+        break;
+      files = new_files;
+      cap = new_cap;
+    }
+    memcpy(files[count].name, e->d_name, len + 1);
+    files[count].used = st.st_mtim;
+    files[count].size = st.st_size;
+    count++;
+    total += st.st_size;
+  }
+
+  // Least recently used first
+  if (total > max_bytes) {
+    qsort(files, count, sizeof(*files), compare_by_use);
+    for (size_t i = 0; i < count && total > max_bytes; i++)
+      if (unlinkat(dirfd(d), files[i].name, 0) == 0)
+        total -= files[i].size;
+  }
+  free(files);
+  closedir(d);
+}
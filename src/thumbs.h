@@ -0,0 +1,40 @@
+#ifndef LAYER_THUMBS_H
+#define LAYER_THUMBS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "scale.h"
+
+#define THUMB_WIDTH 400  // Default size, that of an imageviewer grid cell
+#define THUMB_HEIGHT 300
+#define THUMB_BACKGROUND 0xFF202020 // ARGB, for fully transparent pixels
+#define THUMB_CACHE_DEFAULT_MAX ((size_t)256 << 20)
+
+// A thumbnail: width x height RGBA pixels, with fully transparent source
+// pixels replaced by THUMB_BACKGROUND before scaling (partly transparent
+// ones keep their alpha). Either mapped from the cache or, when it could
+// not be stored, held in memory.
+typedef struct {
+  const unsigned char *pixels;
+  int width, height;
+  void *map; // Mapped cache file, NULL if pixels is malloc()ed
+  size_t map_size;
+} Thumb;
+
+// Get the width x height thumbnail of the image at path, scaled with filter
+// to fill it exactly (the aspect ratio is not kept, as in the grid).
+// A thumbnail stored in $XDG_CACHE_HOME/layer/thumbnails/ from the file at
+// its current size and mtime is mapped as it is; otherwise the image is
+// decoded and, if cache is set, the result stored there for the next
+// process that asks. Returns 0 on success, -1 on failure.
+int thumb_get(const char *path, int width, int height, ScaleFilter filter,
+              int cache, Thumb *thumb);
+
+void thumb_release(Thumb *thumb);
+
+// Delete the least recently used thumbnails until the cache takes at most
+// max_bytes. Thumbnails count as used when created or mapped.
+void thumb_cache_trim(size_t max_bytes);
+
+#endif
@@ -0,0 +1,571 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "scale.h"
+#include "shm-pool.h"
+#include "wallpaper-ipc.h"
+#include "wlr-layer-shell-unstable-v1-client-protocol.h"
+#include <wayland-client.h>
+
+// One background surface per output
+typedef struct Output {
+  struct wl_output *wl_output;
+  uint32_t name; // Registry name, used to match global_remove
+  int32_t scale;
+  struct wl_surface *surface;
+  struct zwlr_layer_surface_v1 *layer_surface;
+  int width, height; // Logical size from configure, 0 until then
+  ShmPool pool;      // Double buffered, so a new wallpaper never waits
+  int drawn;         // A buffer has been committed
+  int pending;       // Render again once a buffer is released
+  struct Output *next;
+} Output;
+
+static struct wl_display *display = NULL;
+static struct wl_compositor *compositor = NULL;
+static struct wl_shm *wl_shm = NULL;
+static struct zwlr_layer_shell_v1 *layer_shell = NULL;
+static Output *outputs = NULL;
+
+static char wallpaper_path[WALLPAPER_IPC_MAX_LINE]; // Empty until set
+static char socket_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static volatile sig_atomic_t running = 1;
+
+static void signal_handler(int sig) {
+  (void)sig;
+  running = 0;
+}
+
+// The wallpaper, decoded once per change at the size of the largest output
+// and scaled from there for each one. It keeps the aspect ratio of the file,
+// so every output crops it on its own.
+static Image wallpaper = {0};
+static int source_width, source_height; // Size of the file
+
+// Scale factor from the file that output needs to be drawn sharply; never
+// above 1, since upscaling the decoded copy gains nothing
+static double output_scale_needed(const Output *output) {
+  double sx = (double)output->width * output->scale / source_width;
+  double sy = (double)output->height * output->scale / source_height;
+  double s = sx > sy ? sx : sy;
+  return s < 1.0 ? s : 1.0;
+}
+
+// Decode the wallpaper at the size the largest configured output needs,
+// streaming the file so only the scaled copy is ever held whole. Returns -1
+// if it can't be decoded.
+static int decode_wallpaper() {
+  double s = 0;
+  for (Output *output = outputs; output; output = output->next) {
+    if (!output->surface || output->width <= 0 || output->height <= 0)
+      continue;
+    double needed = output_scale_needed(output);
+    if (needed > s)
+      s = needed;
+  }
+  if (s <= 0)
+    return 0; // Nothing to draw on yet
+
+  int width = (int)(source_width * s + 0.5);
+  int height = (int)(source_height * s + 0.5);
+  if (width < 1)
+    width = 1;
+  if (height < 1)
+    height = 1;
+  if (wallpaper.data && wallpaper.width >= width && wallpaper.height >= height)
+    return 0;
+
+  image_free(&wallpaper);
+  unsigned char *data = malloc((size_t)width * height * 4);
+  if (!data)
+    return -1;
+  // Wallpapers are scaled once per change, so take the sharpest filter
+  ImageReader reader;
+  int ret = image_reader_open(&reader, wallpaper_path, width, height);
+  if (ret == 0) {
+    ret = scale_reader(&reader, 0, 0, reader.width, reader.height, data,
+                       width, height, width * 4, SCALE_LANCZOS,
+                       &scale_rgba8888);
+    image_reader_close(&reader);
+  }
+  if (ret < 0) {
+    free(data);
+    return -1;
+  }
+  wallpaper.data = data;
+  wallpaper.width = width;
+  wallpaper.height = height;
+  return 0;
+}
+
+// Draw the wallpaper into a buffer of the output. Returns 1 once a buffer is
+// attached, 0 if there is nothing to draw on yet and -1 if it can't be
+// decoded, leaving what is on screen.
+static int render_output(Output *output) {
+  if (!wallpaper_path[0] || !output->surface || output->width <= 0 ||
+      output->height <= 0)
+    return 0;
+
+  int width = output->width * output->scale;
+  int height = output->height * output->scale;
+
+  // Both buffers still in use: try again once one is released
+  ShmBuffer *buf = shm_pool_acquire(&output->pool, width, height);
+  output->pending = !buf;
+  if (!buf)
+    return 0;
+
+  // Only decodes again if this output is larger than any seen so far
+  int ret = decode_wallpaper();
+  if (ret == 0)
+    ret = scale_image_cover(&wallpaper, buf->data, width, height, buf->stride,
+                            SCALE_LANCZOS, &scale_xrgb8888);
+  if (ret < 0) {
+    fprintf(stderr, "Failed to draw %s\n", wallpaper_path);
+    buf->busy = 0; // Never attached, so no release will come
+    return -1;
+  }
+  wl_surface_set_buffer_scale(output->surface, output->scale);
+  wl_surface_attach(output->surface, buf->buffer, 0, 0);
+  wl_surface_damage_buffer(output->surface, 0, 0, width, height);
+  wl_surface_commit(output->surface);
+  output->drawn = 1;
+  return 1;
+}
+
+static void output_buffer_released(void *data) {
+  Output *output = data;
+  if (output->pending)
+    render_output(output);
+}
+
+// Layer surface handlers
+static void layer_surface_configure(void *data,
+                                    struct zwlr_layer_surface_v1 *surface,
+                                    uint32_t serial, uint32_t width,
+                                    uint32_t height) {
+  Output *output = data;
+  zwlr_layer_surface_v1_ack_configure(surface, serial);
+
+  if ((int)width == output->width && (int)height == output->height &&
+      output->drawn)
+    return;
+  output->width = width;
+  output->height = height;
+  render_output(output);
+}
+
+static void destroy_surface(Output *output) {
+  if (output->layer_surface)
+    zwlr_layer_surface_v1_destroy(output->layer_surface);
+  if (output->surface)
+    wl_surface_destroy(output->surface);
+  shm_pool_finish(&output->pool);
+  output->layer_surface = NULL;
+  output->surface = NULL;
+  output->drawn = output->pending = 0;
+  output->width = output->height = 0;
+}
+
+static void layer_surface_closed(void *data,
+                                 struct zwlr_layer_surface_v1 *surface) {
+  (void)surface;
+  destroy_surface(data);
+}
+
+static const struct zwlr_layer_surface_v1_listener layer_surface_listener = {
+    .configure = layer_surface_configure,
+    .closed = layer_surface_closed,
+};
+
+static void create_surface(Output *output) {
+  if (output->surface || !compositor || !wl_shm || !layer_shell)
+    return;
+
+  shm_pool_init(&output->pool, wl_shm, WL_SHM_FORMAT_XRGB8888, 2);
+  output->pool.release = output_buffer_released;
+  output->pool.data = output;
+
+  output->surface = wl_compositor_create_surface(compositor);
+  output->layer_surface = zwlr_layer_shell_v1_get_layer_surface(
+      layer_shell, output->surface, output->wl_output,
+      ZWLR_LAYER_SHELL_V1_LAYER_BACKGROUND, "wallpaper");
+
+  // Cover the whole output and stay put under exclusive zones (panels)
+  zwlr_layer_surface_v1_set_size(output->layer_surface, 0, 0);
+  zwlr_layer_surface_v1_set_anchor(output->layer_surface,
+                                   ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP |
+                                       ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM |
+                                       ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT |
+                                       ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT);
+  zwlr_layer_surface_v1_set_exclusive_zone(output->layer_surface, -1);
+  zwlr_layer_surface_v1_add_listener(output->layer_surface,
+                                     &layer_surface_listener, output);
+
+  // Fully opaque, so the compositor can skip whatever is behind it
+  struct wl_region *region = wl_compositor_create_region(compositor);
+  wl_region_add(region, 0, 0, INT32_MAX, INT32_MAX);
+  wl_surface_set_opaque_region(output->surface, region);
+  wl_region_destroy(region);
+
+  wl_surface_commit(output->surface);
+}
+
+// Output handlers
+static void output_geometry(void *data, struct wl_output *wl_output, int32_t x,
+                            int32_t y, int32_t physical_width,
+                            int32_t physical_height, int32_t subpixel,
+                            const char *make, const char *model,
+                            int32_t transform) {
+  (void)data;
+  (void)wl_output;
+  (void)x;
+  (void)y;
+  (void)physical_width;
+  (void)physical_height;
+  (void)subpixel;
+  (void)make;
+  (void)model;
+  (void)transform;
+}
+
+static void output_mode(void *data, struct wl_output *wl_output, uint32_t flags,
+                        int32_t width, int32_t height, int32_t refresh) {
+  (void)data;
+  (void)wl_output;
+  (void)flags;
+  (void)width;
+  (void)height;
+  (void)refresh;
+}
+
+static void output_done(void *data, struct wl_output *wl_output) {
+  (void)data;
+  (void)wl_output;
+}
+
+static void output_scale(void *data, struct wl_output *wl_output,
+                         int32_t factor) {
+  (void)wl_output;
+  Output *output = data;
+  if (factor < 1 || factor == output->scale)
+    return;
+  output->scale = factor;
+  render_output(output);
+}
+
+static const struct wl_output_listener output_listener = {
+    .geometry = output_geometry,
+    .mode = output_mode,
+    .done = output_done,
+    .scale = output_scale,
+};
+
+static void destroy_output(Output *output) {
+  destroy_surface(output);
+  wl_output_destroy(output->wl_output);
+  free(output);
+}
+
+// Wayland registry handlers
+static void registry_global(void *data, struct wl_registry *registry,
+                            uint32_t name, const char *interface,
+                            uint32_t version) {
+  (void)data;
+
+  if (strcmp(interface, wl_compositor_interface.name) == 0) {
+    compositor = wl_registry_bind(registry, name, &wl_compositor_interface, 4);
+  } else if (strcmp(interface, wl_shm_interface.name) == 0) {
+    wl_shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
+  } else if (strcmp(interface, zwlr_layer_shell_v1_interface.name) == 0) {
+    layer_shell =
+        wl_registry_bind(registry, name, &zwlr_layer_shell_v1_interface, 1);
+  } else if (strcmp(interface, wl_output_interface.name) == 0) {
+    Output *output = calloc(1, sizeof(*output));
+    if (!output)
+      return;
+    output->name = name;
+    output->scale = 1;
+    output->wl_output = wl_registry_bind(registry, name, &wl_output_interface,
+                                         version < 2 ? version : 2);
+    wl_output_add_listener(output->wl_output, &output_listener, output);
+    output->next = outputs;
+    outputs = output;
+    create_surface(output); // No-op during the initial roundtrip
+  }
+}
+
+static void registry_global_remove(void *data, struct wl_registry *registry,
+                                   uint32_t name) {
+  (void)data;
+  (void)registry;
+
+  for (Output **link = &outputs; *link; link = &(*link)->next) {
+    if ((*link)->name == name) {
+      Output *output = *link;
+      *link = output->next;
+      destroy_output(output);
+      return;
+    }
+  }
+}
+
+static const struct wl_registry_listener registry_listener = {
+    .global = registry_global,
+    .global_remove = registry_global_remove,
+};
+
+// Wallpaper
+// The file is decoded once, for all outputs. Returns 0 once it is drawn on
+// at least one of them, -1 if it can't be decoded and -2 if no output is
+// configured to draw on. On failure the previous wallpaper is kept.
+static int set_wallpaper(const char *path) {
+  int width, height;
+  if (image_info(path, &width, &height) < 0 || width <= 0 || height <= 0) {
+    fprintf(stderr, "Not an image: %s\n", path);
+    return -1;
+  }
+
+  char previous[sizeof(wallpaper_path)];
+  int previous_width = source_width, previous_height = source_height;
+  memcpy(previous, wallpaper_path, sizeof(previous));
+  snprintf(wallpaper_path, sizeof(wallpaper_path), "%s", path);
+  source_width = width;
+  source_height = height;
+  image_free(&wallpaper);
+
+  // Decoded up front, so that outputs waiting for a buffer don't hide a file
+  // that is broken past its header
+  int ret = decode_wallpaper() < 0 ? -1 : -2;
+  if (ret == -2) {
+    for (Output *output = outputs; output; output = output->next) {
+      int drawn = render_output(output);
+      if (drawn < 0) {
+        ret = -1;
+        break;
+      }
+      if (drawn > 0 || output->pending)
+        ret = 0;
+    }
+  }
+  if (ret < 0) {
+    memcpy(wallpaper_path, previous, sizeof(wallpaper_path));
+    source_width = previous_width;
+    source_height = previous_height;
+    image_free(&wallpaper); // Decoded again on the next draw
+  }
+  return ret;
+}
+
+// IPC
+static int open_socket() {
+  if (wallpaper_ipc_path(socket_path, sizeof(socket_path)) < 0) {
+    fprintf(stderr, "XDG_RUNTIME_DIR is not set or too long\n");
+    return -1;
+  }
+
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  strcpy(addr.sun_path, socket_path);
+
+  // A socket file that still accepts connections belongs to a live daemon
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+    fprintf(stderr, "wallpaper-daemon is already running on %s\n",
+            socket_path);
+    close(fd);
+    socket_path[0] = '\0';
+    return -1;
+  }
+  close(fd);
+  unlink(socket_path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(fd, 8) < 0) {
+    perror(socket_path);
+    close(fd);
+    socket_path[0] = '\0';
+    return -1;
+  }
+  return fd;
+}
+
+static void reply(int fd, const char *msg) {
+  size_t len = strlen(msg);
+  while (len > 0) {
+    ssize_t ret = write(fd, msg, len);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return;
+    msg += ret;
+    len -= ret;
+  }
+}
+
+// Serve one request per connection
+static void handle_client(int listen_fd) {
+  int fd = accept(listen_fd, NULL, NULL);
+  if (fd < 0)
+    return;
+
+  // Don't let a stuck client freeze the wallpaper
+  struct timeval timeout = {.tv_sec = 1};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  char line[WALLPAPER_IPC_MAX_LINE];
+  size_t len = 0;
+  while (len < sizeof(line) - 1) {
+    ssize_t ret = read(fd, line + len, sizeof(line) - 1 - len);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      break;
+    len += ret;
+    if (memchr(line, '\n', len))
+      break;
+  }
+  line[len] = '\0';
+  line[strcspn(line, "\n")] = '\0';
+
+  if (strncmp(line, "set ", 4) == 0) {
+    int ret = set_wallpaper(line + 4);
+    if (ret == 0)
+      reply(fd, "ok\n");
+    else if (ret == -2)
+      reply(fd, "error no output to draw on\n");
+    else
+      reply(fd, "error cannot load image\n");
+  } else if (strcmp(line, "quit") == 0) {
+    running = 0;
+    reply(fd, "ok\n");
+  } else {
+    reply(fd, "error unknown command\n");
+  }
+  close(fd);
+}
+
+static void print_usage(const char *prog) {
+  printf("Wallpaper Daemon - Draw a wallpaper on every output\n");
+  printf("Usage: %s [image]\n", prog);
+  printf("Change the image at runtime with layer (setter \"builtin\").\n");
+}
+
+static void cleanup(int listen_fd) {
+  if (listen_fd >= 0)
+    close(listen_fd);
+  if (socket_path[0])
+    unlink(socket_path);
+
+  while (outputs) {
+    Output *output = outputs;
+    outputs = output->next;
+    destroy_output(output);
+  }
+  image_free(&wallpaper);
+  if (display)
+    wl_display_disconnect(display);
+}
+
+int main(int argc, char *argv[]) {
+  const char *initial = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+      print_usage(argv[0]);
+      return 0;
+    }
+    initial = argv[i];
+  }
+
+  struct sigaction sa;
+  sa.sa_handler = signal_handler;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = 0;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN); // Clients may hang up before the reply
+
+  display = wl_display_connect(NULL);
+  if (!display) {
+    fprintf(stderr, "Failed to connect to Wayland display\n");
+    return 1;
+  }
+
+  struct wl_registry *registry = wl_display_get_registry(display);
+  wl_registry_add_listener(registry, &registry_listener, NULL);
+  wl_display_roundtrip(display);
+
+  if (!compositor || !wl_shm || !layer_shell) {
+    fprintf(stderr, "Compositor does not support wlr-layer-shell\n");
+    cleanup(-1);
+    return 1;
+  }
+
+  int listen_fd = open_socket();
+  if (listen_fd < 0) {
+    cleanup(-1);
+    return 1;
+  }
+
+  // Draw only once the surfaces are configured, so that a failure is seen
+  // here and not just after the header was read
+  for (Output *output = outputs; output; output = output->next)
+    create_surface(output);
+  wl_display_roundtrip(display);
+  if (initial && set_wallpaper(initial) < 0)
+    fprintf(stderr, "Starting without a wallpaper\n");
+
+  struct pollfd fds[2] = {
+      {.fd = wl_display_get_fd(display), .events = POLLIN},
+      {.fd = listen_fd, .events = POLLIN},
+  };
+
+  while (running) {
+    while (wl_display_prepare_read(display) != 0)
+      wl_display_dispatch_pending(display);
+    wl_display_flush(display);
+
+    if (poll(fds, 2, -1) < 0) {
+      wl_display_cancel_read(display);
+      if (errno == EINTR)
+        continue;
+      perror("poll");
+      break;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      if (wl_display_read_events(display) < 0)
+        break;
+    } else {
+      wl_display_cancel_read(display);
+    }
+    if (fds[0].revents & (POLLERR | POLLHUP))
+      break;
+    if (wl_display_dispatch_pending(display) < 0)
+      break;
+
+    if (fds[1].revents & POLLIN)
+      handle_client(listen_fd);
+  }
+
+  cleanup(listen_fd);
+  return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef LAYER_WALLPAPER_IPC_H
+#define LAYER_WALLPAPER_IPC_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// wallpaper-daemon listens on a unix stream socket in $XDG_RUNTIME_DIR, one
+// per Wayland display. A client connects, sends a single line and reads a
+// single line back:
+//
+//   set <absolute path>\n  ->  ok\n | error <reason>\n
+//   quit\n                 ->  ok\n
+//
+// ok to a set comes only once the image is drawn on an output, so a client
+// may stop other wallpaper setters then.
+#define WALLPAPER_IPC_NAME "layer-wallpaper"
+#define WALLPAPER_IPC_MAX_LINE 4200
+
+static inline int wallpaper_ipc_path(char *buf, size_t len) {
+  const char *dir = getenv("XDG_RUNTIME_DIR");
+  const char *display = getenv("WAYLAND_DISPLAY");
+  if (!dir || !dir[0])
+    return -1;
+  if (!display || !display[0])
+    display = "wayland-0";
+  const char *slash = strrchr(display, '/'); // WAYLAND_DISPLAY may be a path
+  if (slash)
+    display = slash + 1;
+
+  int ret = snprintf(buf, len, "%s/%s-%s.sock", dir, WALLPAPER_IPC_NAME,
+                     display);
+  return ret < 0 || (size_t)ret >= len ? -1 : 0;
+}
+
+#endif
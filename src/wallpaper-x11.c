@@ -0,0 +1,225 @@
+#include <X11/Xatom.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <stdlib.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include "image.h"
+#include "scale.h"
+#include "wallpaper-x11.h"
+
+// The wallpaper is drawn into a pixmap that outlives our connection
+// (RetainPermanent) and published through _XROOTPMAP_ID/ESETROOT_PMAP_ID, the
+// same convention feh, hsetroot and Esetroot use, so compositors and
+// pseudo-transparent terminals pick it up.
+
+static int shm_error = 0;
+
+// Decode path and scale it over all of xim, in the channel order of format.
+// Rows go straight into xim as they are decoded, so the file is never held
+// at full size. Wallpapers are scaled once per change, so take the sharpest
+// filter.
+static int fill_ximage(XImage *xim, const char *path,
+                       const ScaleFormat *format) {
+  if (xim->bits_per_pixel != 32)
+    return -1;
+  ImageReader reader;
+  if (image_reader_open(&reader, path, xim->width, xim->height) < 0)
+    return -1;
+  int ret = scale_reader_cover(&reader, xim->data, xim->width, xim->height,
+                               xim->bytes_per_line, SCALE_LANCZOS, format);
+  image_reader_close(&reader);
+  return ret;
+}
+
+static int shm_error_handler(Display *dpy, XErrorEvent *event) {
+  (void)dpy;
+  (void)event;
+  shm_error = 1;
+  return 0;
+}
+
+// Upload the scaled image through a shared memory segment, which saves a
+// copy of the whole screen through the X socket. Fails on remote displays.
+static int put_image_shm(Display *dpy, Visual *visual, int depth,
+                         Pixmap pixmap, GC gc, const char *path,
+                         const ScaleFormat *format, int width, int height) {
+  XShmSegmentInfo shminfo;
+  XImage *xim = XShmCreateImage(dpy, visual, depth, ZPixmap, NULL, &shminfo,
+                                width, height);
+  if (!xim)
+    return -1;
+  if (xim->bits_per_pixel != 32) {
+    XDestroyImage(xim);
+    return -1;
+  }
+
+  shminfo.shmid =
+      shmget(IPC_PRIVATE, (size_t)xim->bytes_per_line * height, IPC_CREAT | 0600);
+  if (shminfo.shmid < 0) {
+    XDestroyImage(xim);
+    return -1;
+  }
+  shminfo.shmaddr = xim->data = shmat(shminfo.shmid, NULL, 0);
+  if (shminfo.shmaddr == (char *)-1) {
+    shmctl(shminfo.shmid, IPC_RMID, NULL);
+    XDestroyImage(xim);
+    return -1;
+  }
+  shminfo.readOnly = True;
+
+  shm_error = 0;
+  XErrorHandler old_handler = XSetErrorHandler(shm_error_handler);
+  XShmAttach(dpy, &shminfo);
+  XSync(dpy, False);
+  XSetErrorHandler(old_handler);
+  shmctl(shminfo.shmid, IPC_RMID, NULL); // Freed once both sides detach
+  if (shm_error) {
+    shmdt(shminfo.shmaddr);
+    xim->data = NULL;
+    XDestroyImage(xim);
+    return -1;
+  }
+
+  int ret = fill_ximage(xim, path, format);
+  if (ret == 0) {
+    XShmPutImage(dpy, pixmap, gc, xim, 0, 0, 0, 0, width, height, False);
+    XSync(dpy, False);
+  }
+
+  XShmDetach(dpy, &shminfo);
+  shmdt(shminfo.shmaddr);
+  xim->data = NULL;
+  XDestroyImage(xim);
+  return ret;
+}
+
+static int put_image(Display *dpy, Visual *visual, int depth, Pixmap pixmap,
+                     GC gc, const char *path, const ScaleFormat *format,
+                     int width, int height) {
+  XImage *xim = XCreateImage(dpy, visual, depth, ZPixmap, 0, NULL, width,
+                             height, 32, 0);
+  if (!xim)
+    return -1;
+  if (xim->bits_per_pixel != 32) {
+    XDestroyImage(xim);
+    return -1;
+  }
+  xim->data = malloc((size_t)xim->bytes_per_line * height);
+  if (!xim->data) {
+    XDestroyImage(xim);
+    return -1;
+  }
+
+  int ret = fill_ximage(xim, path, format);
+  if (ret == 0)
+    XPutImage(dpy, pixmap, gc, xim, 0, 0, 0, 0, width, height);
+  XDestroyImage(xim); // Frees data too
+  return ret;
+}
+
+// Free the pixmap of the previous wallpaper by killing the (already closed)
+// client that retained it
+static void kill_old_pixmap(Display *dpy, Window root, Atom prop_root,
+                            Atom prop_esetroot) {
+  Atom type;
+  int format;
+  unsigned long items, after;
+  unsigned char *data_root = NULL, *data_esetroot = NULL;
+
+  if (XGetWindowProperty(dpy, root, prop_root, 0, 1, False, AnyPropertyType,
+                         &type, &format, &items, &after,
+                         &data_root) == Success &&
+      type == XA_PIXMAP && items == 1 &&
+      XGetWindowProperty(dpy, root, prop_esetroot, 0, 1, False,
+                         AnyPropertyType, &type, &format, &items, &after,
+                         &data_esetroot) == Success &&
+      type == XA_PIXMAP && items == 1 &&
+      *(Pixmap *)data_root == *(Pixmap *)data_esetroot) {
+    XKillClient(dpy, *(Pixmap *)data_root);
+  }
+
+  if (data_root)
+    XFree(data_root);
+  if (data_esetroot)
+    XFree(data_esetroot);
+}
+
+int x11_set_wallpaper(const char *path) {
+  Display *dpy = XOpenDisplay(NULL);
+  if (!dpy)
+    return X11_WALLPAPER_NO_DISPLAY;
+
+  int screen = DefaultScreen(dpy);
+  Window root = RootWindow(dpy, screen);
+  Visual *visual = DefaultVisual(dpy, screen);
+  int depth = DefaultDepth(dpy, screen);
+  int width = DisplayWidth(dpy, screen);
+  int height = DisplayHeight(dpy, screen);
+
+  // Pixels are written in the visual's channel order, one byte each
+  ScaleFormat format;
+  if ((depth != 24 && depth != 32) ||
+      scale_format_from_masks(visual->red_mask, visual->green_mask,
+                              visual->blue_mask,
+                              ImageByteOrder(dpy) == LSBFirst, &format) < 0) {
+    XCloseDisplay(dpy);
+    return X11_WALLPAPER_BAD_VISUAL;
+  }
+
+  // Decoded later, straight into the upload buffer
+  int image_width, image_height;
+  if (image_info(path, &image_width, &image_height) < 0) {
+    XCloseDisplay(dpy);
+    return X11_WALLPAPER_NOT_IMAGE;
+  }
+
+  Pixmap pixmap = XCreatePixmap(dpy, root, width, height, depth);
+  GC gc = XCreateGC(dpy, pixmap, 0, NULL);
+
+  int ret = -1;
+  if (XShmQueryExtension(dpy))
+    ret = put_image_shm(dpy, visual, depth, pixmap, gc, path, &format, width,
+                        height);
+  if (ret < 0)
+    ret = put_image(dpy, visual, depth, pixmap, gc, path, &format, width,
+                    height);
+  XFreeGC(dpy, gc);
+
+  if (ret < 0) {
+    XFreePixmap(dpy, pixmap);
+    XCloseDisplay(dpy);
+    return X11_WALLPAPER_DRAW_FAILED;
+  }
+
+  Atom prop_root = XInternAtom(dpy, "_XROOTPMAP_ID", False);
+  Atom prop_esetroot = XInternAtom(dpy, "ESETROOT_PMAP_ID", False);
+  kill_old_pixmap(dpy, root, prop_root, prop_esetroot);
+
+  XChangeProperty(dpy, root, prop_root, XA_PIXMAP, 32, PropModeReplace,
+                  (unsigned char *)&pixmap, 1);
+  XChangeProperty(dpy, root, prop_esetroot, XA_PIXMAP, 32, PropModeReplace,
+                  (unsigned char *)&pixmap, 1);
+  XSetWindowBackgroundPixmap(dpy, root, pixmap);
+  XClearWindow(dpy, root);
+
+  XSetCloseDownMode(dpy, RetainPermanent);
+  XCloseDisplay(dpy);
+  return X11_WALLPAPER_OK;
+}
+
+const char *x11_wallpaper_error(int ret) {
+  switch (ret) {
+  case X11_WALLPAPER_NO_DISPLAY:
+    return "cannot open X display";
+  case X11_WALLPAPER_BAD_VISUAL:
+    return "unsupported X visual";
+  case X11_WALLPAPER_NOT_IMAGE:
+    return "not an image";
+  case X11_WALLPAPER_DRAW_FAILED:
+    return "cannot draw on the X server";
+  }
+  return NULL;
+}
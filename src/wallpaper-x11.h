@@ -0,0 +1,22 @@
+#ifndef LAYER_WALLPAPER_X11_H
+#define LAYER_WALLPAPER_X11_H
+
+// Results of x11_set_wallpaper()
+enum {
+  X11_WALLPAPER_OK = 0,
+  X11_WALLPAPER_NO_DISPLAY = -1,
+  X11_WALLPAPER_BAD_VISUAL = -2,
+  X11_WALLPAPER_NOT_IMAGE = -3,
+  X11_WALLPAPER_DRAW_FAILED = -4,
+};
+
+// Decode path, scale it over the root window and make it the X11 desktop
+// background. Opens a display connection of its own, so it may run on any
+// thread. Returns X11_WALLPAPER_OK or one of the negative results above; it
+// prints nothing, the caller reports them.
+int x11_set_wallpaper(const char *path);
+
+// Short description of a negative result of x11_set_wallpaper()
+const char *x11_wallpaper_error(int ret);
+
+#endif